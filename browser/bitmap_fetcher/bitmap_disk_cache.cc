@@ -0,0 +1,411 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/containers/mru_cache.h"
+#include "base/files/file.h"
+#include "base/files/file_enumerator.h"
+#include "base/files/file_util.h"
+#include "base/files/memory_mapped_file.h"
+#include "base/sequenced_task_runner.h"
+#include "base/sha1.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/task_runner_util.h"
+#include "base/time/clock.h"
+#include "base/time/default_clock.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+
+namespace {
+
+const uint32_t kFileMagic = 0x43444642;  // "BFDC"
+const uint32_t kFileVersion = 1;
+
+// Pixels start at a multiple of this offset within the file, so that they can
+// be copied out of a mapping of the file with aligned reads.
+const size_t kPixelAlignment = 16;
+
+// Each file starts with this header, followed by the key, the validator and,
+// at |pixel_offset|, the N32 premultiplied pixels.
+struct FileHeader {
+  uint32_t magic;
+  uint32_t version;
+
+  // The internal value of the time the image was last confirmed by the
+  // network. Updated in place when the image is stored again unchanged.
+  int64_t confirmed_time;
+
+  int32_t width;
+  int32_t height;
+  uint32_t row_bytes;
+  uint32_t key_length;
+  uint32_t validator_length;
+  uint32_t pixel_offset;
+};
+
+static_assert(sizeof(FileHeader) == 40, "FileHeader must not have padding");
+
+std::string GetFileName(const std::string& key) {
+  std::string hash = base::SHA1HashString(key);
+  return base::HexEncode(hash.data(), hash.size());
+}
+
+// Reads the header at the start of |data| and checks that it describes an
+// image for |key| which lies entirely within |length| bytes.
+bool ReadHeader(const uint8_t* data,
+                size_t length,
+                const std::string& key,
+                FileHeader* header) {
+  if (length < sizeof(FileHeader))
+    return false;
+  memcpy(header, data, sizeof(FileHeader));
+
+  if (header->magic != kFileMagic || header->version != kFileVersion)
+    return false;
+  if (header->width <= 0 || header->height <= 0)
+    return false;
+  if (header->row_bytes < static_cast<uint64_t>(header->width) * 4)
+    return false;
+  if (header->pixel_offset % kPixelAlignment != 0)
+    return false;
+
+  uint64_t strings_end = static_cast<uint64_t>(sizeof(FileHeader)) +
+                         header->key_length + header->validator_length;
+  uint64_t pixels_end = static_cast<uint64_t>(header->pixel_offset) +
+                        static_cast<uint64_t>(header->row_bytes) *
+                            header->height;
+  if (strings_end > header->pixel_offset || pixels_end > length)
+    return false;
+
+  // Guard against hash collisions.
+  return header->key_length == key.size() &&
+         memcmp(data + sizeof(FileHeader), key.data(), key.size()) == 0;
+}
+
+}  // namespace
+
+class BitmapDiskCache::Backend {
+ public:
+  Backend(const base::FilePath& directory,
+          size_t max_bytes,
+          base::TimeDelta max_age);
+  ~Backend();
+
+  std::unique_ptr<SkBitmap> Load(const std::string& key);
+  void Store(const std::string& key,
+             const std::string& validator,
+             const SkBitmap& bitmap);
+
+  void SetClock(std::unique_ptr<base::Clock> clock);
+
+ private:
+  // Builds the index of the files in |directory_| on first use, ordered by
+  // their modification time, which is updated whenever a file is used.
+  void EnsureInitialized();
+
+  // Updates the confirmed time of the file for |key| if it already holds an
+  // image of the same dimensions with the same non-empty |validator|.
+  bool RefreshIfUnchanged(const base::FilePath& path,
+                          const std::string& key,
+                          const std::string& validator,
+                          const SkBitmap& bitmap);
+
+  // Records that |name| was just used.
+  void Touch(const std::string& name);
+
+  // Deletes the file |name| and drops it from the index.
+  void Remove(const std::string& name);
+
+  // Deletes the least recently used files until |total_bytes_| fits within
+  // |max_bytes_|.
+  void Trim();
+
+  base::FilePath GetPath(const std::string& name) const {
+    return directory_.AppendASCII(name);
+  }
+
+  const base::FilePath directory_;
+  const size_t max_bytes_;
+  const base::TimeDelta max_age_;
+  std::unique_ptr<base::Clock> clock_;
+
+  bool initialized_;
+
+  // Size of each file, by name, in the order in which they were used.
+  base::MRUCache<std::string, size_t> files_;
+  size_t total_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(Backend);
+};
+
+BitmapDiskCache::Backend::Backend(const base::FilePath& directory,
+                                  size_t max_bytes,
+                                  base::TimeDelta max_age)
+    : directory_(directory),
+      max_bytes_(max_bytes),
+      max_age_(max_age),
+      clock_(new base::DefaultClock),
+      initialized_(false),
+      files_(base::MRUCache<std::string, size_t>::NO_AUTO_EVICT),
+      total_bytes_(0) {}
+
+BitmapDiskCache::Backend::~Backend() {}
+
+std::unique_ptr<SkBitmap> BitmapDiskCache::Backend::Load(
+    const std::string& key) {
+  EnsureInitialized();
+
+  std::string name = GetFileName(key);
+  if (files_.Peek(name) == files_.end())
+    return nullptr;
+
+  base::MemoryMappedFile file;
+  FileHeader header;
+  if (!file.Initialize(GetPath(name)) ||
+      !ReadHeader(file.data(), file.length(), key, &header)) {
+    Remove(name);
+    return nullptr;
+  }
+
+  // Stale images are left in place; if the network still serves the same
+  // validator, storing it again only refreshes the confirmed time.
+  base::Time confirmed_time =
+      base::Time::FromInternalValue(header.confirmed_time);
+  if (clock_->Now() - confirmed_time > max_age_)
+    return nullptr;
+
+  // The pixels are copied out rather than handed out in the mapping, so that
+  // the file can be replaced or deleted while the image is in use, which
+  // Windows does not allow for mapped files.
+  std::unique_ptr<SkBitmap> bitmap(new SkBitmap);
+  if (!bitmap->tryAllocN32Pixels(header.width, header.height))
+    return nullptr;
+  const uint8_t* pixels = file.data() + header.pixel_offset;
+  for (int y = 0; y < header.height; ++y) {
+    memcpy(bitmap->getAddr32(0, y), pixels + y * header.row_bytes,
+           header.width * 4);
+  }
+  bitmap->setImmutable();
+
+  Touch(name);
+  return bitmap;
+}
+
+void BitmapDiskCache::Backend::Store(const std::string& key,
+                                     const std::string& validator,
+                                     const SkBitmap& bitmap) {
+  if (bitmap.colorType() != kN32_SkColorType ||
+      bitmap.alphaType() != kPremul_SkAlphaType || !bitmap.getPixels()) {
+    return;
+  }
+
+  EnsureInitialized();
+
+  std::string name = GetFileName(key);
+  base::FilePath path = GetPath(name);
+  if (files_.Peek(name) != files_.end() &&
+      RefreshIfUnchanged(path, key, validator, bitmap)) {
+    Touch(name);
+    return;
+  }
+
+  FileHeader header = {};
+  header.magic = kFileMagic;
+  header.version = kFileVersion;
+  header.confirmed_time = clock_->Now().ToInternalValue();
+  header.width = bitmap.width();
+  header.height = bitmap.height();
+  header.row_bytes = bitmap.width() * 4;
+  header.key_length = key.size();
+  header.validator_length = validator.size();
+  size_t strings_end =
+      sizeof(FileHeader) + header.key_length + header.validator_length;
+  header.pixel_offset =
+      (strings_end + kPixelAlignment - 1) / kPixelAlignment * kPixelAlignment;
+
+  size_t file_size =
+      header.pixel_offset + static_cast<size_t>(header.row_bytes) *
+                                header.height;
+  if (file_size > max_bytes_)
+    return;
+
+  std::string data(file_size, '\0');
+  memcpy(&data[0], &header, sizeof(FileHeader));
+  memcpy(&data[sizeof(FileHeader)], key.data(), header.key_length);
+  memcpy(&data[sizeof(FileHeader) + header.key_length], validator.data(),
+         header.validator_length);
+  for (int y = 0; y < bitmap.height(); ++y) {
+    memcpy(&data[header.pixel_offset + y * header.row_bytes],
+           bitmap.getAddr32(0, y), header.row_bytes);
+  }
+
+  // The image is written to a temporary file which then replaces the old one,
+  // so that a failed write does not leave a truncated image behind.
+  base::FilePath temp_path;
+  if (!base::CreateDirectory(directory_) ||
+      !base::CreateTemporaryFileInDir(directory_, &temp_path)) {
+    return;
+  }
+  if (base::WriteFile(temp_path, data.data(), data.size()) !=
+          static_cast<int>(data.size()) ||
+      !base::Move(temp_path, path)) {
+    base::DeleteFile(temp_path, false /* recursive */);
+    return;
+  }
+
+  auto iter = files_.Peek(name);
+  if (iter != files_.end()) {
+    total_bytes_ -= iter->second;
+    files_.Erase(iter);
+  }
+  files_.Put(name, file_size);
+  total_bytes_ += file_size;
+  Touch(name);
+  Trim();
+}
+
+void BitmapDiskCache::Backend::SetClock(std::unique_ptr<base::Clock> clock) {
+  clock_ = std::move(clock);
+}
+
+void BitmapDiskCache::Backend::EnsureInitialized() {
+  if (initialized_)
+    return;
+  initialized_ = true;
+
+  std::vector<std::pair<base::Time, std::pair<std::string, size_t>>> files;
+  base::FileEnumerator enumerator(directory_, false /* recursive */,
+                                  base::FileEnumerator::FILES);
+  for (base::FilePath path = enumerator.Next(); !path.empty();
+       path = enumerator.Next()) {
+    base::FileEnumerator::FileInfo info = enumerator.GetInfo();
+    files.push_back(std::make_pair(
+        info.GetLastModifiedTime(),
+        std::make_pair(path.BaseName().MaybeAsASCII(),
+                       static_cast<size_t>(info.GetSize()))));
+  }
+
+  // Add the files from least to most recently used.
+  std::sort(files.begin(), files.end());
+  for (const auto& file : files) {
+    files_.Put(file.second.first, file.second.second);
+    total_bytes_ += file.second.second;
+  }
+
+  Trim();
+}
+
+bool BitmapDiskCache::Backend::RefreshIfUnchanged(
+    const base::FilePath& path,
+    const std::string& key,
+    const std::string& validator,
+    const SkBitmap& bitmap) {
+  if (validator.empty())
+    return false;
+
+  base::File file(path, base::File::FLAG_OPEN | base::File::FLAG_READ |
+                            base::File::FLAG_WRITE);
+  if (!file.IsValid())
+    return false;
+
+  // Only the header and the strings are needed to compare the entries.
+  std::vector<uint8_t> prefix(sizeof(FileHeader) + key.size() +
+                              validator.size());
+  if (file.Read(0, reinterpret_cast<char*>(prefix.data()), prefix.size()) !=
+      static_cast<int>(prefix.size())) {
+    return false;
+  }
+
+  FileHeader header;
+  memcpy(&header, prefix.data(), sizeof(FileHeader));
+  if (header.magic != kFileMagic || header.version != kFileVersion ||
+      header.key_length != key.size() ||
+      memcmp(&prefix[sizeof(FileHeader)], key.data(), key.size()) != 0) {
+    return false;
+  }
+
+  if (header.width != bitmap.width() || header.height != bitmap.height() ||
+      header.validator_length != validator.size() ||
+      memcmp(&prefix[sizeof(FileHeader) + key.size()], validator.data(),
+             validator.size()) != 0) {
+    return false;
+  }
+
+  int64_t confirmed_time = clock_->Now().ToInternalValue();
+  return file.Write(offsetof(FileHeader, confirmed_time),
+                    reinterpret_cast<const char*>(&confirmed_time),
+                    sizeof(confirmed_time)) ==
+         static_cast<int>(sizeof(confirmed_time));
+}
+
+void BitmapDiskCache::Backend::Touch(const std::string& name) {
+  files_.Get(name);
+
+  // The modification time orders the files when the index is rebuilt.
+  base::Time now = clock_->Now();
+  base::TouchFile(GetPath(name), now, now);
+}
+
+void BitmapDiskCache::Backend::Remove(const std::string& name) {
+  auto iter = files_.Peek(name);
+  if (iter != files_.end()) {
+    total_bytes_ -= iter->second;
+    files_.Erase(iter);
+  }
+  base::DeleteFile(GetPath(name), false /* recursive */);
+}
+
+void BitmapDiskCache::Backend::Trim() {
+  while (total_bytes_ > max_bytes_ && !files_.empty()) {
+    auto iter = files_.rbegin();
+    total_bytes_ -= iter->second;
+    base::DeleteFile(GetPath(iter->first), false /* recursive */);
+    files_.Erase(iter);
+  }
+}
+
+BitmapDiskCache::BitmapDiskCache(
+    const base::FilePath& directory,
+    size_t max_bytes,
+    base::TimeDelta max_age,
+    scoped_refptr<base::SequencedTaskRunner> task_runner)
+    : task_runner_(std::move(task_runner)),
+      backend_(new Backend(directory, max_bytes, max_age)) {}
+
+BitmapDiskCache::~BitmapDiskCache() {
+  task_runner_->DeleteSoon(FROM_HERE, backend_.release());
+}
+
+void BitmapDiskCache::Load(const std::string& key,
+                           const LoadCallback& callback) {
+  base::PostTaskAndReplyWithResult(
+      task_runner_.get(), FROM_HERE,
+      base::Bind(&Backend::Load, base::Unretained(backend_.get()), key),
+      callback);
+}
+
+void BitmapDiskCache::Store(const std::string& key,
+                            const std::string& validator,
+                            const SkBitmap& bitmap) {
+  task_runner_->PostTask(FROM_HERE,
+                         base::Bind(&Backend::Store,
+                                    base::Unretained(backend_.get()), key,
+                                    validator, bitmap));
+}
+
+void BitmapDiskCache::SetClockForTesting(std::unique_ptr<base::Clock> clock) {
+  task_runner_->PostTask(
+      FROM_HERE,
+      base::Bind(&Backend::SetClock, base::Unretained(backend_.get()),
+                 base::Passed(&clock)));
+}
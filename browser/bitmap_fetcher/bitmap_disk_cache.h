@@ -0,0 +1,77 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
+#define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
+#include "base/callback_forward.h"
+#include "base/files/file_path.h"
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/time/time.h"
+
+class SkBitmap;
+
+namespace base {
+class Clock;
+class SequencedTaskRunner;
+}  // namespace base
+
+// Keeps decoded images on disk so that they survive restarts. Images are
+// identified by a string key, usually derived from their URL. Each image is
+// stored in its own file, named after a hash of its key, holding a small
+// header followed by the raw pixels. Loading an image copies the pixels out of
+// a mapping of the file, so neither a network request nor a decode is needed.
+//
+// Along with the pixels, each file records the validator (ETag or
+// Last-Modified) the image was served with and when it was last confirmed by
+// the network. Images are only returned while they are younger than
+// |max_age|. Storing an image with the validator already on disk only
+// refreshes that time instead of rewriting the pixels.
+//
+// The cache is bounded to |max_bytes|, trimming the least recently used files.
+// All file access happens on |task_runner|; the public methods must be called
+// on the thread the cache was created on.
+class BitmapDiskCache {
+ public:
+  // Called with the cached image, or with nullptr when there is none.
+  using LoadCallback = base::Callback<void(std::unique_ptr<SkBitmap>)>;
+
+  BitmapDiskCache(const base::FilePath& directory,
+                  size_t max_bytes,
+                  base::TimeDelta max_age,
+                  scoped_refptr<base::SequencedTaskRunner> task_runner);
+  ~BitmapDiskCache();
+
+  // Looks up the image for |key| and calls |callback| with it.
+  void Load(const std::string& key, const LoadCallback& callback);
+
+  // Stores |bitmap| as the image for |key|, served with |validator|, which may
+  // be empty. The write happens asynchronously.
+  void Store(const std::string& key,
+             const std::string& validator,
+             const SkBitmap& bitmap);
+
+ private:
+  friend class BitmapDiskCacheTest;
+
+  // Owns the index of files on disk. Lives on |task_runner_|.
+  class Backend;
+
+  void SetClockForTesting(std::unique_ptr<base::Clock> clock);
+
+  scoped_refptr<base::SequencedTaskRunner> task_runner_;
+
+  // Deleted on |task_runner_|, after any tasks posted to it.
+  std::unique_ptr<Backend> backend_;
+
+  DISALLOW_COPY_AND_ASSIGN(BitmapDiskCache);
+};
+
+#endif  // CHROME_BROWSER_BITMAP_FETCHER_BITMAP_DISK_CACHE_H_
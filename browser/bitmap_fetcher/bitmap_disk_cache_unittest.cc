@@ -0,0 +1,232 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
+#include "base/bind.h"
+#include "base/files/file_enumerator.h"
+#include "base/files/file_util.h"
+#include "base/files/scoped_temp_dir.h"
+#include "base/macros.h"
+#include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/test/simple_test_clock.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+
+namespace {
+
+const int kImageSize = 8;
+
+// Room for two images, including their headers.
+const size_t kMaxBytes = 2 * (kImageSize * kImageSize * 4 + 128);
+
+const int kMaxAgeInDays = 7;
+
+SkBitmap CreateBitmap(SkColor color) {
+  SkBitmap bitmap;
+  bitmap.allocN32Pixels(kImageSize, kImageSize);
+  bitmap.eraseColor(color);
+  return bitmap;
+}
+
+}  // namespace
+
+class BitmapDiskCacheTest : public testing::Test {
+ public:
+  BitmapDiskCacheTest()
+      : key1_("https://example.com/image-1.png"),
+        key2_("https://example.com/image-2.png"),
+        key3_("https://example.com/image-3.png"),
+        clock_(nullptr) {}
+  ~BitmapDiskCacheTest() override {}
+
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    CreateCache();
+  }
+
+  void TearDown() override {
+    cache_.reset();
+
+    // Let the cache delete its backend.
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // Creates a new cache over the same directory, as after a restart.
+  void CreateCache() {
+    cache_.reset();
+    cache_.reset(new BitmapDiskCache(
+        temp_dir_.GetPath(), kMaxBytes,
+        base::TimeDelta::FromDays(kMaxAgeInDays),
+        base::ThreadTaskRunnerHandle::Get()));
+
+    std::unique_ptr<base::SimpleTestClock> clock =
+        base::MakeUnique<base::SimpleTestClock>();
+    clock_ = clock.get();
+    clock_->SetNow(now_.is_null() ? base::Time::Now() : now_);
+    now_ = clock_->Now();
+    cache_->SetClockForTesting(std::move(clock));
+  }
+
+  void Store(const std::string& key,
+             const std::string& validator,
+             const SkBitmap& bitmap) {
+    cache_->Store(key, validator, bitmap);
+    base::RunLoop().RunUntilIdle();
+  }
+
+  std::unique_ptr<SkBitmap> Load(const std::string& key) {
+    base::RunLoop run_loop;
+    cache_->Load(key, base::Bind(&BitmapDiskCacheTest::DidLoad,
+                                 base::Unretained(this),
+                                 run_loop.QuitClosure()));
+    run_loop.Run();
+    return std::move(loaded_bitmap_);
+  }
+
+  void AdvanceClock(base::TimeDelta delta) {
+    clock_->Advance(delta);
+    now_ = clock_->Now();
+  }
+
+  size_t GetFileCount() {
+    size_t count = 0;
+    base::FileEnumerator enumerator(temp_dir_.GetPath(), false,
+                                    base::FileEnumerator::FILES);
+    while (!enumerator.Next().empty())
+      count++;
+    return count;
+  }
+
+ protected:
+  const std::string key1_;
+  const std::string key2_;
+  const std::string key3_;
+
+  base::ScopedTempDir temp_dir_;
+
+ private:
+  void DidLoad(const base::Closure& quit_closure,
+               std::unique_ptr<SkBitmap> bitmap) {
+    loaded_bitmap_ = std::move(bitmap);
+    quit_closure.Run();
+  }
+
+  content::TestBrowserThreadBundle thread_bundle_;
+  std::unique_ptr<BitmapDiskCache> cache_;
+  std::unique_ptr<SkBitmap> loaded_bitmap_;
+
+  // Owned by the cache. |now_| carries the time over to recreated caches.
+  base::SimpleTestClock* clock_;
+  base::Time now_;
+
+  DISALLOW_COPY_AND_ASSIGN(BitmapDiskCacheTest);
+};
+
+TEST_F(BitmapDiskCacheTest, StoreAndLoadAcrossRestarts) {
+  EXPECT_FALSE(Load(key1_));
+
+  Store(key1_, "\"etag\"", CreateBitmap(SK_ColorGREEN));
+  CreateCache();
+
+  std::unique_ptr<SkBitmap> bitmap = Load(key1_);
+  ASSERT_TRUE(bitmap);
+  EXPECT_EQ(kImageSize, bitmap->width());
+  EXPECT_EQ(kImageSize, bitmap->height());
+  EXPECT_TRUE(bitmap->isImmutable());
+  EXPECT_EQ(SK_ColorGREEN, bitmap->getColor(0, 0));
+  EXPECT_EQ(SK_ColorGREEN, bitmap->getColor(kImageSize - 1, kImageSize - 1));
+
+  EXPECT_FALSE(Load(key2_));
+}
+
+TEST_F(BitmapDiskCacheTest, ExpiredImagesAreNotLoaded) {
+  Store(key1_, "\"etag\"", CreateBitmap(SK_ColorGREEN));
+  Store(key2_, "\"etag\"", CreateBitmap(SK_ColorBLUE));
+
+  AdvanceClock(base::TimeDelta::FromDays(kMaxAgeInDays + 1));
+  EXPECT_FALSE(Load(key1_));
+  EXPECT_FALSE(Load(key2_));
+
+  // Storing an image with the same validator confirms the copy on disk.
+  Store(key1_, "\"etag\"", CreateBitmap(SK_ColorRED));
+  std::unique_ptr<SkBitmap> bitmap = Load(key1_);
+  ASSERT_TRUE(bitmap);
+  EXPECT_EQ(SK_ColorGREEN, bitmap->getColor(0, 0));
+
+  // A different validator replaces the image.
+  Store(key2_, "\"other-etag\"", CreateBitmap(SK_ColorRED));
+  bitmap = Load(key2_);
+  ASSERT_TRUE(bitmap);
+  EXPECT_EQ(SK_ColorRED, bitmap->getColor(0, 0));
+}
+
+TEST_F(BitmapDiskCacheTest, TrimsLeastRecentlyUsedImages) {
+  Store(key1_, std::string(), CreateBitmap(SK_ColorGREEN));
+  AdvanceClock(base::TimeDelta::FromMinutes(1));
+  Store(key2_, std::string(), CreateBitmap(SK_ColorBLUE));
+  AdvanceClock(base::TimeDelta::FromMinutes(1));
+
+  // Using |key1_| leaves |key2_| as the least recently used image.
+  EXPECT_TRUE(Load(key1_));
+  AdvanceClock(base::TimeDelta::FromMinutes(1));
+
+  Store(key3_, std::string(), CreateBitmap(SK_ColorRED));
+  EXPECT_EQ(2U, GetFileCount());
+  EXPECT_TRUE(Load(key1_));
+  EXPECT_FALSE(Load(key2_));
+  EXPECT_TRUE(Load(key3_));
+
+  // The order of use is restored from disk after a restart.
+  AdvanceClock(base::TimeDelta::FromMinutes(1));
+  EXPECT_TRUE(Load(key1_));
+  CreateCache();
+  AdvanceClock(base::TimeDelta::FromMinutes(1));
+  Store(key2_, std::string(), CreateBitmap(SK_ColorBLUE));
+  EXPECT_EQ(2U, GetFileCount());
+  EXPECT_TRUE(Load(key1_));
+  EXPECT_FALSE(Load(key3_));
+}
+
+TEST_F(BitmapDiskCacheTest, LoadedImagesOutliveTheirFiles) {
+  Store(key1_, std::string(), CreateBitmap(SK_ColorGREEN));
+  std::unique_ptr<SkBitmap> green = Load(key1_);
+  ASSERT_TRUE(green);
+
+  // Replacing the file leaves the loaded image alone.
+  Store(key1_, std::string(), CreateBitmap(SK_ColorBLUE));
+  EXPECT_EQ(1U, GetFileCount());
+  EXPECT_EQ(SK_ColorGREEN, green->getColor(0, 0));
+  std::unique_ptr<SkBitmap> blue = Load(key1_);
+  ASSERT_TRUE(blue);
+  EXPECT_EQ(SK_ColorBLUE, blue->getColor(0, 0));
+
+  // So does deleting it.
+  Store(key2_, std::string(), CreateBitmap(SK_ColorRED));
+  Store(key3_, std::string(), CreateBitmap(SK_ColorRED));
+  EXPECT_FALSE(Load(key1_));
+  EXPECT_EQ(SK_ColorBLUE, blue->getColor(kImageSize - 1, kImageSize - 1));
+}
+
+TEST_F(BitmapDiskCacheTest, CorruptFilesAreIgnored) {
+  Store(key1_, std::string(), CreateBitmap(SK_ColorGREEN));
+  ASSERT_EQ(1U, GetFileCount());
+
+  base::FileEnumerator enumerator(temp_dir_.GetPath(), false,
+                                  base::FileEnumerator::FILES);
+  base::FilePath path = enumerator.Next();
+  ASSERT_EQ(4, base::WriteFile(path, "junk", 4));
+
+  CreateCache();
+  EXPECT_FALSE(Load(key1_));
+  EXPECT_EQ(0U, GetFileCount());
+}
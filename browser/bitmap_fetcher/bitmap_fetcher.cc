@@ -4,18 +4,82 @@
 
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
 
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "base/memory/ptr_util.h"
 #include "content/public/browser/browser_thread.h"
+#include "net/base/io_buffer.h"
+#include "net/base/net_errors.h"
+#include "net/http/http_response_headers.h"
 #include "net/url_request/url_fetcher.h"
+#include "net/url_request/url_fetcher_response_writer.h"
 #include "net/url_request/url_request_context_getter.h"
 #include "net/url_request/url_request_status.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+
+namespace {
+
+// Bytes per pixel of the N32 bitmaps returned by the decoder service.
+const int64_t kBytesPerPixel = 4;
+
+}  // namespace
 
 namespace chrome {
 
+// Writes the response body straight into the buffer handed to ImageDecoder.
+// This saves the copy made by URLFetcher::GetResponseAsString() and the one
+// made by turning that string into the decoder's std::vector<uint8_t>.
+class BitmapFetcher::ResponseWriter : public net::URLFetcherResponseWriter {
+ public:
+  ResponseWriter() {}
+  ~ResponseWriter() override {}
+
+  // Returns the response body, leaving the writer empty. Must only be called
+  // once the fetch has completed.
+  std::vector<uint8_t> TakeData() { return std::move(data_); }
+
+  // net::URLFetcherResponseWriter:
+  int Initialize(const net::CompletionCallback& callback) override {
+    data_.clear();
+    return net::OK;
+  }
+
+  int Write(net::IOBuffer* buffer,
+            int num_bytes,
+            const net::CompletionCallback& callback) override {
+    data_.insert(data_.end(), buffer->data(), buffer->data() + num_bytes);
+    return num_bytes;
+  }
+
+  int Finish(int net_error, const net::CompletionCallback& callback) override {
+    return net::OK;
+  }
+
+ private:
+  std::vector<uint8_t> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResponseWriter);
+};
+
+BitmapFetcher::BitmapFetcher(
+    const GURL& url,
+    BitmapFetcherDelegate* delegate,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation)
+    : BitmapFetcher(url, gfx::Size(), delegate, traffic_annotation) {}
+
 BitmapFetcher::BitmapFetcher(
     const GURL& url,
+    const gfx::Size& desired_size,
     BitmapFetcherDelegate* delegate,
     const net::NetworkTrafficAnnotationTag& traffic_annotation)
-    : url_(url), delegate_(delegate), traffic_annotation_(traffic_annotation) {}
+    : response_writer_(nullptr),
+      url_(url),
+      desired_size_(desired_size),
+      delegate_(delegate),
+      traffic_annotation_(traffic_annotation) {}
 
 BitmapFetcher::~BitmapFetcher() {
 }
@@ -33,6 +97,11 @@ void BitmapFetcher::Init(net::URLRequestContextGetter* request_context,
   url_fetcher_->SetReferrer(referrer);
   url_fetcher_->SetReferrerPolicy(referrer_policy);
   url_fetcher_->SetLoadFlags(load_flags);
+
+  std::unique_ptr<ResponseWriter> response_writer =
+      base::MakeUnique<ResponseWriter>();
+  response_writer_ = response_writer.get();
+  url_fetcher_->SaveResponseWithWriter(std::move(response_writer));
 }
 
 void BitmapFetcher::Start() {
@@ -48,12 +117,29 @@ void BitmapFetcher::OnURLFetchComplete(const net::URLFetcher* source) {
     return;
   }
 
-  std::string image_data;
-  source->GetResponseAsString(&image_data);
+  response_headers_ = source->GetResponseHeaders();
+
+  std::vector<uint8_t> image_data = response_writer_->TakeData();
+
+  // Larger images are scaled down by the decoder service, so that they never
+  // reach the browser at full size.
+  if (desired_size_.IsEmpty()) {
+    StartDecode(std::move(image_data), false /* shrink_to_fit */,
+                ImageDecoder::kMaxImageSizeInBytes);
+  } else {
+    StartDecode(std::move(image_data), true /* shrink_to_fit */,
+                kBytesPerPixel * desired_size_.GetArea());
+  }
+}
 
+void BitmapFetcher::StartDecode(std::vector<uint8_t> image_data,
+                                bool shrink_to_fit,
+                                int64_t max_size_in_bytes) {
   // Call start to begin decoding.  The ImageDecoder will call OnImageDecoded
   // with the data when it is done.
-  ImageDecoder::Start(this, image_data);
+  ImageDecoder::StartWithOptions(this, std::move(image_data),
+                                 ImageDecoder::DEFAULT_CODEC, shrink_to_fit,
+                                 desired_size_, max_size_in_bytes);
 }
 
 // Methods inherited from ImageDecoder::ImageRequest.
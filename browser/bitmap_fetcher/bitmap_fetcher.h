@@ -5,19 +5,25 @@
 #ifndef CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_H_
 #define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_H_
 
+#include <stdint.h>
+
 #include <memory>
+#include <vector>
 
 #include "base/macros.h"
+#include "base/memory/ref_counted.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_delegate.h"
 #include "chrome/browser/image_decoder.h"
 #include "net/traffic_annotation/network_traffic_annotation.h"
 #include "net/url_request/url_fetcher_delegate.h"
 #include "net/url_request/url_request.h"
+#include "ui/gfx/geometry/size.h"
 #include "url/gurl.h"
 
 class SkBitmap;
 
 namespace net {
+class HttpResponseHeaders;
 class URLFetcher;
 class URLRequestContextGetter;
 }  // namespace net
@@ -32,11 +38,29 @@ class BitmapFetcher : public net::URLFetcherDelegate,
   BitmapFetcher(const GURL& url,
                 BitmapFetcherDelegate* delegate,
                 const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Like the constructor above, but images larger than |desired_size| are
+  // scaled down by the decoder service, keeping their aspect ratio, to take
+  // no more memory than |desired_size| pixels. One side of the image may
+  // still be larger than that of |desired_size|. For images with several
+  // frames, the frame closest to |desired_size| is decoded. An empty
+  // |desired_size| keeps the full size.
+  BitmapFetcher(const GURL& url,
+                const gfx::Size& desired_size,
+                BitmapFetcherDelegate* delegate,
+                const net::NetworkTrafficAnnotationTag& traffic_annotation);
   ~BitmapFetcher() override;
 
   const GURL& url() const { return url_; }
+  const gfx::Size& desired_size() const { return desired_size_; }
   net::URLFetcher* url_fetcher() { return url_fetcher_.get(); }
 
+  // The headers of the response the image was decoded from, once the fetch
+  // has completed. May be null.
+  const net::HttpResponseHeaders* response_headers() const {
+    return response_headers_.get();
+  }
+
   // Initializes internal fetcher.  After this function returns url_fetcher()
   // can be accessed to configure it further (eg. add user data to request).
   // All configuration must be done before Start() is called.
@@ -70,12 +94,26 @@ class BitmapFetcher : public net::URLFetcherDelegate,
   // Called when decoding image failed.
   void OnDecodeImageFailed() override;
 
+ protected:
+  // Starts decoding |image_data| into an image of no more than
+  // |max_size_in_bytes|, scaling it down to fit if |shrink_to_fit|. Virtual
+  // method so tests can check the options without a decoder service.
+  virtual void StartDecode(std::vector<uint8_t> image_data,
+                           bool shrink_to_fit,
+                           int64_t max_size_in_bytes);
+
  private:
+  // Collects the response body for the decoder. Owned by |url_fetcher_|.
+  class ResponseWriter;
+
   // Alerts the delegate that a failure occurred.
   void ReportFailure();
 
   std::unique_ptr<net::URLFetcher> url_fetcher_;
+  ResponseWriter* response_writer_;
+  scoped_refptr<net::HttpResponseHeaders> response_headers_;
   const GURL url_;
+  const gfx::Size desired_size_;
   BitmapFetcherDelegate* const delegate_;
   const net::NetworkTrafficAnnotationTag traffic_annotation_;
 
@@ -6,23 +6,66 @@
 
 #include <stddef.h>
 #include <utility>
+#include <vector>
 
+#include "base/bind.h"
+#include "base/feature_list.h"
+#include "base/files/file_path.h"
 #include "base/macros.h"
 #include "base/memory/weak_ptr.h"
+#include "base/task_scheduler/post_task.h"
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
 #include "chrome/browser/profiles/profile.h"
 #include "content/public/browser/storage_partition.h"
 #include "net/base/load_flags.h"
+#include "net/http/http_response_headers.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 
 namespace {
 
-const size_t kMaxRequests = 25;  // Maximum number of inflight requests allowed.
-const int kMaxCacheEntries = 5;  // Maximum number of cache entries.
+// Maximum number of network fetches running at the same time. Further fetches
+// are queued until one of them completes.
+const size_t kMaxConcurrentFetches = 6;
+
+// Maximum number of prefetches waiting for a fetch to complete. Prefetches are
+// speculative, so later ones are dropped rather than queued without bound.
+const size_t kMaxQueuedPrefetches = 100;
+
+// Bytes of decoded pixel data kept in the cache. This holds hundreds of the
+// small images shown with suggestions, or a few large ones.
+const size_t kMaxCacheBytes = 4 * 1024 * 1024;
+
+// Keeps decoded images in the profile directory across restarts.
+const base::Feature kBitmapFetcherDiskCache{"BitmapFetcherDiskCache",
+                                            base::FEATURE_DISABLED_BY_DEFAULT};
+
+const base::FilePath::CharType kDiskCacheDirname[] =
+    FILE_PATH_LITERAL("Bitmap Fetcher Cache");
+
+// Bytes of decoded images kept on disk, and how long an image is used after
+// the network last served it.
+const size_t kMaxDiskCacheBytes = 20 * 1024 * 1024;
+const int kMaxDiskCacheAgeInDays = 7;
+
+// Returns the validator the network served the image with: its ETag, or else
+// its Last-Modified date.
+std::string GetValidator(const net::HttpResponseHeaders* headers) {
+  std::string validator;
+  if (headers && !headers->EnumerateHeader(nullptr, "ETag", &validator))
+    headers->EnumerateHeader(nullptr, "Last-Modified", &validator);
+  return validator;
+}
+
+bool MayStoreOnDisk(const net::HttpResponseHeaders* headers) {
+  return !headers || !headers->HasHeaderValue("cache-control", "no-store");
+}
 
 }  // namespace.
 
-class BitmapFetcherRequest {
+// Requests are linked into the list of the fetcher they are waiting for, so
+// that completing a fetch only visits the requests attached to it.
+class BitmapFetcherRequest : public base::LinkNode<BitmapFetcherRequest> {
  public:
   BitmapFetcherRequest(BitmapFetcherService::RequestId request_id,
                        BitmapFetcherService::Observer* observer);
@@ -31,14 +74,9 @@ class BitmapFetcherRequest {
   void NotifyImageChanged(const SkBitmap* bitmap);
   BitmapFetcherService::RequestId request_id() const { return request_id_; }
 
-  // Weak ptr |fetcher| is used to identify associated fetchers.
-  void set_fetcher(const chrome::BitmapFetcher* fetcher) { fetcher_ = fetcher; }
-  const chrome::BitmapFetcher* get_fetcher() const { return fetcher_; }
-
  private:
   const BitmapFetcherService::RequestId request_id_;
   std::unique_ptr<BitmapFetcherService::Observer> observer_;
-  const chrome::BitmapFetcher* fetcher_;
 
   DISALLOW_COPY_AND_ASSIGN(BitmapFetcherRequest);
 };
@@ -57,34 +95,95 @@ void BitmapFetcherRequest::NotifyImageChanged(const SkBitmap* bitmap) {
     observer_->OnImageChanged(request_id_, *bitmap);
 }
 
-BitmapFetcherService::CacheEntry::CacheEntry() {
+BitmapFetcherService::CacheEntry::CacheEntry() : byte_size(0) {
 }
 
 BitmapFetcherService::CacheEntry::~CacheEntry() {
 }
 
+BitmapFetcherService::FetcherEntry::FetcherEntry(
+    BitmapFetcherService* service,
+    const GURL& url,
+    const gfx::Size& desired_size,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation,
+    Priority priority)
+    : service(service),
+      url(url),
+      desired_size(desired_size),
+      key(GetCacheKey(url, desired_size)),
+      traffic_annotation(traffic_annotation),
+      priority(priority),
+      queued(false) {}
+
+BitmapFetcherService::FetcherEntry::~FetcherEntry() {
+  // The requests are owned by the service, which removes them from the list
+  // before they are destroyed.
+  DCHECK(requests.empty());
+}
+
+void BitmapFetcherService::FetcherEntry::OnFetchComplete(
+    const GURL& url,
+    const SkBitmap* bitmap) {
+  service->OnFetchComplete(this, bitmap);
+}
+
 BitmapFetcherService::BitmapFetcherService(content::BrowserContext* context)
-    : cache_(kMaxCacheEntries), current_request_id_(1), context_(context) {
+    : running_fetches_(0),
+      max_concurrent_fetches_(kMaxConcurrentFetches),
+      cache_(base::MRUCache<std::string,
+                            std::unique_ptr<CacheEntry>>::NO_AUTO_EVICT),
+      max_cache_bytes_(kMaxCacheBytes),
+      memory_pressure_listener_(new base::MemoryPressureListener(
+          base::Bind(&BitmapFetcherService::OnMemoryPressure,
+                     base::Unretained(this)))),
+      current_request_id_(1),
+      context_(context),
+      weak_ptr_factory_(this) {
+  if (base::FeatureList::IsEnabled(kBitmapFetcherDiskCache) &&
+      !context->IsOffTheRecord()) {
+    disk_cache_.reset(new BitmapDiskCache(
+        context->GetPath().Append(kDiskCacheDirname), kMaxDiskCacheBytes,
+        base::TimeDelta::FromDays(kMaxDiskCacheAgeInDays),
+        base::CreateSequencedTaskRunnerWithTraits(
+            base::TaskTraits()
+                .MayBlock()
+                .WithPriority(base::TaskPriority::USER_VISIBLE)
+                .WithShutdownBehavior(
+                    base::TaskShutdownBehavior::SKIP_ON_SHUTDOWN))));
+  }
 }
 
 BitmapFetcherService::~BitmapFetcherService() {
+  // Unlink the requests which are still waiting, so that neither container
+  // refers to the other's elements while they are being destroyed.
+  for (auto& entry : active_fetchers_) {
+    while (!entry.second->requests.empty())
+      entry.second->requests.head()->value()->RemoveFromList();
+  }
 }
 
 void BitmapFetcherService::CancelRequest(int request_id) {
-  ScopedVector<BitmapFetcherRequest>::iterator iter;
-  for (iter = requests_.begin(); iter != requests_.end(); ++iter) {
-    if ((*iter)->request_id() == request_id) {
-      requests_.erase(iter);
-      // Deliberately leave the associated fetcher running to populate cache.
-      return;
-    }
-  }
+  auto iter = requests_.find(request_id);
+  if (iter == requests_.end())
+    return;
+
+  // Deliberately leave the associated fetcher running to populate cache.
+  iter->second->RemoveFromList();
+  requests_.erase(iter);
 }
 
 BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
     const GURL& url,
     Observer* observer,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  return RequestImage(url, gfx::Size(), observer, traffic_annotation);
+}
+
+BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
+    const GURL& url,
+    const gfx::Size& desired_size,
+    Observer* observer,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
   // Create a new request, assigning next available request ID.
   ++current_request_id_;
   if (current_request_id_ == REQUEST_ID_INVALID)
@@ -98,40 +197,55 @@ BitmapFetcherService::RequestId BitmapFetcherService::RequestImage(
     return REQUEST_ID_INVALID;
 
   // Check for existing images first.
-  auto iter = cache_.Get(url);
+  auto iter = cache_.Get(GetCacheKey(url, desired_size));
   if (iter != cache_.end()) {
+    ++cache_stats_.hits;
     BitmapFetcherService::CacheEntry* entry = iter->second.get();
     request->NotifyImageChanged(entry->bitmap.get());
 
     // There is no request ID associated with this - data is already delivered.
     return REQUEST_ID_INVALID;
   }
-
-  // Limit number of simultaneous in-flight requests.
-  if (requests_.size() > kMaxRequests)
-    return REQUEST_ID_INVALID;
+  ++cache_stats_.misses;
 
   // Make sure there's a fetcher for this URL and attach to request.
-  const chrome::BitmapFetcher* fetcher =
-      EnsureFetcherForUrl(url, traffic_annotation);
-  request->set_fetcher(fetcher);
+  EnsureFetcherForUrl(url, desired_size, traffic_annotation, Priority::VISIBLE)
+      ->requests.Append(request.get());
 
-  requests_.push_back(request.release());
-  return requests_.back()->request_id();
+  requests_[request_id] = std::move(request);
+  return request_id;
 }
 
 void BitmapFetcherService::Prefetch(
     const GURL& url,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
-  if (url.is_valid())
-    EnsureFetcherForUrl(url, traffic_annotation);
+  Prefetch(url, gfx::Size(), traffic_annotation);
+}
+
+void BitmapFetcherService::Prefetch(
+    const GURL& url,
+    const gfx::Size& desired_size,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
+  if (!url.is_valid())
+    return;
+
+  if (prefetch_queue_.size() >= kMaxQueuedPrefetches &&
+      active_fetchers_.find(GetCacheKey(url, desired_size)) ==
+          active_fetchers_.end()) {
+    return;
+  }
+
+  EnsureFetcherForUrl(url, desired_size, traffic_annotation,
+                      Priority::PREFETCH);
 }
 
 std::unique_ptr<chrome::BitmapFetcher> BitmapFetcherService::CreateFetcher(
     const GURL& url,
+    const gfx::Size& desired_size,
+    chrome::BitmapFetcherDelegate* delegate,
     const net::NetworkTrafficAnnotationTag& traffic_annotation) {
-  std::unique_ptr<chrome::BitmapFetcher> new_fetcher(
-      new chrome::BitmapFetcher(url, this, traffic_annotation));
+  std::unique_ptr<chrome::BitmapFetcher> new_fetcher(new chrome::BitmapFetcher(
+      url, desired_size, delegate, traffic_annotation));
 
   new_fetcher->Init(
       content::BrowserContext::GetDefaultStoragePartition(context_)->
@@ -143,60 +257,211 @@ std::unique_ptr<chrome::BitmapFetcher> BitmapFetcherService::CreateFetcher(
   return new_fetcher;
 }
 
-const chrome::BitmapFetcher* BitmapFetcherService::EnsureFetcherForUrl(
+// static
+std::string BitmapFetcherService::GetCacheKey(const GURL& url,
+                                              const gfx::Size& desired_size) {
+  // A valid URL spec never contains a space.
+  if (desired_size.IsEmpty())
+    return url.spec();
+  return url.spec() + " " + desired_size.ToString();
+}
+
+BitmapFetcherService::FetcherEntry* BitmapFetcherService::EnsureFetcherForUrl(
     const GURL& url,
-    const net::NetworkTrafficAnnotationTag& traffic_annotation) {
-  const chrome::BitmapFetcher* fetcher = FindFetcherForUrl(url);
-  if (fetcher)
-    return fetcher;
+    const gfx::Size& desired_size,
+    const net::NetworkTrafficAnnotationTag& traffic_annotation,
+    Priority priority) {
+  std::unique_ptr<FetcherEntry>& entry =
+      active_fetchers_[GetCacheKey(url, desired_size)];
+  if (entry) {
+    if (priority == Priority::VISIBLE &&
+        entry->priority == Priority::PREFETCH) {
+      // Take the fetch out of the prefetch queue, so that it doesn't wait
+      // behind other prefetches.
+      if (entry->queued)
+        RequeueFetch(entry.get(), priority);
+      entry->priority = priority;
+    }
+    return entry.get();
+  }
 
-  std::unique_ptr<chrome::BitmapFetcher> new_fetcher =
-      CreateFetcher(url, traffic_annotation);
-  active_fetchers_.push_back(std::move(new_fetcher));
-  return active_fetchers_.back().get();
+  entry.reset(new FetcherEntry(this, url, desired_size, traffic_annotation,
+                               priority));
+  if (disk_cache_) {
+    disk_cache_->Load(entry->key,
+                      base::Bind(&BitmapFetcherService::DidLoadFromDiskCache,
+                                 weak_ptr_factory_.GetWeakPtr(), entry->key));
+  } else {
+    ScheduleFetch(entry.get());
+  }
+  return entry.get();
 }
 
 const chrome::BitmapFetcher* BitmapFetcherService::FindFetcherForUrl(
-    const GURL& url) {
-  for (auto it = active_fetchers_.begin(); it != active_fetchers_.end(); ++it) {
-    if (url == (*it)->url())
-      return it->get();
+    const GURL& url,
+    const gfx::Size& desired_size) {
+  auto it = active_fetchers_.find(GetCacheKey(url, desired_size));
+  if (it == active_fetchers_.end())
+    return nullptr;
+  return it->second->fetcher.get();
+}
+
+void BitmapFetcherService::DidLoadFromDiskCache(
+    const std::string& key,
+    std::unique_ptr<SkBitmap> bitmap) {
+  auto iter = active_fetchers_.find(key);
+  DCHECK(iter != active_fetchers_.end());
+  DCHECK(!iter->second->fetcher);
+
+  if (bitmap) {
+    ++cache_stats_.disk_hits;
+    FinishRequests(iter->second.get(), bitmap.get());
+    return;
   }
-  return nullptr;
+
+  ScheduleFetch(iter->second.get());
 }
 
-void BitmapFetcherService::RemoveFetcher(const chrome::BitmapFetcher* fetcher) {
-  auto it = active_fetchers_.begin();
-  for (; it != active_fetchers_.end(); ++it) {
-    if (it->get() == fetcher)
-      break;
+void BitmapFetcherService::ScheduleFetch(FetcherEntry* entry) {
+  DCHECK(!entry->fetcher);
+  DCHECK(!entry->queued);
+
+  if (running_fetches_ < max_concurrent_fetches_) {
+    entry->fetcher = CreateFetcher(entry->url, entry->desired_size, entry,
+                                   entry->traffic_annotation);
+    ++running_fetches_;
+    return;
+  }
+
+  std::list<std::string>& queue = entry->priority == Priority::VISIBLE
+                                      ? visible_queue_
+                                      : prefetch_queue_;
+  entry->queue_position = queue.insert(queue.end(), entry->key);
+  entry->queued = true;
+}
+
+void BitmapFetcherService::RequeueFetch(FetcherEntry* entry,
+                                        Priority priority) {
+  DCHECK(entry->queued);
+  std::list<std::string>& old_queue = entry->priority == Priority::VISIBLE
+                                          ? visible_queue_
+                                          : prefetch_queue_;
+  std::list<std::string>& new_queue =
+      priority == Priority::VISIBLE ? visible_queue_ : prefetch_queue_;
+  new_queue.splice(new_queue.end(), old_queue, entry->queue_position);
+}
+
+void BitmapFetcherService::StartQueuedFetches() {
+  while (running_fetches_ < max_concurrent_fetches_) {
+    std::list<std::string>& queue =
+        visible_queue_.empty() ? prefetch_queue_ : visible_queue_;
+    if (queue.empty())
+      return;
+
+    auto iter = active_fetchers_.find(queue.front());
+    queue.pop_front();
+    DCHECK(iter != active_fetchers_.end());
+    iter->second->queued = false;
+    ScheduleFetch(iter->second.get());
+  }
+}
+
+void BitmapFetcherService::FinishRequests(FetcherEntry* finished_entry,
+                                          const SkBitmap* bitmap) {
+  auto entry_iter = active_fetchers_.find(finished_entry->key);
+  DCHECK(entry_iter != active_fetchers_.end());
+  DCHECK_EQ(finished_entry, entry_iter->second.get());
+
+  // Detach the entry first, so that observers which call back into the service
+  // find the image in the cache rather than a finished fetcher. The entry, and
+  // the fetcher which may own |bitmap|, are kept alive until the end.
+  std::unique_ptr<FetcherEntry> entry = std::move(entry_iter->second);
+  active_fetchers_.erase(entry_iter);
+  DCHECK(!entry->queued);
+  if (entry->fetcher) {
+    DCHECK_GT(running_fetches_, 0U);
+    --running_fetches_;
+  }
+
+  if (bitmap && !bitmap->isNull())
+    AddToCache(entry->key, *bitmap);
+
+  // Take the attached requests out of the service first, so that observers
+  // can't affect the set of requests being notified.
+  std::vector<std::unique_ptr<BitmapFetcherRequest>> finished_requests;
+  while (!entry->requests.empty()) {
+    BitmapFetcherRequest* request = entry->requests.head()->value();
+    request->RemoveFromList();
+    auto request_iter = requests_.find(request->request_id());
+    DCHECK(request_iter != requests_.end());
+    finished_requests.push_back(std::move(request_iter->second));
+    requests_.erase(request_iter);
   }
-  // RemoveFetcher should always result in removal.
-  DCHECK(it != active_fetchers_.end());
-  active_fetchers_.erase(it);
+
+  // Notify all attached requests of completion.
+  for (const auto& request : finished_requests)
+    request->NotifyImageChanged(bitmap);
+
+  StartQueuedFetches();
 }
 
-void BitmapFetcherService::OnFetchComplete(const GURL& url,
+void BitmapFetcherService::OnFetchComplete(FetcherEntry* entry,
                                            const SkBitmap* bitmap) {
-  const chrome::BitmapFetcher* fetcher = FindFetcherForUrl(url);
+  const chrome::BitmapFetcher* fetcher = entry->fetcher.get();
   DCHECK(fetcher);
 
-  // Notify all attached requests of completion.
-  ScopedVector<BitmapFetcherRequest>::iterator iter = requests_.begin();
-  while (iter != requests_.end()) {
-    if ((*iter)->get_fetcher() == fetcher) {
-      (*iter)->NotifyImageChanged(bitmap);
-      iter = requests_.erase(iter);
-    } else {
-      ++iter;
-    }
+  if (disk_cache_ && bitmap && !bitmap->isNull() &&
+      MayStoreOnDisk(fetcher->response_headers())) {
+    disk_cache_->Store(entry->key, GetValidator(fetcher->response_headers()),
+                       *bitmap);
   }
 
-  if (bitmap && !bitmap->isNull()) {
-    std::unique_ptr<CacheEntry> entry(new CacheEntry);
-    entry->bitmap.reset(new SkBitmap(*bitmap));
-    cache_.Put(fetcher->url(), std::move(entry));
+  FinishRequests(entry, bitmap);
+}
+
+void BitmapFetcherService::AddToCache(const std::string& key,
+                                      const SkBitmap& bitmap) {
+  size_t byte_size = bitmap.computeByteSize();
+  if (byte_size > max_cache_bytes_)
+    return;
+
+  // Put() replaces an existing entry, so account for the one it drops.
+  auto iter = cache_.Peek(key);
+  if (iter != cache_.end()) {
+    cache_stats_.bytes -= iter->second->byte_size;
+    cache_.Erase(iter);
   }
 
-  RemoveFetcher(fetcher);
+  std::unique_ptr<CacheEntry> entry(new CacheEntry);
+  entry->bitmap.reset(new SkBitmap(bitmap));
+  entry->byte_size = byte_size;
+  cache_.Put(key, std::move(entry));
+  cache_stats_.bytes += byte_size;
+
+  TrimCache(max_cache_bytes_);
+}
+
+void BitmapFetcherService::TrimCache(size_t max_bytes) {
+  while (cache_stats_.bytes > max_bytes && !cache_.empty()) {
+    auto iter = cache_.rbegin();
+    cache_stats_.bytes -= iter->second->byte_size;
+    cache_.Erase(iter);
+    ++cache_stats_.evictions;
+  }
+}
+
+void BitmapFetcherService::OnMemoryPressure(
+    base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level) {
+  switch (memory_pressure_level) {
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_NONE:
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_MODERATE:
+      // Keep the most recently used half, as those are likely to be shown
+      // again soon.
+      TrimCache(max_cache_bytes_ / 2);
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL:
+      TrimCache(0);
+      break;
+  }
 }
@@ -4,15 +4,22 @@
 #ifndef CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_SERVICE_H_
 #define CHROME_BROWSER_BITMAP_FETCHER_BITMAP_FETCHER_SERVICE_H_
 
+#include <list>
 #include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "base/compiler_specific.h"
+#include "base/containers/linked_list.h"
 #include "base/containers/mru_cache.h"
 #include "base/macros.h"
-#include "base/memory/scoped_vector.h"
+#include "base/memory/memory_pressure_listener.h"
+#include "base/memory/weak_ptr.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_delegate.h"
 #include "components/keyed_service/core/keyed_service.h"
 #include "net/traffic_annotation/network_traffic_annotation.h"
+#include "ui/gfx/geometry/size.h"
+#include "url/gurl.h"
 
 namespace content {
 class BrowserContext;
@@ -22,13 +29,12 @@ namespace chrome {
 class BitmapFetcher;
 }  // namespace chrome
 
+class BitmapDiskCache;
 class BitmapFetcherRequest;
-class GURL;
 class SkBitmap;
 
 // Service to retrieve images for Answers in Suggest.
-class BitmapFetcherService : public KeyedService,
-                             public chrome::BitmapFetcherDelegate {
+class BitmapFetcherService : public KeyedService {
  public:
   typedef int RequestId;
   static const RequestId REQUEST_ID_INVALID = 0;
@@ -51,10 +57,9 @@ class BitmapFetcherService : public KeyedService,
   void CancelRequest(RequestId requestId);
 
   // Requests a new image. Will either trigger download or satisfy from cache.
-  // Takes ownership of |observer|. If there are too many outstanding requests,
-  // the request will fail and |observer| will be called to signal failure.
-  // Otherwise, |observer| will be called with either the cached image or the
-  // downloaded one.
+  // Takes ownership of |observer|, which will be called with either the cached
+  // image or the downloaded one. When too many fetches are in flight, the
+  // download waits for one of them to finish, ahead of any prefetches.
   // NOTE: The observer might be called back synchronously from RequestImage if
   // the image is already in the cache.
   RequestId RequestImage(
@@ -62,41 +67,170 @@ class BitmapFetcherService : public KeyedService,
       Observer* observer,
       const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
-  // Start fetching the image at the given |url|.
+  // Like RequestImage() above, but images larger than |desired_size| are
+  // scaled down by the decoder service, keeping their aspect ratio, to take
+  // no more memory than |desired_size| pixels before they are cached and
+  // handed to |observer|. One side of the image may still be larger than
+  // that of |desired_size|. Images for the same URL at different sizes are
+  // cached separately.
+  RequestId RequestImage(
+      const GURL& url,
+      const gfx::Size& desired_size,
+      Observer* observer,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Start fetching the image at the given |url|. Prefetches wait for images
+  // requested with RequestImage(), and are dropped when too many are waiting.
   void Prefetch(const GURL& url,
                 const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
+  // Like Prefetch() above, for a later RequestImage() with |desired_size|.
+  void Prefetch(const GURL& url,
+                const gfx::Size& desired_size,
+                const net::NetworkTrafficAnnotationTag& traffic_annotation);
+
+  // Counters describing the cache of decoded images.
+  struct CacheStats {
+    CacheStats() : hits(0), misses(0), disk_hits(0), evictions(0), bytes(0) {}
+
+    // Requests which were answered from the cache, or had to be fetched.
+    size_t hits;
+    size_t misses;
+
+    // Images which were found in the disk cache instead of being fetched.
+    size_t disk_hits;
+
+    // Images which were dropped to stay within the byte budget or to release
+    // memory under pressure.
+    size_t evictions;
+
+    // Bytes of pixel data currently held by the cache.
+    size_t bytes;
+  };
+
+  const CacheStats& cache_stats() const { return cache_stats_; }
+
  protected:
-  // Create a bitmap fetcher for the given |url| and start it. Virtual method
-  // so tests can override this for different behavior.
+  // Create a bitmap fetcher for the given |url|, reporting to |delegate|, and
+  // start it. Virtual method so tests can override this for different
+  // behavior.
   virtual std::unique_ptr<chrome::BitmapFetcher> CreateFetcher(
       const GURL& url,
+      const gfx::Size& desired_size,
+      chrome::BitmapFetcherDelegate* delegate,
       const net::NetworkTrafficAnnotationTag& traffic_annotation);
 
  private:
   friend class BitmapFetcherServiceTest;
 
-  // Gets the existing fetcher for |url| or constructs a new one if it doesn't
-  // exist.
-  const chrome::BitmapFetcher* EnsureFetcherForUrl(
+  struct FetcherEntry;
+
+  // Images requested for display are fetched before prefetched ones.
+  enum class Priority { VISIBLE, PREFETCH };
+
+  // Returns the key of the image for |url| at |desired_size| in the caches
+  // and in |active_fetchers_|.
+  static std::string GetCacheKey(const GURL& url,
+                                 const gfx::Size& desired_size);
+
+  // Gets the existing fetcher entry for |url| at |desired_size| or constructs
+  // a new one if it doesn't exist. With a disk cache, the fetcher of a new
+  // entry is only created once the image turns out not to be on disk. An
+  // existing entry waiting to be fetched is moved up if |priority| is higher
+  // than its own.
+  FetcherEntry* EnsureFetcherForUrl(
       const GURL& url,
-      const net::NetworkTrafficAnnotationTag& traffic_annotation);
+      const gfx::Size& desired_size,
+      const net::NetworkTrafficAnnotationTag& traffic_annotation,
+      Priority priority);
+
+  // Find a fetcher with a given |url| and |desired_size|. Return NULL if none
+  // is found, including when the fetch is still waiting to start.
+  const chrome::BitmapFetcher* FindFetcherForUrl(
+      const GURL& url,
+      const gfx::Size& desired_size);
 
-  // Find a fetcher with a given |url|. Return NULL if none is found.
-  const chrome::BitmapFetcher* FindFetcherForUrl(const GURL& url);
+  // Called with the image for |key| from the disk cache, or nullptr if it has
+  // to be fetched.
+  void DidLoadFromDiskCache(const std::string& key,
+                            std::unique_ptr<SkBitmap> bitmap);
 
-  // Remove |fetcher| from list of active fetchers. |fetcher| MUST be part of
-  // the list.
-  void RemoveFetcher(const chrome::BitmapFetcher* fetcher);
+  // Starts the fetcher for |entry| if fewer than |max_concurrent_fetches_| are
+  // running, and queues it by its priority otherwise.
+  void ScheduleFetch(FetcherEntry* entry);
 
-  // BitmapFetcherDelegate implementation.
-  void OnFetchComplete(const GURL& url, const SkBitmap* bitmap) override;
+  // Moves |entry|, which must be queued, to the back of the queue for
+  // |priority|.
+  void RequeueFetch(FetcherEntry* entry, Priority priority);
 
-  // Currently active image fetchers.
-  std::vector<std::unique_ptr<chrome::BitmapFetcher>> active_fetchers_;
+  // Starts queued fetches, highest priority first, while there is room.
+  void StartQueuedFetches();
 
-  // Currently active requests.
-  ScopedVector<BitmapFetcherRequest> requests_;
+  // Notifies the requests waiting for the image of |entry| of |bitmap|,
+  // caches it and removes |entry|.
+  void FinishRequests(FetcherEntry* entry, const SkBitmap* bitmap);
+
+  // Called by |entry| when its fetcher has completed.
+  void OnFetchComplete(FetcherEntry* entry, const SkBitmap* bitmap);
+
+  // Adds |bitmap| to the cache, evicting the least recently used images until
+  // the cache fits within |max_cache_bytes_|. Images larger than the whole
+  // budget are not cached.
+  void AddToCache(const std::string& key, const SkBitmap& bitmap);
+
+  // Evicts the least recently used images until at most |max_bytes| remain.
+  void TrimCache(size_t max_bytes);
+
+  void OnMemoryPressure(
+      base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level);
+
+  // An active fetcher and the requests waiting for its image. The requests are
+  // owned by |requests_|. |fetcher| is null while the disk cache is checked
+  // and while the fetch is queued. The entry is the delegate of |fetcher|, so
+  // that completed fetches can be told apart by their size.
+  struct FetcherEntry : public chrome::BitmapFetcherDelegate {
+    FetcherEntry(BitmapFetcherService* service,
+                 const GURL& url,
+                 const gfx::Size& desired_size,
+                 const net::NetworkTrafficAnnotationTag& traffic_annotation,
+                 Priority priority);
+    ~FetcherEntry() override;
+
+    // chrome::BitmapFetcherDelegate implementation.
+    void OnFetchComplete(const GURL& url, const SkBitmap* bitmap) override;
+
+    BitmapFetcherService* const service;
+    const GURL url;
+    const gfx::Size desired_size;
+    const std::string key;
+
+    std::unique_ptr<chrome::BitmapFetcher> fetcher;
+    base::LinkedList<BitmapFetcherRequest> requests;
+
+    const net::NetworkTrafficAnnotationTag traffic_annotation;
+    Priority priority;
+
+    // Position in |visible_queue_| or |prefetch_queue_|, if |queued|.
+    bool queued;
+    std::list<std::string>::iterator queue_position;
+  };
+
+  // Currently active image fetchers, keyed by GetCacheKey().
+  std::unordered_map<std::string, std::unique_ptr<FetcherEntry>>
+      active_fetchers_;
+
+  // Currently active requests, keyed by their ID.
+  std::unordered_map<RequestId, std::unique_ptr<BitmapFetcherRequest>>
+      requests_;
+
+  // Keys of the fetches waiting to start, in the order they will start within
+  // each priority.
+  std::list<std::string> visible_queue_;
+  std::list<std::string> prefetch_queue_;
+
+  // Number of fetchers which have been created and not yet completed.
+  size_t running_fetches_;
+  size_t max_concurrent_fetches_;
 
   // Cache of retrieved images.
   struct CacheEntry {
@@ -104,8 +238,21 @@ class BitmapFetcherService : public KeyedService,
     ~CacheEntry();
 
     std::unique_ptr<const SkBitmap> bitmap;
+
+    // Size of the pixel data of |bitmap|.
+    size_t byte_size;
   };
-  base::MRUCache<GURL, std::unique_ptr<CacheEntry>> cache_;
+  base::MRUCache<std::string, std::unique_ptr<CacheEntry>> cache_;
+
+  // The number of bytes of pixel data the cache may hold.
+  size_t max_cache_bytes_;
+
+  CacheStats cache_stats_;
+
+  std::unique_ptr<base::MemoryPressureListener> memory_pressure_listener_;
+
+  // Keeps decoded images across restarts. Null unless enabled.
+  std::unique_ptr<BitmapDiskCache> disk_cache_;
 
   // Current request ID to be used.
   int current_request_id_;
@@ -113,6 +260,8 @@ class BitmapFetcherService : public KeyedService,
   // Browser context this service is active for.
   content::BrowserContext* context_;
 
+  base::WeakPtrFactory<BitmapFetcherService> weak_ptr_factory_;
+
   DISALLOW_COPY_AND_ASSIGN(BitmapFetcherService);
 };
 
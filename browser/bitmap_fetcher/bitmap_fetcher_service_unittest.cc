@@ -5,22 +5,38 @@
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher_service.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/files/scoped_temp_dir.h"
 #include "base/macros.h"
+#include "base/memory/memory_pressure_listener.h"
 #include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "chrome/browser/bitmap_fetcher/bitmap_disk_cache.h"
 #include "chrome/browser/bitmap_fetcher/bitmap_fetcher.h"
+#include "chrome/browser/image_decoder.h"
 #include "chrome/test/base/testing_profile.h"
 #include "content/public/test/test_browser_thread_bundle.h"
+#include "net/base/load_flags.h"
 #include "net/traffic_annotation/network_traffic_annotation_test_helper.h"
+#include "net/url_request/test_url_fetcher_factory.h"
 #include "testing/gtest/include/gtest/gtest.h"
 #include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/geometry/size.h"
 
 namespace {
 
 class TestNotificationInterface {
  public:
   virtual ~TestNotificationInterface() {}
-  virtual void OnImageChanged() = 0;
+  virtual void OnImageChanged(const SkBitmap& image) = 0;
   virtual void OnRequestFinished() = 0;
 };
 
@@ -31,7 +47,7 @@ class TestObserver : public BitmapFetcherService::Observer {
 
   void OnImageChanged(BitmapFetcherService::RequestId request_id,
                       const SkBitmap& answers_image) override {
-    target_->OnImageChanged();
+    target_->OnImageChanged(answers_image);
   }
 
  private:
@@ -40,20 +56,60 @@ class TestObserver : public BitmapFetcherService::Observer {
   DISALLOW_COPY_AND_ASSIGN(TestObserver);
 };
 
+// The options of the last decode started by a TestBitmapFetcher.
+struct DecodeOptions {
+  int count = 0;
+  bool shrink_to_fit = false;
+  int64_t max_size_in_bytes = 0;
+};
+
+// Records the options of its decode instead of starting it, since decoding
+// requires a utility process.
+class TestBitmapFetcher : public chrome::BitmapFetcher {
+ public:
+  TestBitmapFetcher(const GURL& url,
+                    const gfx::Size& desired_size,
+                    chrome::BitmapFetcherDelegate* delegate,
+                    const net::NetworkTrafficAnnotationTag& traffic_annotation,
+                    DecodeOptions* last_decode)
+      : chrome::BitmapFetcher(url, desired_size, delegate, traffic_annotation),
+        last_decode_(last_decode) {}
+  ~TestBitmapFetcher() override {}
+
+ protected:
+  void StartDecode(std::vector<uint8_t> image_data,
+                   bool shrink_to_fit,
+                   int64_t max_size_in_bytes) override {
+    last_decode_->count++;
+    last_decode_->shrink_to_fit = shrink_to_fit;
+    last_decode_->max_size_in_bytes = max_size_in_bytes;
+  }
+
+ private:
+  DecodeOptions* last_decode_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestBitmapFetcher);
+};
+
 class TestService : public BitmapFetcherService {
  public:
-  explicit TestService(content::BrowserContext* context)
-      : BitmapFetcherService(context) {}
+  TestService(content::BrowserContext* context, DecodeOptions* last_decode)
+      : BitmapFetcherService(context), last_decode_(last_decode) {}
   ~TestService() override {}
 
   // Create a fetcher, but don't start downloading. That allows side-stepping
   // the decode step, which requires a utility process.
   std::unique_ptr<chrome::BitmapFetcher> CreateFetcher(
       const GURL& url,
+      const gfx::Size& desired_size,
+      chrome::BitmapFetcherDelegate* delegate,
       const net::NetworkTrafficAnnotationTag& traffic_annotation) override {
-    return base::MakeUnique<chrome::BitmapFetcher>(url, this,
-                                                   traffic_annotation);
+    return base::MakeUnique<TestBitmapFetcher>(
+        url, desired_size, delegate, traffic_annotation, last_decode_);
   }
+
+ private:
+  DecodeOptions* last_decode_;
 };
 
 }  // namespace
@@ -67,46 +123,107 @@ class BitmapFetcherServiceTest : public testing::Test,
   }
 
   void SetUp() override {
-    service_.reset(new TestService(&profile_));
+    service_.reset(new TestService(&profile_, &last_decode_));
     requests_finished_ = 0;
     images_changed_ = 0;
   }
 
-  const ScopedVector<BitmapFetcherRequest>& requests() const {
+  void TearDown() override {
+    service_.reset();
+    base::RunLoop().RunUntilIdle();
+  }
+
+  // Replaces the service with a new one, as after a restart.
+  void RecreateService() {
+    service_.reset();
+    service_.reset(new TestService(&profile_, &last_decode_));
+  }
+
+  const std::unordered_map<BitmapFetcherService::RequestId,
+                           std::unique_ptr<BitmapFetcherRequest>>&
+  requests() const {
     return service_->requests_;
   }
-  const std::vector<std::unique_ptr<chrome::BitmapFetcher>>& active_fetchers()
-      const {
+  const std::unordered_map<std::string,
+                           std::unique_ptr<BitmapFetcherService::FetcherEntry>>&
+  active_fetchers() const {
     return service_->active_fetchers_;
   }
   size_t cache_size() const { return service_->cache_.size(); }
+  void set_max_concurrent_fetches(size_t max_fetches) {
+    service_->max_concurrent_fetches_ = max_fetches;
+  }
+  void set_max_cache_bytes(size_t bytes) {
+    service_->max_cache_bytes_ = bytes;
+  }
 
-  void OnImageChanged() override { images_changed_++; }
+  // Gives the service a disk cache in a temporary directory which outlives
+  // the service, running its tasks on the current thread.
+  void EnableDiskCache() {
+    if (!disk_cache_dir_.IsValid())
+      ASSERT_TRUE(disk_cache_dir_.CreateUniqueTempDir());
+    service_->disk_cache_.reset(new BitmapDiskCache(
+        disk_cache_dir_.GetPath(), 1024 * 1024, base::TimeDelta::FromDays(1),
+        base::ThreadTaskRunnerHandle::Get()));
+  }
+
+  void OnImageChanged(const SkBitmap& image) override {
+    images_changed_++;
+    last_image_size_ = gfx::Size(image.width(), image.height());
+  }
 
   void OnRequestFinished() override { requests_finished_++; }
 
+  // Returns the fetcher for the full size image at |url|.
+  const chrome::BitmapFetcher* FindFetcher(const GURL& url) {
+    return service_->FindFetcherForUrl(url, gfx::Size());
+  }
+
+  // Simulates the download of the image at |url| requested at |desired_size|,
+  // up to the start of its decode.
+  void CompleteDownload(const GURL& url, const gfx::Size& desired_size) {
+    chrome::BitmapFetcher* fetcher = const_cast<chrome::BitmapFetcher*>(
+        service_->FindFetcherForUrl(url, desired_size));
+    ASSERT_TRUE(fetcher);
+    fetcher->Init(nullptr, std::string(), net::URLRequest::NEVER_CLEAR_REFERRER,
+                  net::LOAD_NORMAL);
+    fetcher->OnURLFetchComplete(fetcher->url_fetcher());
+  }
+
   // Simulate finishing a URL fetch and decode for the given fetcher.
-  void CompleteFetch(const GURL& url) {
-    const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
+  void CompleteFetch(const GURL& url) { CompleteFetchWithSize(url, 2); }
+
+  // Like CompleteFetch(), decoding to a square image of |size| pixels.
+  void CompleteFetchWithSize(const GURL& url, int size) {
+    CompleteSizedFetch(url, gfx::Size(), size);
+  }
+
+  // Like CompleteFetchWithSize(), for the fetch of the image at |url| which
+  // was requested at |desired_size|.
+  void CompleteSizedFetch(const GURL& url,
+                          const gfx::Size& desired_size,
+                          int size) {
+    const chrome::BitmapFetcher* fetcher =
+        service_->FindFetcherForUrl(url, desired_size);
     ASSERT_TRUE(fetcher);
 
     // Create a non-empty bitmap.
     SkBitmap image;
-    image.allocN32Pixels(2, 2);
+    image.allocN32Pixels(size, size);
     image.eraseColor(SK_ColorGREEN);
 
     const_cast<chrome::BitmapFetcher*>(fetcher)->OnImageDecoded(image);
   }
 
   void FailFetch(const GURL& url) {
-    const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
+    const chrome::BitmapFetcher* fetcher = FindFetcher(url);
     ASSERT_TRUE(fetcher);
     const_cast<chrome::BitmapFetcher*>(fetcher)->OnImageDecoded(SkBitmap());
   }
 
   // A failed decode results in a nullptr image.
   void FailDecode(const GURL& url) {
-    const chrome::BitmapFetcher* fetcher = service_->FindFetcherForUrl(url);
+    const chrome::BitmapFetcher* fetcher = FindFetcher(url);
     ASSERT_TRUE(fetcher);
     const_cast<chrome::BitmapFetcher*>(fetcher)->OnDecodeImageFailed();
   }
@@ -116,6 +233,8 @@ class BitmapFetcherServiceTest : public testing::Test,
 
   int images_changed_;
   int requests_finished_;
+  gfx::Size last_image_size_;
+  DecodeOptions last_decode_;
 
   const GURL url1_;
   const GURL url2_;
@@ -123,6 +242,8 @@ class BitmapFetcherServiceTest : public testing::Test,
  private:
   content::TestBrowserThreadBundle thread_bundle_;
   TestingProfile profile_;
+  base::ScopedTempDir disk_cache_dir_;
+  net::TestURLFetcherFactory url_fetcher_factory_;
 };
 
 TEST_F(BitmapFetcherServiceTest, RequestInvalidUrl) {
@@ -193,6 +314,29 @@ TEST_F(BitmapFetcherServiceTest, CancelRequest) {
   EXPECT_EQ(4, images_changed_);
 }
 
+TEST_F(BitmapFetcherServiceTest, CompletedFetchOnlyNotifiesItsRequests) {
+  const int kNumUrls = 50;
+  for (int i = 0; i < kNumUrls; ++i) {
+    GURL url("http://example.org/image-" + base::IntToString(i) + ".png");
+    service_->RequestImage(url, new TestObserver(this),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+    service_->RequestImage(url, new TestObserver(this),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+  }
+  EXPECT_EQ(static_cast<size_t>(kNumUrls), active_fetchers().size());
+  EXPECT_EQ(static_cast<size_t>(2 * kNumUrls), requests().size());
+
+  CompleteFetch(GURL("http://example.org/image-0.png"));
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(2, requests_finished_);
+  EXPECT_EQ(static_cast<size_t>(kNumUrls - 1), active_fetchers().size());
+  EXPECT_EQ(static_cast<size_t>(2 * kNumUrls - 2), requests().size());
+
+  // Requests which are still waiting are released with the service.
+  service_.reset();
+  EXPECT_EQ(2 * kNumUrls, requests_finished_);
+}
+
 TEST_F(BitmapFetcherServiceTest, FailedNullRequestsAreHandled) {
   service_->RequestImage(url1_, new TestObserver(this),
                          TRAFFIC_ANNOTATION_FOR_TESTS);
@@ -219,3 +363,180 @@ TEST_F(BitmapFetcherServiceTest, FailedRequestsDontEnterCache) {
   FailFetch(url2_);
   EXPECT_EQ(1U, cache_size());
 }
+
+TEST_F(BitmapFetcherServiceTest, CacheIsBoundedByBytes) {
+  // Room for two 16x16 images at four bytes per pixel.
+  const int kImageSize = 16;
+  const size_t kImageBytes = kImageSize * kImageSize * 4;
+  set_max_cache_bytes(2 * kImageBytes);
+
+  const GURL url3("http://example.org/sample-image-3.png");
+  for (const GURL& url : {url1_, url2_, url3}) {
+    service_->RequestImage(url, new TestObserver(this),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+  }
+  EXPECT_EQ(3U, service_->cache_stats().misses);
+
+  CompleteFetchWithSize(url1_, kImageSize);
+  CompleteFetchWithSize(url2_, kImageSize);
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(2 * kImageBytes, service_->cache_stats().bytes);
+
+  // Using |url1_| makes |url2_| the least recently used image.
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(1U, service_->cache_stats().hits);
+
+  CompleteFetchWithSize(url3, kImageSize);
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(1U, service_->cache_stats().evictions);
+  EXPECT_EQ(2 * kImageBytes, service_->cache_stats().bytes);
+
+  EXPECT_EQ(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url1_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+  EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+            service_->RequestImage(url2_, new TestObserver(this),
+                                   TRAFFIC_ANNOTATION_FOR_TESTS));
+
+  // Images larger than the whole budget are not cached.
+  CompleteFetchWithSize(url2_, 2 * kImageSize);
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(1U, service_->cache_stats().evictions);
+}
+
+TEST_F(BitmapFetcherServiceTest, MemoryPressureTrimsCache) {
+  const int kImageSize = 16;
+  const size_t kImageBytes = kImageSize * kImageSize * 4;
+  set_max_cache_bytes(4 * kImageBytes);
+
+  for (int i = 0; i < 4; ++i) {
+    GURL url("http://example.org/image-" + base::IntToString(i) + ".png");
+    service_->RequestImage(url, new TestObserver(this),
+                           TRAFFIC_ANNOTATION_FOR_TESTS);
+    CompleteFetchWithSize(url, kImageSize);
+  }
+  EXPECT_EQ(4U, cache_size());
+
+  // Moderate pressure keeps the most recently used half of the budget.
+  base::MemoryPressureListener::SimulatePressureNotification(
+      base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_MODERATE);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(2U, cache_size());
+  EXPECT_EQ(2 * kImageBytes, service_->cache_stats().bytes);
+
+  base::MemoryPressureListener::SimulatePressureNotification(
+      base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(0U, cache_size());
+  EXPECT_EQ(0U, service_->cache_stats().bytes);
+  EXPECT_EQ(4U, service_->cache_stats().evictions);
+}
+
+TEST_F(BitmapFetcherServiceTest, DiskCacheServesImagesAfterRestart) {
+  EnableDiskCache();
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+
+  // The fetcher is only created once the image is known not to be on disk.
+  EXPECT_FALSE(FindFetcher(url1_));
+  base::RunLoop().RunUntilIdle();
+  CompleteFetch(url1_);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1, images_changed_);
+
+  RecreateService();
+  EnableDiskCache();
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  base::RunLoop().RunUntilIdle();
+
+  // The image came from disk without fetching, and is now in memory too.
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(1U, service_->cache_stats().disk_hits);
+  EXPECT_EQ(0U, active_fetchers().size());
+  EXPECT_EQ(1U, cache_size());
+}
+
+TEST_F(BitmapFetcherServiceTest, FetchesBeyondLimitAreQueued) {
+  set_max_concurrent_fetches(2);
+  const GURL url3("http://example.org/sample-image-3.png");
+  for (const GURL& url : {url1_, url2_, url3}) {
+    EXPECT_NE(BitmapFetcherService::REQUEST_ID_INVALID,
+              service_->RequestImage(url, new TestObserver(this),
+                                     TRAFFIC_ANNOTATION_FOR_TESTS));
+  }
+  EXPECT_EQ(3U, active_fetchers().size());
+  EXPECT_TRUE(FindFetcher(url2_));
+  EXPECT_FALSE(FindFetcher(url3));
+
+  // Completing a fetch starts the queued one, and no image is lost.
+  CompleteFetch(url1_);
+  EXPECT_TRUE(FindFetcher(url3));
+  CompleteFetch(url2_);
+  CompleteFetch(url3);
+  EXPECT_EQ(3, images_changed_);
+  EXPECT_EQ(0U, active_fetchers().size());
+}
+
+TEST_F(BitmapFetcherServiceTest, VisibleRequestsOvertakeQueuedPrefetches) {
+  set_max_concurrent_fetches(1);
+  const GURL url3("http://example.org/sample-image-3.png");
+  service_->Prefetch(url1_, TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->Prefetch(url2_, TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->Prefetch(url3, TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_TRUE(FindFetcher(url1_));
+
+  // Requesting a queued prefetch for display moves it ahead of the others.
+  service_->RequestImage(url3, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  CompleteFetch(url1_);
+  EXPECT_TRUE(FindFetcher(url3));
+  EXPECT_FALSE(FindFetcher(url2_));
+
+  CompleteFetch(url3);
+  EXPECT_EQ(1, images_changed_);
+  EXPECT_TRUE(FindFetcher(url2_));
+}
+
+TEST_F(BitmapFetcherServiceTest, DecoderShrinksImagesToDesiredSize) {
+  const gfx::Size kDesiredSize(4, 4);
+  service_->RequestImage(url1_, kDesiredSize, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  service_->RequestImage(url1_, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+
+  // Each size of the same image has its own fetcher.
+  EXPECT_EQ(2U, active_fetchers().size());
+  EXPECT_TRUE(FindFetcher(url1_));
+
+  // The decoder service shrinks the image to the pixels of the desired size.
+  CompleteDownload(url1_, kDesiredSize);
+  EXPECT_EQ(1, last_decode_.count);
+  EXPECT_TRUE(last_decode_.shrink_to_fit);
+  EXPECT_EQ(4 * kDesiredSize.GetArea(), last_decode_.max_size_in_bytes);
+
+  CompleteDownload(url1_, gfx::Size());
+  EXPECT_EQ(2, last_decode_.count);
+  EXPECT_FALSE(last_decode_.shrink_to_fit);
+  EXPECT_EQ(ImageDecoder::kMaxImageSizeInBytes,
+            last_decode_.max_size_in_bytes);
+
+  // The decoded images reach the observers and the cache unchanged, even if
+  // one side is larger than the desired size.
+  CompleteSizedFetch(url1_, kDesiredSize, 8);
+  EXPECT_EQ(1, images_changed_);
+  EXPECT_EQ(gfx::Size(8, 8), last_image_size_);
+
+  CompleteFetchWithSize(url1_, 16);
+  EXPECT_EQ(2, images_changed_);
+  EXPECT_EQ(gfx::Size(16, 16), last_image_size_);
+  EXPECT_EQ(2U, cache_size());
+
+  // Both sizes are now served from the cache.
+  service_->RequestImage(url1_, kDesiredSize, new TestObserver(this),
+                         TRAFFIC_ANNOTATION_FOR_TESTS);
+  EXPECT_EQ(3, images_changed_);
+  EXPECT_EQ(gfx::Size(8, 8), last_image_size_);
+  EXPECT_EQ(1U, service_->cache_stats().hits);
+}
@@ -0,0 +1,100 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/budget_service/budget_chunks.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace {
+
+// The initial capacity of the ring buffer. Origins which are touched about
+// once a day end up with a handful of chunks; hourly awards give up to 96.
+constexpr size_t kInitialCapacity = 8;
+
+// The relative amount of a bill which may be left unpaid by Spend() because of
+// rounding errors in the running total.
+constexpr double kSpendTolerance = 1e-9;
+
+}  // namespace
+
+BudgetChunks::BudgetChunks() : head_(0), size_(0), total_(0) {}
+
+BudgetChunks::BudgetChunks(const BudgetChunks& other) = default;
+
+BudgetChunks::~BudgetChunks() {}
+
+BudgetChunks& BudgetChunks::operator=(const BudgetChunks& other) = default;
+
+const BudgetChunk& BudgetChunks::operator[](size_t index) const {
+  DCHECK_LT(index, size_);
+  return buffer_[(head_ + index) & (buffer_.size() - 1)];
+}
+
+void BudgetChunks::push_back(double amount, base::Time expiration) {
+  DCHECK(empty() || (*this)[size_ - 1].expiration <= expiration);
+
+  if (size_ == buffer_.size())
+    Grow();
+
+  BudgetChunk& chunk = buffer_[(head_ + size_) & (buffer_.size() - 1)];
+  chunk.amount = amount;
+  chunk.expiration = expiration;
+  ++size_;
+  total_ += amount;
+}
+
+void BudgetChunks::RemoveExpired(base::Time now) {
+  // This relies on the chunks being in expiration order.
+  while (!empty() && front().expiration <= now)
+    PopFront();
+}
+
+void BudgetChunks::Spend(double amount) {
+  double bill = amount;
+  while (bill > 0 && !empty()) {
+    BudgetChunk& chunk = buffer_[head_];
+    if (chunk.amount > bill) {
+      chunk.amount -= bill;
+      total_ -= bill;
+      bill = 0;
+      break;
+    }
+    bill -= chunk.amount;
+    PopFront();
+  }
+
+  // The running total may be off by rounding errors, so it can't be kept from
+  // going slightly negative by the caller's check against it.
+  if (total_ < 0)
+    total_ = 0;
+
+  // There should have been enough budget to cover the entire bill, up to the
+  // rounding errors of the running total.
+  DCHECK_LE(bill, kSpendTolerance * std::max(1.0, amount));
+}
+
+void BudgetChunks::PopFront() {
+  DCHECK(!empty());
+  total_ -= buffer_[head_].amount;
+  head_ = (head_ + 1) & (buffer_.size() - 1);
+  --size_;
+
+  // Reset the total once the buffer is empty so that rounding errors from the
+  // running total don't accumulate over the lifetime of the origin.
+  if (empty()) {
+    head_ = 0;
+    total_ = 0;
+  }
+}
+
+void BudgetChunks::Grow() {
+  std::vector<BudgetChunk> buffer(
+      buffer_.empty() ? kInitialCapacity : buffer_.size() * 2);
+  for (size_t i = 0; i < size_; ++i)
+    buffer[i] = (*this)[i];
+  buffer_.swap(buffer);
+  head_ = 0;
+}
@@ -0,0 +1,100 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNKS_H_
+#define CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNKS_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "base/time/time.h"
+
+// Holds information about individual pieces of awarded budget. There is a
+// one-to-one mapping of these to the chunks in the underlying database.
+struct BudgetChunk {
+  BudgetChunk() : amount(0) {}
+  BudgetChunk(double amount, base::Time expiration)
+      : amount(amount), expiration(expiration) {}
+
+  double amount;
+  base::Time expiration;
+};
+
+// The budget chunks awarded to an origin, in the order in which they expire.
+// Chunks are only ever added at the back and removed from the front, so they
+// are kept in a contiguous ring buffer together with a running total of the
+// budget they hold. Reading the total is O(1), and spending budget and removing
+// expired chunks are amortized O(1) per chunk added.
+class BudgetChunks {
+ public:
+  class const_iterator {
+   public:
+    const_iterator(const BudgetChunks* chunks, size_t index)
+        : chunks_(chunks), index_(index) {}
+
+    const BudgetChunk& operator*() const { return (*chunks_)[index_]; }
+    const BudgetChunk* operator->() const { return &(*chunks_)[index_]; }
+    const_iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const const_iterator& other) const {
+      return chunks_ == other.chunks_ && index_ == other.index_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    const BudgetChunks* chunks_;
+    size_t index_;
+  };
+
+  BudgetChunks();
+  BudgetChunks(const BudgetChunks& other);
+  ~BudgetChunks();
+
+  BudgetChunks& operator=(const BudgetChunks& other);
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  // The sum of the amounts of all chunks.
+  double total() const { return total_; }
+
+  // Access to the chunks, with index 0 being the soonest to expire.
+  const BudgetChunk& operator[](size_t index) const;
+  const BudgetChunk& front() const { return (*this)[0]; }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size_); }
+
+  // Adds a chunk at the back. It should not expire before any existing chunk.
+  void push_back(double amount, base::Time expiration);
+
+  // Removes all chunks which expire at or before |now|.
+  void RemoveExpired(base::Time now);
+
+  // Removes |amount| of budget, starting with the chunks which expire soonest.
+  // Chunks which are used up entirely are removed. There must be at least
+  // |amount| of budget available, as reported by total().
+  void Spend(double amount);
+
+ private:
+  // Removes the chunk at the front.
+  void PopFront();
+
+  // Doubles the capacity of |buffer_|, moving the chunks to its start.
+  void Grow();
+
+  // Ring buffer holding the chunks, starting at |head_|. The capacity is always
+  // zero or a power of two so that indices can be wrapped with a mask.
+  std::vector<BudgetChunk> buffer_;
+  size_t head_;
+  size_t size_;
+
+  double total_;
+};
+
+#endif  // CHROME_BROWSER_BUDGET_SERVICE_BUDGET_CHUNKS_H_
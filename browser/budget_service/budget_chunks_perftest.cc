@@ -0,0 +1,118 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+
+#include <list>
+#include <string>
+
+#include "base/strings/string_number_conversions.h"
+#include "base/time/time.h"
+#include "chrome/browser/budget_service/budget_chunks.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+
+namespace {
+
+// The number of times each chunk count is exercised.
+const int kIterations = 20000;
+
+// Chunk counts to measure. 96 is the number of hourly engagement awards an
+// origin can hold before the oldest one expires.
+const size_t kChunkCounts[] = {4, 24, 96};
+
+base::Time ExpirationForChunk(size_t index) {
+  return base::Time::UnixEpoch() + base::TimeDelta::FromHours(index);
+}
+
+// The representation used by BudgetDatabase before BudgetChunks, where the
+// total had to be computed by walking the list.
+struct ListChunk {
+  ListChunk(double amount, base::Time expiration)
+      : amount(amount), expiration(expiration) {}
+
+  double amount;
+  base::Time expiration;
+};
+
+double ListTotal(const std::list<ListChunk>& chunks) {
+  double total = 0;
+  for (const ListChunk& chunk : chunks)
+    total += chunk.amount;
+  return total;
+}
+
+// Simulates the steady state of an origin which is awarded budget hourly and
+// queries and spends budget for each award: an hour passes, the oldest chunk
+// expires, a new one is added, the total is read twice and a small amount is
+// spent.
+double RunListWorkload(size_t chunk_count) {
+  std::list<ListChunk> chunks;
+  for (size_t i = 0; i < chunk_count; ++i)
+    chunks.emplace_back(1, ExpirationForChunk(i));
+
+  double sum = 0;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; ++i) {
+    size_t next = chunk_count + i;
+    base::Time now = ExpirationForChunk(i);
+    auto iter = chunks.begin();
+    while (iter != chunks.end() && iter->expiration <= now)
+      iter = chunks.erase(iter);
+    chunks.emplace_back(1, ExpirationForChunk(next));
+
+    sum += ListTotal(chunks);
+    if (ListTotal(chunks) >= 0.5) {
+      double bill = 0.5;
+      for (iter = chunks.begin(); iter != chunks.end();) {
+        if (iter->amount > bill) {
+          iter->amount -= bill;
+          break;
+        }
+        bill -= iter->amount;
+        iter = chunks.erase(iter);
+      }
+    }
+  }
+  double elapsed = (base::TimeTicks::Now() - start).InMicrosecondsF();
+
+  // Keep the compiler from discarding the work.
+  EXPECT_LT(0, sum);
+  return elapsed * 1000 / kIterations;
+}
+
+double RunBudgetChunksWorkload(size_t chunk_count) {
+  BudgetChunks chunks;
+  for (size_t i = 0; i < chunk_count; ++i)
+    chunks.push_back(1, ExpirationForChunk(i));
+
+  double sum = 0;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; ++i) {
+    size_t next = chunk_count + i;
+    chunks.RemoveExpired(ExpirationForChunk(i));
+    chunks.push_back(1, ExpirationForChunk(next));
+
+    sum += chunks.total();
+    if (chunks.total() >= 0.5)
+      chunks.Spend(0.5);
+  }
+  double elapsed = (base::TimeTicks::Now() - start).InMicrosecondsF();
+
+  EXPECT_LT(0, sum);
+  return elapsed * 1000 / kIterations;
+}
+
+}  // namespace
+
+TEST(BudgetChunksPerfTest, AwardQueryAndSpend) {
+  for (size_t chunk_count : kChunkCounts) {
+    std::string trace = base::SizeTToString(chunk_count) + "_chunks";
+    perf_test::PrintResult("budget_chunks_list", "", trace,
+                           RunListWorkload(chunk_count), "ns/op", true);
+    perf_test::PrintResult("budget_chunks_ring_buffer", "", trace,
+                           RunBudgetChunksWorkload(chunk_count), "ns/op",
+                           true);
+  }
+}
@@ -0,0 +1,132 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/budget_service/budget_chunks.h"
+
+#include <stddef.h>
+
+#include "base/time/time.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// Matches the number of hourly engagement awards an origin can accumulate
+// before the first one expires.
+const size_t kMaxChunks = 96;
+
+base::Time ExpirationForChunk(size_t index) {
+  return base::Time::UnixEpoch() + base::TimeDelta::FromHours(index);
+}
+
+}  // namespace
+
+TEST(BudgetChunksTest, PushBackKeepsTotal) {
+  BudgetChunks chunks;
+  EXPECT_TRUE(chunks.empty());
+  EXPECT_EQ(0, chunks.total());
+
+  for (size_t i = 0; i < kMaxChunks; ++i)
+    chunks.push_back(1, ExpirationForChunk(i));
+
+  ASSERT_EQ(kMaxChunks, chunks.size());
+  EXPECT_EQ(static_cast<double>(kMaxChunks), chunks.total());
+
+  // Iteration starts with the soonest expiring chunk.
+  size_t index = 0;
+  for (const BudgetChunk& chunk : chunks)
+    EXPECT_EQ(ExpirationForChunk(index++), chunk.expiration);
+  EXPECT_EQ(kMaxChunks, index);
+}
+
+TEST(BudgetChunksTest, Spend) {
+  BudgetChunks chunks;
+  chunks.push_back(2, ExpirationForChunk(0));
+  chunks.push_back(3, ExpirationForChunk(1));
+  chunks.push_back(4, ExpirationForChunk(2));
+
+  // Spending less than the first chunk only reduces that chunk.
+  chunks.Spend(1);
+  ASSERT_EQ(3U, chunks.size());
+  EXPECT_EQ(1, chunks.front().amount);
+  EXPECT_EQ(8, chunks.total());
+
+  // Spending across chunks removes the chunks which are used up.
+  chunks.Spend(5);
+  ASSERT_EQ(1U, chunks.size());
+  EXPECT_EQ(3, chunks.front().amount);
+  EXPECT_EQ(ExpirationForChunk(2), chunks.front().expiration);
+  EXPECT_EQ(3, chunks.total());
+
+  // Spending exactly the remaining budget empties the chunks.
+  chunks.Spend(3);
+  EXPECT_TRUE(chunks.empty());
+  EXPECT_EQ(0, chunks.total());
+}
+
+TEST(BudgetChunksTest, SpendWithRoundingErrors) {
+  BudgetChunks chunks;
+  for (size_t i = 0; i < 10; ++i)
+    chunks.push_back(0.1, ExpirationForChunk(i));
+
+  // The running total differs from the sum of the chunks by rounding errors,
+  // which must not trip up spending all of it.
+  chunks.Spend(0.35);
+  chunks.Spend(chunks.total());
+  EXPECT_GE(chunks.total(), 0);
+  for (const BudgetChunk& chunk : chunks)
+    EXPECT_NEAR(0, chunk.amount, 1e-9);
+}
+
+TEST(BudgetChunksTest, SpendStopsOncePaid) {
+  BudgetChunks chunks;
+  chunks.push_back(2, ExpirationForChunk(0));
+  chunks.push_back(0, ExpirationForChunk(1));
+  chunks.push_back(1, ExpirationForChunk(2));
+
+  // Chunks after the ones which paid the bill are left alone, even if they are
+  // empty.
+  chunks.Spend(2);
+  ASSERT_EQ(2U, chunks.size());
+  EXPECT_EQ(ExpirationForChunk(1), chunks.front().expiration);
+  EXPECT_EQ(1, chunks.total());
+}
+
+TEST(BudgetChunksTest, RemoveExpired) {
+  BudgetChunks chunks;
+  for (size_t i = 0; i < 10; ++i)
+    chunks.push_back(1, ExpirationForChunk(i));
+
+  // Chunks expiring at exactly the given time are removed as well.
+  chunks.RemoveExpired(ExpirationForChunk(4));
+  ASSERT_EQ(5U, chunks.size());
+  EXPECT_EQ(ExpirationForChunk(5), chunks.front().expiration);
+  EXPECT_EQ(5, chunks.total());
+
+  chunks.RemoveExpired(ExpirationForChunk(20));
+  EXPECT_TRUE(chunks.empty());
+  EXPECT_EQ(0, chunks.total());
+}
+
+TEST(BudgetChunksTest, WrapAround) {
+  BudgetChunks chunks;
+  size_t next = 0;
+
+  // Repeatedly add and expire chunks so that the contents of the ring buffer
+  // wrap around its end, and make sure the order is preserved across growth.
+  for (size_t round = 0; round < 4; ++round) {
+    for (size_t i = 0; i < 7 * (round + 1); ++i, ++next)
+      chunks.push_back(1, ExpirationForChunk(next));
+    chunks.RemoveExpired(ExpirationForChunk(next - 4));
+    ASSERT_EQ(3U, chunks.size());
+    EXPECT_EQ(3, chunks.total());
+    EXPECT_EQ(ExpirationForChunk(next - 3), chunks[0].expiration);
+    EXPECT_EQ(ExpirationForChunk(next - 1), chunks[2].expiration);
+  }
+
+  // Copies hold the same chunks.
+  BudgetChunks copy(chunks);
+  ASSERT_EQ(chunks.size(), copy.size());
+  EXPECT_EQ(chunks.total(), copy.total());
+  EXPECT_EQ(chunks[1].expiration, copy[1].expiration);
+}
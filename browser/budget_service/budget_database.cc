@@ -4,8 +4,12 @@
 
 #include "chrome/browser/budget_service/budget_database.h"
 
+#include <algorithm>
+
+#include "base/feature_list.h"
 #include "base/memory/ptr_util.h"
 #include "base/metrics/histogram_macros.h"
+#include "base/threading/thread_task_runner_handle.h"
 #include "base/time/clock.h"
 #include "base/time/default_clock.h"
 #include "chrome/browser/budget_service/budget.pb.h"
@@ -21,6 +25,11 @@ using content::BrowserThread;
 
 namespace {
 
+// When enabled, the cache is populated with all origins in the database as
+// soon as the database has been opened, rather than one origin at a time.
+const base::Feature kBudgetDatabasePreload{"BudgetDatabasePreload",
+                                           base::FEATURE_DISABLED_BY_DEFAULT};
+
 // UMA are logged for the database with this string as part of the name.
 // They will be LevelDB.*.BudgetManager. Changes here should be synchronized
 // with histograms.xml.
@@ -35,24 +44,70 @@ constexpr int kBudgetDurationInDays = 4;
 // various actions.
 constexpr double kMaximumHourlyBudget = 12.0 / 24.0;
 
+// The maximum amount of time that writes are held back so that updates for
+// many origins, e.g. during a burst of push messages, can be written to the
+// database as a single batch.
+constexpr int kWriteDelayInMilliseconds = 100;
+
+// How long a snapshot of an origin's engagement score is used before it is
+// read from the SiteEngagementService again. This matches the minimum interval
+// between engagement awards, so that each award sees a fresh score.
+constexpr int kEngagementSnapshotLifetimeInHours = 1;
+
+// The first sweep of expired budget starts this long after browser startup
+// has completed, and later sweeps follow at the given interval.
+constexpr int kInitialSweepDelayInMinutes = 5;
+constexpr int kSweepIntervalInHours = 24;
+
+// The number of database entries handled by each task of a sweep.
+constexpr size_t kSweepSliceSize = 50;
+
+// The default maximum number of origins kept in the cache.
+constexpr size_t kMaxCachedOrigins = 1000;
+
+// A failed sweep write leaves expired data behind, which the next sweep will
+// find again, so there is nothing to do.
+void IgnoreSweepWriteResult(bool success) {}
+
 }  // namespace
 
-BudgetDatabase::BudgetInfo::BudgetInfo() {}
+BudgetDatabase::BudgetInfo::BudgetInfo()
+    : engagement_score(0), engagement_max_points(0) {}
 
 BudgetDatabase::BudgetInfo::BudgetInfo(const BudgetInfo&& other)
-    : last_engagement_award(other.last_engagement_award) {
+    : last_engagement_award(other.last_engagement_award),
+      engagement_score(other.engagement_score),
+      engagement_max_points(other.engagement_max_points),
+      engagement_snapshot_time(other.engagement_snapshot_time),
+      lru_position(other.lru_position) {
   chunks = std::move(other.chunks);
 }
 
 BudgetDatabase::BudgetInfo::~BudgetInfo() {}
 
+BudgetDatabase::SpendBatch::SpendBatch() : pending_syncs(0) {}
+
+BudgetDatabase::SpendBatch::~SpendBatch() {}
+
 BudgetDatabase::BudgetDatabase(
     Profile* profile,
     const base::FilePath& database_dir,
     const scoped_refptr<base::SequencedTaskRunner>& task_runner)
-    : profile_(profile),
+    : SiteEngagementObserver(SiteEngagementService::Get(profile)),
+      profile_(profile),
       db_(new leveldb_proto::ProtoDatabaseImpl<budget_service::Budget>(
           task_runner)),
+      max_cached_origins_(kMaxCachedOrigins),
+      preloading_(base::FeatureList::IsEnabled(kBudgetDatabasePreload)),
+      preload_reads_(0),
+      next_batch_id_(0),
+      write_delay_(
+          base::TimeDelta::FromMilliseconds(kWriteDelayInMilliseconds)),
+      sweeping_(false),
+      sweep_position_(0),
+      sweep_reads_(0),
+      database_read_count_(0),
+      database_write_count_(0),
       clock_(base::WrapUnique(new base::DefaultClock)),
       weak_ptr_factory_(this) {
   db_->Init(kDatabaseUMAName, database_dir,
@@ -60,7 +115,13 @@ BudgetDatabase::BudgetDatabase(
                        weak_ptr_factory_.GetWeakPtr()));
 }
 
-BudgetDatabase::~BudgetDatabase() {}
+BudgetDatabase::~BudgetDatabase() {
+  // Make sure that pending writes reach the database. The ProtoDatabase
+  // sequences the write before its own destruction on the task runner, but the
+  // callbacks will not be run.
+  if (!dirty_origins_.empty())
+    FlushDirtyOrigins();
+}
 
 void BudgetDatabase::GetBudgetDetails(const url::Origin& origin,
                                       const GetBudgetCallback& callback) {
@@ -77,28 +138,379 @@ void BudgetDatabase::SpendBudget(const url::Origin& origin,
                                callback));
 }
 
+void BudgetDatabase::SpendBudgetBatch(
+    const std::vector<SpendRequest>& requests,
+    const SpendBudgetBatchCallback& callback) {
+  if (requests.empty()) {
+    callback.Run(std::vector<SpendResult>());
+    return;
+  }
+
+  int batch_id = next_batch_id_++;
+  std::unique_ptr<SpendBatch> batch(new SpendBatch());
+  batch->requests = requests;
+  batch->callback = callback;
+
+  // Pin the origins so that the ones which are synced first are not evicted
+  // while the batch waits for the others.
+  for (const SpendRequest& request : requests) {
+    if (batch->sync_results.insert(std::make_pair(request.first, false))
+            .second) {
+      pinned_origins_.insert(request.first);
+    }
+  }
+  batch->pending_syncs = batch->sync_results.size();
+
+  // Copy the origins, since the batch may complete synchronously while they
+  // are being synced.
+  std::vector<url::Origin> origins;
+  for (const auto& sync_result : batch->sync_results)
+    origins.push_back(sync_result.first);
+  pending_batches_[batch_id] = std::move(batch);
+
+  for (const url::Origin& origin : origins) {
+    SyncCache(origin, base::Bind(&BudgetDatabase::SpendBudgetBatchAfterSync,
+                                 weak_ptr_factory_.GetWeakPtr(), batch_id,
+                                 origin));
+  }
+}
+
+void BudgetDatabase::SetMaxCachedOrigins(size_t max_cached_origins) {
+  DCHECK_GT(max_cached_origins, 0U);
+  max_cached_origins_ = max_cached_origins;
+  EvictIfNeeded();
+}
+
 void BudgetDatabase::SetClockForTesting(std::unique_ptr<base::Clock> clock) {
   clock_ = std::move(clock);
 }
 
+void BudgetDatabase::SetWriteDelayForTesting(base::TimeDelta write_delay) {
+  write_delay_ = write_delay;
+}
+
+void BudgetDatabase::OnEngagementIncreased(content::WebContents* web_contents,
+                                           const GURL& url,
+                                           double score) {
+  // Drop the snapshot so that the next spend sees the new score. The budget
+  // itself only changes at the next engagement award.
+  auto iter = budget_map_.find(url::Origin(url));
+  if (iter != budget_map_.end())
+    iter->second.engagement_snapshot_time = base::Time();
+}
+
 void BudgetDatabase::OnDatabaseInit(bool success) {
-  // TODO(harkness): Consider caching the budget database now?
+  // Keep the sweep from competing with startup work.
+  if (success) {
+    BrowserThread::PostAfterStartupTask(
+        FROM_HERE, base::ThreadTaskRunnerHandle::Get(),
+        base::Bind(&BudgetDatabase::ScheduleSweep,
+                   weak_ptr_factory_.GetWeakPtr(),
+                   base::TimeDelta::FromMinutes(kInitialSweepDelayInMinutes)));
+  }
+
+  if (!preloading_)
+    return;
+
+  // If the database failed to open, individual reads will report the error.
+  if (!success) {
+    FinishPreloadCache();
+    return;
+  }
+
+  db_->LoadEntries(base::Bind(&BudgetDatabase::DidPreloadCache,
+                              weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::DidPreloadCache(
+    bool success,
+    std::unique_ptr<std::vector<budget_service::Budget>> entries) {
+  bool found_legacy_entry = false;
+  if (success && entries) {
+    for (const budget_service::Budget& budget : *entries) {
+      // Origins beyond the size of the cache are loaded on demand.
+      if (budget_map_.size() >= max_cached_origins_)
+        break;
+
+      if (!budget.has_origin()) {
+        found_legacy_entry = true;
+        continue;
+      }
+
+      url::Origin origin(GURL(budget.origin()));
+      if (origin.unique() || IsCached(origin))
+        continue;
+      CacheBudget(origin, budget);
+    }
+  }
+
+  if (found_legacy_entry && budget_map_.size() < max_cached_origins_) {
+    db_->LoadKeys(base::Bind(&BudgetDatabase::DidLoadKeysForPreload,
+                             weak_ptr_factory_.GetWeakPtr()));
+    return;
+  }
+
+  FinishPreloadCache();
+}
+
+void BudgetDatabase::DidLoadKeysForPreload(
+    bool success,
+    std::unique_ptr<std::vector<std::string>> keys) {
+  if (success && keys) {
+    for (const std::string& key : *keys) {
+      if (budget_map_.size() + preload_reads_ >= max_cached_origins_)
+        break;
+
+      // The key is the serialized origin.
+      url::Origin origin(GURL(key));
+      if (origin.unique() || IsCached(origin))
+        continue;
+
+      preload_reads_++;
+      database_read_count_++;
+      db_->GetEntry(key, base::Bind(&BudgetDatabase::DidLoadEntryForPreload,
+                                    weak_ptr_factory_.GetWeakPtr(), origin));
+    }
+  }
+
+  if (preload_reads_ == 0)
+    FinishPreloadCache();
+}
+
+void BudgetDatabase::DidLoadEntryForPreload(
+    const url::Origin& origin,
+    bool success,
+    std::unique_ptr<budget_service::Budget> budget) {
+  if (success && budget && !IsCached(origin)) {
+    CacheBudget(origin, *budget);
+    if (!budget->has_origin())
+      dirty_origins_.insert(origin);
+  }
+
+  DCHECK_GT(preload_reads_, 0U);
+  if (--preload_reads_ > 0)
+    return;
+
+  // Write the origins of the legacy entries back along with their budget.
+  if (!dirty_origins_.empty())
+    FlushDirtyOrigins();
+  FinishPreloadCache();
+}
+
+void BudgetDatabase::FinishPreloadCache() {
+  preloading_ = false;
+
+  std::vector<base::Closure> waiters;
+  waiters.swap(preload_waiters_);
+  for (const base::Closure& waiter : waiters)
+    waiter.Run();
+}
+
+void BudgetDatabase::ScheduleSweep(base::TimeDelta delay) {
+  sweep_timer_.Start(FROM_HERE, delay, this, &BudgetDatabase::StartSweep);
+}
+
+void BudgetDatabase::StartSweep() {
+  if (sweeping_)
+    return;
+
+  sweeping_ = true;
+  db_->LoadKeys(base::Bind(&BudgetDatabase::DidLoadKeysForSweep,
+                           weak_ptr_factory_.GetWeakPtr()));
+}
+
+void BudgetDatabase::DidLoadKeysForSweep(
+    bool success,
+    std::unique_ptr<std::vector<std::string>> keys) {
+  if (!success || !keys) {
+    FinishSweep();
+    return;
+  }
+
+  sweep_keys_ = std::move(keys);
+  sweep_position_ = 0;
+  SweepNextSlice();
+}
+
+void BudgetDatabase::SweepNextSlice() {
+  sweep_updates_.reset(new leveldb_proto::ProtoDatabase<
+                       budget_service::Budget>::KeyEntryVector());
+  sweep_removals_.reset(new std::vector<std::string>());
+
+  // The key is the serialized origin, which also covers entries written before
+  // the origin was stored in the proto.
+  std::vector<std::string> keys;
+  size_t slice_end =
+      std::min(sweep_keys_->size(), sweep_position_ + kSweepSliceSize);
+  for (; sweep_position_ < slice_end; ++sweep_position_) {
+    const std::string& key = (*sweep_keys_)[sweep_position_];
+    if (IsSweepable(url::Origin(GURL(key))))
+      keys.push_back(key);
+  }
+
+  if (keys.empty()) {
+    WriteSweptSlice();
+    return;
+  }
+
+  sweep_reads_ = keys.size();
+  for (const std::string& key : keys) {
+    database_read_count_++;
+    db_->GetEntry(key, base::Bind(&BudgetDatabase::DidLoadEntryForSweep,
+                                  weak_ptr_factory_.GetWeakPtr(), key));
+  }
+}
+
+void BudgetDatabase::DidLoadEntryForSweep(
+    const std::string& key,
+    bool success,
+    std::unique_ptr<budget_service::Budget> budget) {
+  if (success && budget) {
+    base::Time now = clock_->Now();
+    budget_service::Budget swept(*budget);
+    swept.clear_budget();
+    for (const auto& chunk : budget->budget()) {
+      if (base::Time::FromInternalValue(chunk.expiration()) > now)
+        *swept.add_budget() = chunk;
+    }
+
+    // This mirrors CleanupExpiredBudget. Entries without the origin gain it
+    // when they are rewritten, so that the preload can find them.
+    if (swept.budget_size() == 0 &&
+        base::Time::FromInternalValue(budget->engagement_last_updated()) <
+            now - base::TimeDelta::FromDays(kBudgetDurationInDays)) {
+      sweep_removals_->push_back(key);
+    } else if (swept.budget_size() != budget->budget_size() ||
+               !budget->has_origin()) {
+      swept.set_origin(key);
+      sweep_updates_->push_back(std::make_pair(key, swept));
+    }
+  }
+
+  DCHECK_GT(sweep_reads_, 0U);
+  if (--sweep_reads_ > 0)
+    return;
+  WriteSweptSlice();
+}
+
+void BudgetDatabase::WriteSweptSlice() {
+  // Origins may have been loaded or written while their entries were read, in
+  // which case the cache is authoritative.
+  sweep_updates_->erase(
+      std::remove_if(
+          sweep_updates_->begin(), sweep_updates_->end(),
+          [this](const std::pair<std::string, budget_service::Budget>& entry) {
+            return !IsSweepable(url::Origin(GURL(entry.first)));
+          }),
+      sweep_updates_->end());
+  sweep_removals_->erase(
+      std::remove_if(sweep_removals_->begin(), sweep_removals_->end(),
+                     [this](const std::string& key) {
+                       return !IsSweepable(url::Origin(GURL(key)));
+                     }),
+      sweep_removals_->end());
+
+  if (!sweep_updates_->empty() || !sweep_removals_->empty()) {
+    database_write_count_++;
+    db_->UpdateEntries(std::move(sweep_updates_), std::move(sweep_removals_),
+                       base::Bind(&IgnoreSweepWriteResult));
+  }
+
+  if (sweep_position_ < sweep_keys_->size()) {
+    base::ThreadTaskRunnerHandle::Get()->PostTask(
+        FROM_HERE, base::Bind(&BudgetDatabase::SweepNextSlice,
+                              weak_ptr_factory_.GetWeakPtr()));
+    return;
+  }
+
+  FinishSweep();
+}
+
+void BudgetDatabase::FinishSweep() {
+  sweeping_ = false;
+  sweep_keys_.reset();
+  sweep_position_ = 0;
+  sweep_updates_.reset();
+  sweep_removals_.reset();
+  sweep_reads_ = 0;
+  origins_written_during_sweep_.clear();
+  ScheduleSweep(base::TimeDelta::FromHours(kSweepIntervalInHours));
+}
+
+bool BudgetDatabase::IsSweepable(const url::Origin& origin) const {
+  return !origin.unique() && !IsCached(origin) &&
+         !pending_loads_.count(origin) && !dirty_origins_.count(origin) &&
+         !pinned_origins_.count(origin) &&
+         !origins_written_during_sweep_.count(origin);
 }
 
 bool BudgetDatabase::IsCached(const url::Origin& origin) const {
   return budget_map_.find(origin) != budget_map_.end();
 }
 
+BudgetDatabase::BudgetInfo& BudgetDatabase::AddCacheEntry(
+    const url::Origin& origin) {
+  DCHECK(!IsCached(origin));
+  BudgetInfo& info = budget_map_[origin];
+  info.lru_position = lru_origins_.insert(lru_origins_.begin(), origin);
+  return info;
+}
+
+void BudgetDatabase::RemoveCacheEntry(const url::Origin& origin) {
+  auto iter = budget_map_.find(origin);
+  DCHECK(iter != budget_map_.end());
+  lru_origins_.erase(iter->second.lru_position);
+  budget_map_.erase(iter);
+}
+
+BudgetDatabase::BudgetInfo& BudgetDatabase::GetCacheEntry(
+    const url::Origin& origin) {
+  auto iter = budget_map_.find(origin);
+  DCHECK(iter != budget_map_.end());
+  return iter->second;
+}
+
+void BudgetDatabase::MarkRecentlyUsed(const url::Origin& origin) {
+  auto iter = budget_map_.find(origin);
+  DCHECK(iter != budget_map_.end());
+  lru_origins_.splice(lru_origins_.begin(), lru_origins_,
+                      iter->second.lru_position);
+}
+
+void BudgetDatabase::EvictIfNeeded() {
+  bool skipped_dirty_origin = false;
+  auto iter = lru_origins_.end();
+  while (budget_map_.size() > max_cached_origins_ &&
+         iter != lru_origins_.begin()) {
+    --iter;
+
+    // Dirty origins would lose their changes, so they are only evicted once
+    // they have been written. Pinned origins are still being used.
+    if (dirty_origins_.count(*iter) || pinned_origins_.count(*iter)) {
+      skipped_dirty_origin = true;
+      continue;
+    }
+
+    // The origin is copied since erasing it from the list destroys it.
+    url::Origin origin = *iter;
+    iter = lru_origins_.erase(iter);
+    budget_map_.erase(origin);
+    cache_stats_.evictions++;
+  }
+
+  // Write the dirty origins now rather than waiting for the timer, after which
+  // eviction is attempted again.
+  if (skipped_dirty_origin && budget_map_.size() > max_cached_origins_ &&
+      !dirty_origins_.empty()) {
+    FlushDirtyOrigins();
+  }
+}
+
 double BudgetDatabase::GetBudget(const url::Origin& origin) const {
-  double total = 0;
   auto iter = budget_map_.find(origin);
   if (iter == budget_map_.end())
-    return total;
-
-  const BudgetInfo& info = iter->second;
-  for (const BudgetChunk& chunk : info.chunks)
-    total += chunk.amount;
-  return total;
+    return 0;
+  return iter->second.chunks.total();
 }
 
 void BudgetDatabase::AddToCache(
@@ -119,18 +531,24 @@ void BudgetDatabase::AddToCache(
     return;
   }
 
-  // Add the data to the cache, converting from the proto format to an STL
-  // format which is better for removing things from the list.
-  BudgetInfo& info = budget_map_[origin];
-  for (const auto& chunk : budget_proto->budget()) {
-    info.chunks.emplace_back(chunk.amount(),
-                             base::Time::FromInternalValue(chunk.expiration()));
+  CacheBudget(origin, *budget_proto);
+  callback.Run(success);
+}
+
+void BudgetDatabase::CacheBudget(const url::Origin& origin,
+                                 const budget_service::Budget& budget) {
+  DCHECK(!IsCached(origin));
+
+  // Add the data to the cache, converting from the proto format to a ring
+  // buffer which is better for removing things from the front.
+  BudgetInfo& info = AddCacheEntry(origin);
+  for (const auto& chunk : budget.budget()) {
+    info.chunks.push_back(chunk.amount(),
+                          base::Time::FromInternalValue(chunk.expiration()));
   }
 
   info.last_engagement_award =
-      base::Time::FromInternalValue(budget_proto->engagement_last_updated());
-
-  callback.Run(success);
+      base::Time::FromInternalValue(budget.engagement_last_updated());
 }
 
 void BudgetDatabase::GetBudgetAfterSync(const url::Origin& origin,
@@ -160,7 +578,7 @@ void BudgetDatabase::GetBudgetAfterSync(const url::Origin& origin,
 
   // Starting with the soonest expiring chunks, add entries for the
   // expiration times going forward.
-  const BudgetChunks& chunks = budget_map_[origin].chunks;
+  const BudgetChunks& chunks = GetCacheEntry(origin).chunks;
   for (const auto& chunk : chunks) {
     blink::mojom::BudgetStatePtr prediction(blink::mojom::BudgetState::New());
     total -= chunk.amount;
@@ -183,44 +601,104 @@ void BudgetDatabase::SpendBudgetAfterSync(const url::Origin& origin,
     return;
   }
 
+  if (!SpendFromCache(origin, amount)) {
+    callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
+                 false /* success */);
+    return;
+  }
+
+  // Now that the cache is updated, write the data to the database.
+  WriteCachedValuesToDatabase(
+      origin, base::Bind(&BudgetDatabase::SpendBudgetAfterWrite,
+                         weak_ptr_factory_.GetWeakPtr(), callback));
+}
+
+bool BudgetDatabase::SpendFromCache(const url::Origin& origin, double amount) {
   // Get the current SES score, to generate UMA.
-  SiteEngagementService* service = SiteEngagementService::Get(profile_);
-  double score = service->GetScore(origin.GetURL());
+  double score = GetEngagementScore(origin);
 
-  // Walk the list of budget chunks to see if the origin has enough budget.
-  double total = 0;
-  BudgetInfo& info = budget_map_[origin];
-  for (const BudgetChunk& chunk : info.chunks)
-    total += chunk.amount;
+  // Check whether the origin has enough budget.
+  BudgetInfo& info = GetCacheEntry(origin);
+  double total = info.chunks.total();
 
   if (total < amount) {
     UMA_HISTOGRAM_COUNTS_100("PushMessaging.SESForNoBudgetOrigin", score);
-    callback.Run(blink::mojom::BudgetServiceErrorType::NONE,
-                 false /* success */);
-    return;
+    return false;
   } else if (total < amount * 2) {
     UMA_HISTOGRAM_COUNTS_100("PushMessaging.SESForLowBudgetOrigin", score);
   }
 
-  // Walk the chunks and remove enough budget to cover the needed amount.
-  double bill = amount;
-  for (auto iter = info.chunks.begin(); iter != info.chunks.end();) {
-    if (iter->amount > bill) {
-      iter->amount -= bill;
-      bill = 0;
-      break;
+  // Remove enough budget to cover the needed amount, starting with the chunks
+  // which expire soonest.
+  info.chunks.Spend(amount);
+  return true;
+}
+
+void BudgetDatabase::SpendBudgetBatchAfterSync(int batch_id,
+                                               const url::Origin& origin,
+                                               bool success) {
+  auto batch_iter = pending_batches_.find(batch_id);
+  DCHECK(batch_iter != pending_batches_.end());
+  SpendBatch* batch = batch_iter->second.get();
+  batch->sync_results[origin] = success;
+  DCHECK_GT(batch->pending_syncs, 0U);
+  if (--batch->pending_syncs > 0)
+    return;
+
+  std::unique_ptr<SpendBatch> owned_batch = std::move(batch_iter->second);
+  pending_batches_.erase(batch_iter);
+
+  // Every origin has been synced, so apply the spends in order.
+  std::vector<SpendResult> results;
+  bool spent = false;
+  for (const SpendRequest& request : batch->requests) {
+    const url::Origin& request_origin = request.first;
+    if (!batch->sync_results[request_origin]) {
+      results.emplace_back(blink::mojom::BudgetServiceErrorType::DATABASE_ERROR,
+                           false /* success */);
+      continue;
+    }
+
+    bool request_spent = SpendFromCache(request_origin, request.second);
+    results.emplace_back(blink::mojom::BudgetServiceErrorType::NONE,
+                         request_spent);
+    if (request_spent) {
+      dirty_origins_.insert(request_origin);
+      spent = true;
     }
-    bill -= iter->amount;
-    iter = info.chunks.erase(iter);
   }
 
-  // There should have been enough budget to cover the entire bill.
-  DCHECK_EQ(0, bill);
+  for (const auto& sync_result : batch->sync_results)
+    pinned_origins_.erase(pinned_origins_.find(sync_result.first));
 
-  // Now that the cache is updated, write the data to the database.
-  WriteCachedValuesToDatabase(
-      origin, base::Bind(&BudgetDatabase::SpendBudgetAfterWrite,
-                         weak_ptr_factory_.GetWeakPtr(), callback));
+  if (!spent) {
+    batch->callback.Run(results);
+    return;
+  }
+
+  // The batch is already coalesced, so write it, together with any other dirty
+  // origins, without waiting for the flush timer.
+  pending_write_callbacks_.push_back(
+      base::Bind(&BudgetDatabase::SpendBudgetBatchAfterWrite,
+                 weak_ptr_factory_.GetWeakPtr(), base::Passed(&results),
+                 batch->callback));
+  FlushDirtyOrigins();
+}
+
+void BudgetDatabase::SpendBudgetBatchAfterWrite(
+    std::vector<SpendResult> results,
+    const SpendBudgetBatchCallback& callback,
+    bool write_successful) {
+  // As for single spends, a failed write turns successful spends into errors.
+  if (!write_successful) {
+    for (SpendResult& result : results) {
+      if (result.success) {
+        result.error = blink::mojom::BudgetServiceErrorType::DATABASE_ERROR;
+        result.success = false;
+      }
+    }
+  }
+  callback.Run(results);
 }
 
 // This converts the bool value which is returned from the database to a Mojo
@@ -240,6 +718,20 @@ void BudgetDatabase::SpendBudgetAfterWrite(const SpendBudgetCallback& callback,
 void BudgetDatabase::WriteCachedValuesToDatabase(
     const url::Origin& origin,
     const StoreBudgetCallback& callback) {
+  dirty_origins_.insert(origin);
+  pending_write_callbacks_.push_back(callback);
+
+  // Writes which arrive while a flush is already scheduled join that flush, so
+  // the first write determines when the batch goes to disk.
+  if (flush_timer_.IsRunning())
+    return;
+  flush_timer_.Start(FROM_HERE, write_delay_, this,
+                     &BudgetDatabase::FlushDirtyOrigins);
+}
+
+void BudgetDatabase::FlushDirtyOrigins() {
+  flush_timer_.Stop();
+
   // Create the data structures that are passed to the ProtoDatabase.
   std::unique_ptr<
       leveldb_proto::ProtoDatabase<budget_service::Budget>::KeyEntryVector>
@@ -248,12 +740,19 @@ void BudgetDatabase::WriteCachedValuesToDatabase(
   std::unique_ptr<std::vector<std::string>> keys_to_remove(
       new std::vector<std::string>());
 
-  // Each operation can either update the existing budget or remove the origin's
-  // budget information.
-  if (IsCached(origin)) {
+  // Each dirty origin can either update the existing budget or remove the
+  // origin's budget information.
+  for (const url::Origin& origin : dirty_origins_) {
+    auto iter = budget_map_.find(origin);
+    if (iter == budget_map_.end()) {
+      // If the origin doesn't exist in the cache, this is a remove operation.
+      keys_to_remove->push_back(origin.Serialize());
+      continue;
+    }
+
     // Build the Budget proto object.
     budget_service::Budget budget;
-    const BudgetInfo& info = budget_map_[origin];
+    const BudgetInfo& info = iter->second;
     for (const auto& chunk : info.chunks) {
       budget_service::BudgetChunk* budget_chunk = budget.add_budget();
       budget_chunk->set_amount(chunk.amount);
@@ -261,31 +760,85 @@ void BudgetDatabase::WriteCachedValuesToDatabase(
     }
     budget.set_engagement_last_updated(
         info.last_engagement_award.ToInternalValue());
+    budget.set_origin(origin.Serialize());
     entries->push_back(std::make_pair(origin.Serialize(), budget));
-  } else {
-    // If the origin doesn't exist in the cache, this is a remove operation.
-    keys_to_remove->push_back(origin.Serialize());
   }
 
+  std::set<url::Origin> origins;
+  origins.swap(dirty_origins_);
+  pinned_origins_.insert(origins.begin(), origins.end());
+  if (sweeping_)
+    origins_written_during_sweep_.insert(origins.begin(), origins.end());
+
+  std::vector<StoreBudgetCallback> callbacks;
+  callbacks.swap(pending_write_callbacks_);
+
   // Send the updates to the database.
-  db_->UpdateEntries(std::move(entries), std::move(keys_to_remove), callback);
+  database_write_count_++;
+  db_->UpdateEntries(std::move(entries), std::move(keys_to_remove),
+                     base::Bind(&BudgetDatabase::DidFlushDirtyOrigins,
+                                weak_ptr_factory_.GetWeakPtr(),
+                                base::Passed(&origins),
+                                base::Passed(&callbacks)));
+}
+
+void BudgetDatabase::DidFlushDirtyOrigins(
+    std::set<url::Origin> origins,
+    std::vector<StoreBudgetCallback> callbacks,
+    bool success) {
+  for (const StoreBudgetCallback& callback : callbacks)
+    callback.Run(success);
+
+  for (const url::Origin& origin : origins)
+    pinned_origins_.erase(pinned_origins_.find(origin));
+
+  // Origins which were dirty could not be evicted until now.
+  EvictIfNeeded();
 }
 
 void BudgetDatabase::SyncCache(const url::Origin& origin,
                                const CacheCallback& callback) {
-  // If the origin isn't already cached, add it to the cache.
+  // While the whole database is being loaded, wait for it instead of reading
+  // the origin separately.
+  if (preloading_) {
+    preload_waiters_.push_back(base::Bind(&BudgetDatabase::SyncCache,
+                                          weak_ptr_factory_.GetWeakPtr(),
+                                          origin, callback));
+    return;
+  }
+
+  // If the origin isn't already cached, add it to the cache. Only one read is
+  // issued for an origin; callers arriving while it is in flight wait for it.
   if (!IsCached(origin)) {
-    CacheCallback add_callback =
-        base::Bind(&BudgetDatabase::SyncLoadedCache,
-                   weak_ptr_factory_.GetWeakPtr(), origin, callback);
+    cache_stats_.misses++;
+    std::vector<CacheCallback>& waiters = pending_loads_[origin];
+    waiters.push_back(callback);
+    if (waiters.size() > 1)
+      return;
+
+    CacheCallback add_callback = base::Bind(
+        &BudgetDatabase::DidLoadOrigin, weak_ptr_factory_.GetWeakPtr(), origin);
+    database_read_count_++;
     db_->GetEntry(origin.Serialize(), base::Bind(&BudgetDatabase::AddToCache,
                                                  weak_ptr_factory_.GetWeakPtr(),
                                                  origin, add_callback));
     return;
   }
+  cache_stats_.hits++;
   SyncLoadedCache(origin, callback, true /* success */);
 }
 
+void BudgetDatabase::DidLoadOrigin(const url::Origin& origin, bool success) {
+  auto iter = pending_loads_.find(origin);
+  DCHECK(iter != pending_loads_.end());
+  std::vector<CacheCallback> waiters;
+  waiters.swap(iter->second);
+  pending_loads_.erase(iter);
+
+  for (const CacheCallback& callback : waiters)
+    SyncLoadedCache(origin, callback, success);
+}
+
 void BudgetDatabase::SyncLoadedCache(const url::Origin& origin,
                                      const CacheCallback& callback,
                                      bool success) {
@@ -300,6 +853,14 @@ void BudgetDatabase::SyncLoadedCache(const url::Origin& origin,
   // Get the SES score and add engagement budget for the site.
   AddEngagementBudget(origin);
 
+  // The origin is always cached after an engagement award has been considered.
+  // It is pinned while other origins are evicted, since the caller is about to
+  // read it, and it may be the least recently used origin which can go.
+  MarkRecentlyUsed(origin);
+  pinned_origins_.insert(origin);
+  EvictIfNeeded();
+  pinned_origins_.erase(pinned_origins_.find(origin));
+
   if (needs_write)
     WriteCachedValuesToDatabase(origin, callback);
   else
@@ -313,7 +874,7 @@ void BudgetDatabase::AddEngagementBudget(const url::Origin& origin) {
   // reduce that if budget has already been given during that period.
   base::TimeDelta elapsed = base::TimeDelta::FromDays(kBudgetDurationInDays);
   if (IsCached(origin)) {
-    elapsed = clock_->Now() - budget_map_[origin].last_engagement_award;
+    elapsed = clock_->Now() - GetCacheEntry(origin).last_engagement_award;
     // Don't give engagement awards for periods less than an hour.
     if (elapsed.InHours() < 1)
       return;
@@ -322,21 +883,22 @@ void BudgetDatabase::AddEngagementBudget(const url::Origin& origin) {
       elapsed = base::TimeDelta::FromDays(kBudgetDurationInDays);
   }
 
-  // Get the current SES score, and calculate the hourly budget for that score.
-  SiteEngagementService* service = SiteEngagementService::Get(profile_);
-  double hourly_budget = kMaximumHourlyBudget *
-                         service->GetScore(origin.GetURL()) /
-                         service->GetMaxPoints();
-
   // Update the last_engagement_award to the current time. If the origin wasn't
   // already in the map, this adds a new entry for it.
-  budget_map_[origin].last_engagement_award = clock_->Now();
+  BudgetInfo& info =
+      IsCached(origin) ? GetCacheEntry(origin) : AddCacheEntry(origin);
+  info.last_engagement_award = clock_->Now();
+
+  // Get the current SES score, and calculate the hourly budget for that score.
+  // Awards always read a fresh score, which later spends can then reuse.
+  SnapshotEngagementScore(origin);
+  double hourly_budget = kMaximumHourlyBudget * info.engagement_score /
+                         info.engagement_max_points;
 
   // Add a new chunk of budget for the origin at the default expiration time.
   base::Time expiration =
       clock_->Now() + base::TimeDelta::FromDays(kBudgetDurationInDays);
-  budget_map_[origin].chunks.emplace_back(elapsed.InHours() * hourly_budget,
-                                          expiration);
+  info.chunks.push_back(elapsed.InHours() * hourly_budget, expiration);
 
   // Any time we award engagement budget, which is done at most once an hour
   // whenever any budget action is taken, record the budget.
@@ -350,20 +912,15 @@ bool BudgetDatabase::CleanupExpiredBudget(const url::Origin& origin) {
   if (!IsCached(origin))
     return false;
 
-  base::Time now = clock_->Now();
-  BudgetChunks& chunks = budget_map_[origin].chunks;
-  auto cleanup_iter = chunks.begin();
-
-  // This relies on the list of chunks being in timestamp order.
-  while (cleanup_iter != chunks.end() && cleanup_iter->expiration <= now)
-    cleanup_iter = chunks.erase(cleanup_iter);
+  BudgetInfo& info = GetCacheEntry(origin);
+  info.chunks.RemoveExpired(clock_->Now());
 
   // If the entire budget is empty now AND there have been no engagements
   // in the last kBudgetDurationInDays days, remove this from the cache.
-  if (chunks.empty() &&
-      budget_map_[origin].last_engagement_award <
+  if (info.chunks.empty() &&
+      info.last_engagement_award <
           clock_->Now() - base::TimeDelta::FromDays(kBudgetDurationInDays)) {
-    budget_map_.erase(origin);
+    RemoveCacheEntry(origin);
     return true;
   }
 
@@ -372,3 +929,27 @@ bool BudgetDatabase::CleanupExpiredBudget(const url::Origin& origin) {
   // origin spends some budget.
   return false;
 }
+
+double BudgetDatabase::GetEngagementScore(const url::Origin& origin) {
+  const BudgetInfo& info = GetCacheEntry(origin);
+
+  // Snapshots taken in the future are treated as stale, in case the clock went
+  // backwards.
+  base::Time now = clock_->Now();
+  if (info.engagement_snapshot_time.is_null() ||
+      info.engagement_snapshot_time > now ||
+      now - info.engagement_snapshot_time >=
+          base::TimeDelta::FromHours(kEngagementSnapshotLifetimeInHours)) {
+    SnapshotEngagementScore(origin);
+  }
+
+  return info.engagement_score;
+}
+
+void BudgetDatabase::SnapshotEngagementScore(const url::Origin& origin) {
+  SiteEngagementService* service = SiteEngagementService::Get(profile_);
+  BudgetInfo& info = GetCacheEntry(origin);
+  info.engagement_score = service->GetScore(origin.GetURL());
+  info.engagement_max_points = service->GetMaxPoints();
+  info.engagement_snapshot_time = clock_->Now();
+}
@@ -8,17 +8,24 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "base/callback_forward.h"
 #include "base/macros.h"
 #include "base/memory/weak_ptr.h"
+#include "base/time/time.h"
+#include "base/timer/timer.h"
+#include "chrome/browser/budget_service/budget_chunks.h"
+#include "chrome/browser/engagement/site_engagement_observer.h"
 #include "components/leveldb_proto/proto_database.h"
 #include "third_party/WebKit/public/platform/modules/budget_service/budget_service.mojom.h"
 
 namespace base {
 class Clock;
 class SequencedTaskRunner;
-class Time;
 }
 
 namespace budget_service {
@@ -33,7 +40,7 @@ class Profile;
 
 // A class used to asynchronously read and write details of the budget
 // assigned to an origin. The class uses an underlying LevelDB.
-class BudgetDatabase {
+class BudgetDatabase : public SiteEngagementObserver {
  public:
   // Callback for getting a list of all budget chunks.
   using GetBudgetCallback = blink::mojom::BudgetService::GetBudgetCallback;
@@ -43,13 +50,32 @@ class BudgetDatabase {
       base::Callback<void(blink::mojom::BudgetServiceErrorType error_type,
                           bool success)>;
 
+  // The outcome of a single spend within a batch.
+  struct SpendResult {
+    SpendResult(blink::mojom::BudgetServiceErrorType error, bool success)
+        : error(error), success(success) {}
+
+    blink::mojom::BudgetServiceErrorType error;
+    bool success;
+  };
+
+  // An origin and the amount of budget it wants to spend.
+  using SpendRequest = std::pair<url::Origin, double>;
+
+  // This is invoked with one result per request, in the order of the requests,
+  // after all of the spends have been written to the database.
+  using SpendBudgetBatchCallback =
+      base::Callback<void(const std::vector<SpendResult>& results)>;
+
   // The database_dir specifies the location of the budget information on
   // disk. The task_runner is used by the ProtoDatabase to handle all blocking
   // calls and disk access.
   BudgetDatabase(Profile* profile,
                  const base::FilePath& database_dir,
                  const scoped_refptr<base::SequencedTaskRunner>& task_runner);
-  ~BudgetDatabase();
+
+  // Any origins which have not yet been written to disk are flushed here.
+  ~BudgetDatabase() override;
 
   // Get the full budget expectation for the origin. This will return a
   // sequence of time points and the expected budget at those times.
@@ -62,30 +88,44 @@ class BudgetDatabase {
                    double amount,
                    const SpendBudgetCallback& callback);
 
+  // Spend budget for many origins at once. All origins are synced in a single
+  // pass, and the spends are written to the database in a single write. The
+  // spends are applied in order, so an origin may appear more than once.
+  void SpendBudgetBatch(const std::vector<SpendRequest>& requests,
+                        const SpendBudgetBatchCallback& callback);
+
+  // Counters describing how effective the cache of origins is.
+  struct CacheStats {
+    CacheStats() : hits(0), misses(0), evictions(0) {}
+
+    // Requests which found the origin in the cache, or had to load it.
+    int hits;
+    int misses;
+
+    // Origins which were dropped from the cache to stay within its size.
+    int evictions;
+  };
+
+  const CacheStats& cache_stats() const { return cache_stats_; }
+
+  // Sets the maximum number of origins kept in the cache. Origins which have
+  // not been used recently are evicted first, and are loaded again on demand.
+  void SetMaxCachedOrigins(size_t max_cached_origins);
+
  private:
   friend class BudgetDatabaseTest;
+  friend class BudgetManagerPerfTest;
 
   // Used to allow tests to change time for testing.
   void SetClockForTesting(std::unique_ptr<base::Clock> clock);
 
-  // Holds information about individual pieces of awarded budget. There is a
-  // one-to-one mapping of these to the chunks in the underlying database.
-  struct BudgetChunk {
-    BudgetChunk(double amount, base::Time expiration)
-        : amount(amount), expiration(expiration) {}
-    BudgetChunk(const BudgetChunk& other)
-        : amount(other.amount), expiration(other.expiration) {}
-
-    double amount;
-    base::Time expiration;
-  };
-
-  // Data structure for caching budget information.
-  using BudgetChunks = std::list<BudgetChunk>;
+  // Used to allow tests to change how long writes are held back so that they
+  // can be coalesced with writes for other origins.
+  void SetWriteDelayForTesting(base::TimeDelta write_delay);
 
   // Holds information about the overall budget for a site. This includes the
-  // time the budget was last incremented, as well as a list of budget chunks
-  // which have been awarded.
+  // time the budget was last incremented, as well as the budget chunks which
+  // have been awarded.
   struct BudgetInfo {
     BudgetInfo();
     BudgetInfo(const BudgetInfo&& other);
@@ -94,18 +134,105 @@ class BudgetDatabase {
     base::Time last_engagement_award;
     BudgetChunks chunks;
 
+    // The engagement score of the origin and the maximum possible score, as
+    // of |engagement_snapshot_time|. This is refreshed whenever engagement
+    // budget is awarded, and is null until then.
+    double engagement_score;
+    double engagement_max_points;
+    base::Time engagement_snapshot_time;
+
+    // The position of the origin in |lru_origins_|.
+    std::list<url::Origin>::iterator lru_position;
+
     DISALLOW_COPY_AND_ASSIGN(BudgetInfo);
   };
 
+  // State of a batch spend while its origins are being synced.
+  struct SpendBatch {
+    SpendBatch();
+    ~SpendBatch();
+
+    std::vector<SpendRequest> requests;
+    SpendBudgetBatchCallback callback;
+
+    // Whether the sync of each distinct origin in |requests| succeeded.
+    std::map<url::Origin, bool> sync_results;
+
+    // The number of origins which haven't finished syncing yet.
+    size_t pending_syncs;
+  };
+
   // Callback for writing budget values to the database.
   using StoreBudgetCallback = base::Callback<void(bool success)>;
 
   using CacheCallback = base::Callback<void(bool success)>;
 
+  // SiteEngagementObserver:
+  void OnEngagementIncreased(content::WebContents* web_contents,
+                             const GURL& url,
+                             double score) override;
+
   void OnDatabaseInit(bool success);
 
+  // Populates the cache with the origins in the database, up to
+  // |max_cached_origins_|. Queries which arrive while this is in progress wait
+  // for it rather than issuing their own reads.
+  void DidPreloadCache(bool success,
+                       std::unique_ptr<std::vector<budget_service::Budget>>
+                           entries);
+
+  // Entries written before the origin was stored in the proto are matched to
+  // their origin through their key, and read one by one. They are written back
+  // with the origin so that later preloads find them in one read.
+  void DidLoadKeysForPreload(bool success,
+                             std::unique_ptr<std::vector<std::string>> keys);
+  void DidLoadEntryForPreload(const url::Origin& origin,
+                              bool success,
+                              std::unique_ptr<budget_service::Budget> budget);
+  void FinishPreloadCache();
+
+  // The sweep removes expired budget chunks and origins without any budget
+  // left from the database, including origins which are never used again.
+  // It runs periodically, starting some time after browser startup.
+  void ScheduleSweep(base::TimeDelta delay);
+  // Only the keys are loaded up front, so the sweep never holds more than a
+  // slice of entries in memory.
+  void StartSweep();
+  void DidLoadKeysForSweep(bool success,
+                           std::unique_ptr<std::vector<std::string>> keys);
+
+  // Reads the entries of a bounded number of keys and writes the changes to
+  // them as one batch, then posts a task to sweep the next slice.
+  void SweepNextSlice();
+  void DidLoadEntryForSweep(const std::string& key,
+                            bool success,
+                            std::unique_ptr<budget_service::Budget> budget);
+  void WriteSweptSlice();
+  void FinishSweep();
+
+  // Whether the sweep may change the entry of the origin. Entries of origins
+  // which are in use are cleaned up through the cache instead.
+  bool IsSweepable(const url::Origin& origin) const;
+
   bool IsCached(const url::Origin& origin) const;
 
+  // Adds an empty entry for the origin to the cache, or removes the origin's
+  // entry. All changes to the set of cached origins go through these so that
+  // |lru_origins_| is kept in sync.
+  BudgetInfo& AddCacheEntry(const url::Origin& origin);
+  void RemoveCacheEntry(const url::Origin& origin);
+
+  // Returns the cache entry of the origin, which must be cached.
+  BudgetInfo& GetCacheEntry(const url::Origin& origin);
+
+  // Moves the origin to the front of |lru_origins_|.
+  void MarkRecentlyUsed(const url::Origin& origin);
+
+  // Evicts the least recently used origins until the cache is within
+  // |max_cached_origins_|. Dirty origins are flushed before they are evicted,
+  // and pinned origins are never evicted.
+  void EvictIfNeeded();
+
   double GetBudget(const url::Origin& origin) const;
 
   void AddToCache(const url::Origin& origin,
@@ -113,6 +240,11 @@ class BudgetDatabase {
                   bool success,
                   std::unique_ptr<budget_service::Budget> budget);
 
+  // Converts the budget from the proto format and adds it to the cache. The
+  // origin must not already be cached.
+  void CacheBudget(const url::Origin& origin,
+                   const budget_service::Budget& budget);
+
   void GetBudgetAfterSync(const url::Origin& origin,
                           const GetBudgetCallback& callback,
                           bool success);
@@ -124,10 +256,35 @@ class BudgetDatabase {
 
   void SpendBudgetAfterWrite(const SpendBudgetCallback& callback, bool success);
 
+  // Spends budget from the synced cache entry of the origin, and records UMA
+  // about the origin's engagement. Returns whether there was enough budget.
+  // The caller is responsible for writing the cache to the database.
+  bool SpendFromCache(const url::Origin& origin, double amount);
+
+  void SpendBudgetBatchAfterSync(int batch_id,
+                                 const url::Origin& origin,
+                                 bool success);
+  void SpendBudgetBatchAfterWrite(std::vector<SpendResult> results,
+                                  const SpendBudgetBatchCallback& callback,
+                                  bool success);
+
+  // Marks the origin as dirty and schedules a write of all dirty origins. The
+  // callback is invoked once the cached values have been written to disk.
   void WriteCachedValuesToDatabase(const url::Origin& origin,
                                    const StoreBudgetCallback& callback);
 
+  // Writes the cached values of all dirty origins to the database in a single
+  // batch and then runs the callbacks that were waiting on them.
+  void FlushDirtyOrigins();
+  void DidFlushDirtyOrigins(std::set<url::Origin> origins,
+                            std::vector<StoreBudgetCallback> callbacks,
+                            bool success);
+
   void SyncCache(const url::Origin& origin, const CacheCallback& callback);
+
+  // Runs SyncLoadedCache for every caller waiting on the load of the origin.
+  void DidLoadOrigin(const url::Origin& origin, bool success);
+
   void SyncLoadedCache(const url::Origin& origin,
                        const CacheCallback& callback,
                        bool success);
@@ -140,6 +297,13 @@ class BudgetDatabase {
 
   bool CleanupExpiredBudget(const url::Origin& origin);
 
+  // Returns the engagement score of the cached origin, reusing the snapshot
+  // in its BudgetInfo if it's recent enough.
+  double GetEngagementScore(const url::Origin& origin);
+
+  // Stores a fresh snapshot of the origin's engagement score in its BudgetInfo.
+  void SnapshotEngagementScore(const url::Origin& origin);
+
   Profile* profile_;
 
   // The database for storing budget information.
@@ -148,6 +312,80 @@ class BudgetDatabase {
   // Cached data for the origins which have been loaded.
   std::map<url::Origin, BudgetInfo> budget_map_;
 
+  // The cached origins, ordered from most to least recently used.
+  std::list<url::Origin> lru_origins_;
+
+  // The maximum number of origins in |budget_map_|.
+  size_t max_cached_origins_;
+
+  CacheStats cache_stats_;
+
+  // Whether the cache is being populated with the whole database. This is only
+  // the case when the BudgetDatabasePreload feature is enabled.
+  bool preloading_;
+
+  // Cache syncs which are waiting for the preload to finish.
+  std::vector<base::Closure> preload_waiters_;
+
+  // The number of reads of individual entries the preload is waiting for.
+  size_t preload_reads_;
+
+  // Callers waiting for the database read of an origin which isn't cached yet.
+  // Only the first caller issues the read; later ones are added to its entry.
+  std::map<url::Origin, std::vector<CacheCallback>> pending_loads_;
+
+  // Origins whose cached data has changed since it was last written to disk.
+  // Origins which are dirty but no longer in |budget_map_| get removed from
+  // the database on the next flush.
+  std::set<url::Origin> dirty_origins_;
+
+  // Origins which must not be evicted because they are in use: either part of
+  // a write that hasn't completed yet, or part of a batch spend which is still
+  // waiting for other origins to load. An origin may be pinned several times.
+  std::multiset<url::Origin> pinned_origins_;
+
+  // Batch spends which are waiting for their origins to be synced, keyed by
+  // an id which is unique for this database.
+  std::map<int, std::unique_ptr<SpendBatch>> pending_batches_;
+  int next_batch_id_;
+
+  // Callbacks waiting for the next flush of |dirty_origins_| to complete.
+  std::vector<StoreBudgetCallback> pending_write_callbacks_;
+
+  // The maximum amount of time a write will be held back in order to coalesce
+  // it with writes for other origins.
+  base::TimeDelta write_delay_;
+
+  // Fires when the pending writes should be flushed to the database. The timer
+  // is not restarted by later writes, so |write_delay_| bounds the latency.
+  base::OneShotTimer flush_timer_;
+
+  // Fires when the next sweep of the database should start.
+  base::OneShotTimer sweep_timer_;
+
+  // Whether a sweep is in progress, the keys of the database it works on, and
+  // the position of the next slice to be swept.
+  bool sweeping_;
+  std::unique_ptr<std::vector<std::string>> sweep_keys_;
+  size_t sweep_position_;
+
+  // The changes to the slice being swept, and the number of its entries which
+  // are still being read.
+  std::unique_ptr<
+      leveldb_proto::ProtoDatabase<budget_service::Budget>::KeyEntryVector>
+      sweep_updates_;
+  std::unique_ptr<std::vector<std::string>> sweep_removals_;
+  size_t sweep_reads_;
+
+  // Origins written since the current sweep started. Entries read before such
+  // a write are stale, so the sweep leaves these origins alone.
+  std::set<url::Origin> origins_written_during_sweep_;
+
+  // The number of reads and batched writes which have been issued to the
+  // database.
+  int database_read_count_;
+  int database_write_count_;
+
   // The clock used to vend times.
   std::unique_ptr<base::Clock> clock_;
 
@@ -5,11 +5,13 @@
 #include "chrome/browser/budget_service/budget_database.h"
 
 #include <math.h>
+#include <string>
 #include <vector>
 
 #include "base/memory/ptr_util.h"
 #include "base/run_loop.h"
 #include "base/test/histogram_tester.h"
+#include "base/test/scoped_feature_list.h"
 #include "base/test/simple_test_clock.h"
 #include "base/threading/thread_task_runner_handle.h"
 #include "chrome/browser/budget_service/budget.pb.h"
@@ -34,16 +36,92 @@ const double kEngagement = 25;
 
 const char kTestOrigin[] = "https://example.com";
 
+// The amount of budget held by the entries of WriteLegacyEntries().
+const double kLegacyBudget = 7;
+
+void IgnoreSpendResult(blink::mojom::BudgetServiceErrorType error,
+                       bool success) {}
+
+void DidUpdateDatabase(bool* result,
+                       const base::Closure& quit_closure,
+                       bool success) {
+  *result = success;
+  quit_closure.Run();
+}
+
 }  // namespace
 
 class BudgetDatabaseTest : public ::testing::Test {
  public:
   BudgetDatabaseTest()
-      : success_(false),
-        db_(&profile_,
-            profile_.GetPath().Append(FILE_PATH_LITERAL("BudgetDatabase")),
-            base::ThreadTaskRunnerHandle::Get()),
-        origin_(url::Origin(GURL(kTestOrigin))) {}
+      : success_(false), origin_(url::Origin(GURL(kTestOrigin))) {
+    CreateDatabase();
+  }
+
+  base::FilePath GetDatabaseDir() {
+    return profile_.GetPath().Append(FILE_PATH_LITERAL("BudgetDatabase"));
+  }
+
+  void CreateDatabase() {
+    db_.reset(new BudgetDatabase(&profile_, GetDatabaseDir(),
+                                 base::ThreadTaskRunnerHandle::Get()));
+
+    // Write immediately so that tests don't wait for writes to be coalesced.
+    db_->SetWriteDelayForTesting(base::TimeDelta());
+  }
+
+  // Destroys the database, which flushes pending writes, and opens it again
+  // with an empty cache.
+  void RecreateDatabase() {
+    db_.reset();
+    base::RunLoop().RunUntilIdle();
+    CreateDatabase();
+  }
+
+  // Closes the database, writes an entry for each of |origins| the way versions
+  // before the origin was stored in the proto did, and opens it again.
+  void WriteLegacyEntries(const std::vector<url::Origin>& origins) {
+    db_.reset();
+    base::RunLoop().RunUntilIdle();
+
+    {
+      leveldb_proto::ProtoDatabaseImpl<budget_service::Budget> db(
+          base::ThreadTaskRunnerHandle::Get());
+      bool result = false;
+      base::RunLoop init_loop;
+      db.Init("BudgetManager", GetDatabaseDir(),
+              base::Bind(&DidUpdateDatabase, &result,
+                         init_loop.QuitClosure()));
+      init_loop.Run();
+      ASSERT_TRUE(result);
+
+      std::unique_ptr<leveldb_proto::ProtoDatabase<
+          budget_service::Budget>::KeyEntryVector>
+          entries(new leveldb_proto::ProtoDatabase<
+                  budget_service::Budget>::KeyEntryVector());
+      base::Time now = base::Time::Now();
+      for (const url::Origin& origin : origins) {
+        budget_service::Budget budget;
+        budget_service::BudgetChunk* chunk = budget.add_budget();
+        chunk->set_amount(kLegacyBudget);
+        chunk->set_expiration(
+            (now + base::TimeDelta::FromDays(1)).ToInternalValue());
+        budget.set_engagement_last_updated(now.ToInternalValue());
+        entries->push_back(std::make_pair(origin.Serialize(), budget));
+      }
+
+      base::RunLoop update_loop;
+      db.UpdateEntries(std::move(entries),
+                       base::MakeUnique<std::vector<std::string>>(),
+                       base::Bind(&DidUpdateDatabase, &result,
+                                  update_loop.QuitClosure()));
+      update_loop.Run();
+      ASSERT_TRUE(result);
+    }
+    base::RunLoop().RunUntilIdle();
+
+    CreateDatabase();
+  }
 
   void WriteBudgetComplete(base::Closure run_loop_closure,
                            blink::mojom::BudgetServiceErrorType error,
@@ -55,7 +133,7 @@ class BudgetDatabaseTest : public ::testing::Test {
   // Spend budget for the origin.
   bool SpendBudget(double amount) {
     base::RunLoop run_loop;
-    db_.SpendBudget(origin(), amount,
+    db_->SpendBudget(origin(), amount,
                     base::Bind(&BudgetDatabaseTest::WriteBudgetComplete,
                                base::Unretained(this), run_loop.QuitClosure()));
     run_loop.Run();
@@ -72,11 +150,13 @@ class BudgetDatabaseTest : public ::testing::Test {
   }
 
   // Get the full set of budget predictions for the origin.
-  void GetBudgetDetails() {
+  void GetBudgetDetails() { GetBudgetDetailsForOrigin(origin()); }
+
+  void GetBudgetDetailsForOrigin(const url::Origin& origin) {
     base::RunLoop run_loop;
-    db_.GetBudgetDetails(
-        origin(), base::Bind(&BudgetDatabaseTest::GetBudgetDetailsComplete,
-                             base::Unretained(this), run_loop.QuitClosure()));
+    db_->GetBudgetDetails(
+        origin, base::Bind(&BudgetDatabaseTest::GetBudgetDetailsComplete,
+                           base::Unretained(this), run_loop.QuitClosure()));
     run_loop.Run();
   }
 
@@ -86,13 +166,67 @@ class BudgetDatabaseTest : public ::testing::Test {
   // Setup a test clock so that the tests can control time.
   base::SimpleTestClock* SetClockForTesting() {
     base::SimpleTestClock* clock = new base::SimpleTestClock();
-    db_.SetClockForTesting(base::WrapUnique(clock));
+    db_->SetClockForTesting(base::WrapUnique(clock));
     return clock;
   }
 
   void SetSiteEngagementScore(double score) {
+    SetSiteEngagementScoreForOrigin(origin(), score);
+  }
+
+  void SetSiteEngagementScoreForOrigin(const url::Origin& origin,
+                                       double score) {
     SiteEngagementService* service = SiteEngagementService::Get(&profile_);
-    service->ResetBaseScoreForURL(GURL(kTestOrigin), score);
+    service->ResetBaseScoreForURL(origin.GetURL(), score);
+  }
+
+  void SpendBudgetForOriginComplete(int* remaining,
+                                    base::Closure run_loop_closure,
+                                    blink::mojom::BudgetServiceErrorType error,
+                                    bool success) {
+    if (error != blink::mojom::BudgetServiceErrorType::NONE || !success)
+      success_ = false;
+    if (--(*remaining) == 0)
+      run_loop_closure.Run();
+  }
+
+  // Spend budget for all of the origins without waiting for the individual
+  // spends to complete. Returns whether all of the spends succeeded.
+  bool SpendBudgetForOrigins(const std::vector<url::Origin>& origins,
+                             double amount) {
+    // Origins may be repeated, in which case they are spent from several
+    // times concurrently.
+    base::RunLoop run_loop;
+    int remaining = origins.size();
+    success_ = true;
+    for (const url::Origin& origin : origins) {
+      db_->SpendBudget(
+          origin, amount,
+          base::Bind(&BudgetDatabaseTest::SpendBudgetForOriginComplete,
+                     base::Unretained(this), &remaining,
+                     run_loop.QuitClosure()));
+    }
+    run_loop.Run();
+    return success_;
+  }
+
+  int GetDatabaseReadCount() const { return db_->database_read_count_; }
+  int GetDatabaseWriteCount() const { return db_->database_write_count_; }
+
+  bool IsCached(const url::Origin& origin) const {
+    return db_->IsCached(origin);
+  }
+
+  BudgetDatabase* database() { return db_.get(); }
+
+  void SetWriteDelay(base::TimeDelta write_delay) {
+    db_->SetWriteDelayForTesting(write_delay);
+  }
+
+  // Runs a full sweep of the database.
+  void SweepDatabase() {
+    db_->StartSweep();
+    base::RunLoop().RunUntilIdle();
   }
 
  protected:
@@ -104,7 +238,7 @@ class BudgetDatabaseTest : public ::testing::Test {
   content::TestBrowserThreadBundle thread_bundle_;
   std::unique_ptr<budget_service::Budget> budget_;
   TestingProfile profile_;
-  BudgetDatabase db_;
+  std::unique_ptr<BudgetDatabase> db_;
   base::HistogramTester histogram_tester_;
   const url::Origin origin_;
 };
@@ -305,6 +439,11 @@ TEST_F(BudgetDatabaseTest, CheckEngagementHistograms) {
   clock->Advance(base::TimeDelta::FromDays(12));
   GetBudgetDetails();
   SetSiteEngagementScore(engagement * 2);
+
+  // The engagement score is snapshotted when budget is awarded. Let an hour
+  // pass so that the next award picks up the new score. This only adds a
+  // small award, which doesn't change which UMA the spends below record.
+  clock->Advance(base::TimeDelta::FromHours(1));
   ASSERT_TRUE(SpendBudget(cost));
   ASSERT_TRUE(SpendBudget(cost));
   ASSERT_FALSE(SpendBudget(cost));
@@ -327,3 +466,277 @@ TEST_F(BudgetDatabaseTest, CheckEngagementHistograms) {
   EXPECT_EQ(floor(engagement * 2), low_budget_buckets[1].min);
   EXPECT_EQ(1, low_budget_buckets[1].count);
 }
+
+TEST_F(BudgetDatabaseTest, CoalesceWritesForManyOrigins) {
+  const int kNumOrigins = 20;
+  std::vector<url::Origin> origins;
+  for (int i = 0; i < kNumOrigins; ++i) {
+    origins.push_back(url::Origin(
+        GURL("https://example" + std::to_string(i) + ".com")));
+    SetSiteEngagementScoreForOrigin(origins.back(), kEngagement);
+  }
+
+  // All of the spends are issued together, so their updates should reach the
+  // database as a single batched write.
+  ASSERT_TRUE(SpendBudgetForOrigins(origins, 1));
+  EXPECT_EQ(1, GetDatabaseWriteCount());
+
+  // Spending again for the now cached origins should also be coalesced.
+  ASSERT_TRUE(SpendBudgetForOrigins(origins, 1));
+  EXPECT_EQ(2, GetDatabaseWriteCount());
+}
+
+TEST_F(BudgetDatabaseTest, PreloadCacheOnInit) {
+  const int kNumOrigins = 20;
+  std::vector<url::Origin> origins;
+  for (int i = 0; i < kNumOrigins; ++i) {
+    origins.push_back(url::Origin(
+        GURL("https://example" + std::to_string(i) + ".com")));
+    SetSiteEngagementScoreForOrigin(origins.back(), kEngagement);
+  }
+  ASSERT_TRUE(SpendBudgetForOrigins(origins, 1));
+
+  // Reopen the database with preloading enabled.
+  base::test::ScopedFeatureList scoped_feature_list;
+  scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                          std::string());
+  RecreateDatabase();
+  for (const url::Origin& origin : origins)
+    EXPECT_FALSE(IsCached(origin));
+
+  // The query waits for the preload, after which every origin is cached.
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  for (const url::Origin& origin : origins)
+    EXPECT_TRUE(IsCached(origin));
+}
+
+TEST_F(BudgetDatabaseTest, PreloadCacheWithLegacyEntries) {
+  const url::Origin other_origin(GURL("https://other.example.com"));
+  base::test::ScopedFeatureList scoped_feature_list;
+  scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                          std::string());
+  WriteLegacyEntries({origin(), other_origin});
+
+  // The entries have no origin, so they are found through their keys.
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, prediction_.size());
+  EXPECT_DOUBLE_EQ(kLegacyBudget, prediction_[0]->budget_at);
+  EXPECT_TRUE(IsCached(other_origin));
+  EXPECT_EQ(2, GetDatabaseReadCount());
+
+  // They were written back with their origin, so the next preload doesn't
+  // need to read them one by one.
+  base::RunLoop().RunUntilIdle();
+  RecreateDatabase();
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(kLegacyBudget, prediction_[0]->budget_at);
+  EXPECT_TRUE(IsCached(other_origin));
+  EXPECT_EQ(0, GetDatabaseReadCount());
+}
+
+TEST_F(BudgetDatabaseTest, PreloadStopsAtCacheLimit) {
+  const int kNumOrigins = 20;
+  const int kMaxCachedOrigins = 5;
+  std::vector<url::Origin> origins;
+  for (int i = 0; i < kNumOrigins; ++i) {
+    origins.push_back(url::Origin(
+        GURL("https://example" + std::to_string(i) + ".com")));
+    SetSiteEngagementScoreForOrigin(origins.back(), kEngagement);
+  }
+  ASSERT_TRUE(SpendBudgetForOrigins(origins, 1));
+
+  base::test::ScopedFeatureList scoped_feature_list;
+  scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                          std::string());
+  RecreateDatabase();
+  database()->SetMaxCachedOrigins(kMaxCachedOrigins);
+  base::RunLoop().RunUntilIdle();
+
+  // The preload fills the cache without going over its size.
+  int cached = 0;
+  for (const url::Origin& origin : origins)
+    cached += IsCached(origin) ? 1 : 0;
+  EXPECT_EQ(kMaxCachedOrigins, cached);
+  EXPECT_EQ(0, database()->cache_stats().evictions);
+}
+
+TEST_F(BudgetDatabaseTest, ConcurrentLoadsShareOneRead) {
+  SetSiteEngagementScore(kEngagement);
+
+  // Several spends for the same uncached origin only read it once, and each
+  // of them is applied to the cached budget.
+  std::vector<url::Origin> origins(5, origin());
+  ASSERT_TRUE(SpendBudgetForOrigins(origins, 1));
+  EXPECT_EQ(1, GetDatabaseReadCount());
+
+  double daily_budget =
+      kMaxDailyBudget * (kEngagement / SiteEngagementScore::kMaxPoints);
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, prediction_.size());
+  EXPECT_DOUBLE_EQ(daily_budget * kDefaultExpirationInDays - 5,
+                   prediction_[0]->budget_at);
+  EXPECT_EQ(1, GetDatabaseReadCount());
+}
+
+TEST_F(BudgetDatabaseTest, EvictLeastRecentlyUsedOrigins) {
+  const int kNumOrigins = 10;
+  const int kMaxCachedOrigins = 4;
+  database()->SetMaxCachedOrigins(kMaxCachedOrigins);
+
+  std::vector<url::Origin> origins;
+  for (int i = 0; i < kNumOrigins; ++i) {
+    origins.push_back(url::Origin(
+        GURL("https://example" + std::to_string(i) + ".com")));
+    SetSiteEngagementScoreForOrigin(origins.back(), kEngagement);
+  }
+
+  // Spend for each origin in turn. Only the most recently used origins stay
+  // cached, and the others are only evicted after their spend was written.
+  for (const url::Origin& origin : origins)
+    ASSERT_TRUE(SpendBudgetForOrigins({origin}, 1));
+  for (int i = 0; i < kNumOrigins; ++i)
+    EXPECT_EQ(i >= kNumOrigins - kMaxCachedOrigins, IsCached(origins[i]));
+
+  const BudgetDatabase::CacheStats& stats = database()->cache_stats();
+  EXPECT_EQ(0, stats.hits);
+  EXPECT_EQ(kNumOrigins, stats.misses);
+  EXPECT_EQ(kNumOrigins - kMaxCachedOrigins, stats.evictions);
+
+  // Evicted origins are loaded again with the budget that was spent.
+  ASSERT_TRUE(SpendBudgetForOrigins({origins[0]}, 1));
+  EXPECT_TRUE(IsCached(origins[0]));
+  EXPECT_EQ(kNumOrigins + 1, stats.misses);
+
+  double daily_budget =
+      kMaxDailyBudget * (kEngagement / SiteEngagementScore::kMaxPoints);
+  GetBudgetDetailsForOrigin(origins[0]);
+  ASSERT_TRUE(success_);
+  EXPECT_DOUBLE_EQ(daily_budget * kDefaultExpirationInDays - 2,
+                   prediction_[0]->budget_at);
+  EXPECT_EQ(1, stats.hits);
+}
+
+TEST_F(BudgetDatabaseTest, QueriedOriginIsNotEvicted) {
+  const url::Origin other_origin(GURL("https://other.example.com"));
+  SetSiteEngagementScore(kEngagement);
+  SetSiteEngagementScoreForOrigin(other_origin, kEngagement);
+  database()->SetMaxCachedOrigins(1);
+
+  // Leave a spend for the other origin waiting to be written, so that it can't
+  // be evicted.
+  SetWriteDelay(base::TimeDelta::FromHours(1));
+  database()->SpendBudget(other_origin, 1, base::Bind(&IgnoreSpendResult));
+  base::RunLoop().RunUntilIdle();
+  ASSERT_TRUE(IsCached(other_origin));
+
+  // The queried origin is the only one which could be evicted, but the query
+  // still sees its budget.
+  double daily_budget =
+      kMaxDailyBudget * (kEngagement / SiteEngagementScore::kMaxPoints);
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, prediction_.size());
+  EXPECT_DOUBLE_EQ(daily_budget * kDefaultExpirationInDays,
+                   prediction_[0]->budget_at);
+
+  // Once the other origin has been written, it is evicted instead.
+  base::RunLoop().RunUntilIdle();
+  EXPECT_TRUE(IsCached(origin()));
+  EXPECT_FALSE(IsCached(other_origin));
+}
+
+TEST_F(BudgetDatabaseTest, EngagementScoreSnapshot) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  SetSiteEngagementScore(kEngagement);
+
+  // Award budget, which snapshots the engagement score.
+  GetBudgetDetails();
+  ASSERT_TRUE(success_);
+  ASSERT_EQ(2U, prediction_.size());
+  double budget = prediction_[0]->budget_at;
+
+  // Spends within the hour use the snapshot, so the changed score doesn't show
+  // up in the UMA recorded for an origin without enough budget.
+  SetSiteEngagementScore(kEngagement * 2);
+  ASSERT_FALSE(SpendBudget(budget + 1));
+  GetHistogramTester()->ExpectUniqueSample("PushMessaging.SESForNoBudgetOrigin",
+                                           static_cast<int>(kEngagement), 1);
+
+  // Once the snapshot has expired, the new score is read again.
+  clock->Advance(base::TimeDelta::FromHours(1));
+  ASSERT_FALSE(SpendBudget(budget * 10));
+  GetHistogramTester()->ExpectBucketCount("PushMessaging.SESForNoBudgetOrigin",
+                                          static_cast<int>(kEngagement * 2), 1);
+}
+
+TEST_F(BudgetDatabaseTest, SweepRemovesExpiredBudget) {
+  base::SimpleTestClock* clock = SetClockForTesting();
+  const url::Origin dead_origin(GURL("https://dead.example.com"));
+  const url::Origin live_origin(GURL("https://live.example.com"));
+  SetSiteEngagementScoreForOrigin(dead_origin, kEngagement);
+  SetSiteEngagementScoreForOrigin(live_origin, kEngagement);
+
+  // Award budget to the dead origin now, and to the live origin a day later.
+  ASSERT_TRUE(SpendBudgetForOrigins({dead_origin}, 1));
+  clock->Advance(base::TimeDelta::FromDays(1));
+  ASSERT_TRUE(SpendBudgetForOrigins({live_origin}, 1));
+
+  // Move past the expiration of the dead origin's budget, and reopen the
+  // database so that neither origin is cached.
+  base::Time now = clock->Now() + base::TimeDelta::FromDays(3) +
+                   base::TimeDelta::FromHours(1);
+  RecreateDatabase();
+  SetClockForTesting()->SetNow(now);
+
+  int writes = GetDatabaseWriteCount();
+  SweepDatabase();
+  EXPECT_EQ(writes + 1, GetDatabaseWriteCount());
+  EXPECT_FALSE(IsCached(dead_origin));
+  EXPECT_FALSE(IsCached(live_origin));
+
+  // Only the live origin is left in the database.
+  base::test::ScopedFeatureList scoped_feature_list;
+  scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                          std::string());
+  RecreateDatabase();
+  SetClockForTesting()->SetNow(now);
+  GetBudgetDetailsForOrigin(live_origin);
+  ASSERT_TRUE(success_);
+  EXPECT_FALSE(IsCached(dead_origin));
+  EXPECT_TRUE(IsCached(live_origin));
+}
+
+TEST_F(BudgetDatabaseTest, SweepHandlesLegacyEntries) {
+  // An expired entry without the origin field is removed through its key.
+  WriteLegacyEntries({origin()});
+  SetClockForTesting()->SetNow(
+      base::Time::Now() +
+      base::TimeDelta::FromDays(kDefaultExpirationInDays + 1));
+  SweepDatabase();
+  {
+    base::test::ScopedFeatureList scoped_feature_list;
+    scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                            std::string());
+    RecreateDatabase();
+    base::RunLoop().RunUntilIdle();
+    EXPECT_FALSE(IsCached(origin()));
+  }
+
+  // An entry which is still valid is rewritten with its origin, so that the
+  // preload finds it without reading it through its key.
+  WriteLegacyEntries({origin()});
+  SweepDatabase();
+  {
+    base::test::ScopedFeatureList scoped_feature_list;
+    scoped_feature_list.InitFromCommandLine("BudgetDatabasePreload",
+                                            std::string());
+    RecreateDatabase();
+    base::RunLoop().RunUntilIdle();
+    EXPECT_TRUE(IsCached(origin()));
+    EXPECT_EQ(0, GetDatabaseReadCount());
+  }
+}
@@ -21,6 +21,15 @@
 
 using content::BrowserThread;
 
+namespace {
+
+// The budget API is only available to secure, non-unique origins.
+bool IsOriginSupported(const url::Origin& origin) {
+  return !origin.unique() && content::IsOriginSecure(origin.GetURL());
+}
+
+}  // namespace
+
 BudgetManager::BudgetManager(Profile* profile)
     : profile_(profile),
       db_(profile,
@@ -49,7 +58,7 @@ double BudgetManager::GetCost(blink::mojom::BudgetOperationType type) {
 
 void BudgetManager::GetBudget(const url::Origin& origin,
                               const GetBudgetCallback& callback) {
-  if (origin.unique() || !content::IsOriginSecure(origin.GetURL())) {
+  if (!IsOriginSupported(origin)) {
     callback.Run(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED,
                  std::vector<blink::mojom::BudgetStatePtr>());
     return;
@@ -62,7 +71,7 @@ void BudgetManager::GetBudget(const url::Origin& origin,
 void BudgetManager::Reserve(const url::Origin& origin,
                             blink::mojom::BudgetOperationType type,
                             const ReserveCallback& callback) {
-  if (origin.unique() || !content::IsOriginSecure(origin.GetURL())) {
+  if (!IsOriginSupported(origin)) {
     callback.Run(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED,
                  false /* success */);
     return;
@@ -75,7 +84,7 @@ void BudgetManager::Reserve(const url::Origin& origin,
 void BudgetManager::Consume(const url::Origin& origin,
                             blink::mojom::BudgetOperationType type,
                             const ConsumeCallback& callback) {
-  if (origin.unique() || !content::IsOriginSecure(origin.GetURL())) {
+  if (!IsOriginSupported(origin)) {
     callback.Run(false /* success */);
     return;
   }
@@ -104,6 +113,65 @@ void BudgetManager::Consume(const url::Origin& origin,
                              weak_ptr_factory_.GetWeakPtr(), callback));
 }
 
+void BudgetManager::ReserveBatch(const std::vector<OperationRequest>& requests,
+                                 const ReserveBatchCallback& callback) {
+  std::vector<BudgetDatabase::SpendResult> results;
+  std::vector<BudgetDatabase::SpendRequest> spends;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const url::Origin& origin = requests[i].first;
+    if (!IsOriginSupported(origin)) {
+      results.emplace_back(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED,
+                           false /* success */);
+      continue;
+    }
+
+    // Filled in once the spend has completed.
+    results.emplace_back(blink::mojom::BudgetServiceErrorType::NONE,
+                         false /* success */);
+    spends.emplace_back(origin, GetCost(requests[i].second));
+    indices.push_back(i);
+  }
+
+  db_.SpendBudgetBatch(
+      spends, base::Bind(&BudgetManager::DidReserveBatch,
+                         weak_ptr_factory_.GetWeakPtr(), requests, indices,
+                         base::Passed(&results), callback));
+}
+
+void BudgetManager::ConsumeBatch(const std::vector<OperationRequest>& requests,
+                                 const ConsumeBatchCallback& callback) {
+  std::vector<bool> results(requests.size(), false);
+  std::vector<BudgetDatabase::SpendRequest> spends;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const url::Origin& origin = requests[i].first;
+    if (!IsOriginSupported(origin))
+      continue;
+
+    // Consume existing reservations first. All of these are taken before any
+    // budget is spent, so the reservations change in a single step.
+    auto count = reservation_map_.find(origin);
+    if (count != reservation_map_.end()) {
+      if (count->second == 1)
+        reservation_map_.erase(count);
+      else
+        count->second--;
+      results[i] = true;
+      continue;
+    }
+
+    // If there wasn't a reservation already, try to directly consume budget.
+    spends.emplace_back(origin, GetCost(requests[i].second));
+    indices.push_back(i);
+  }
+
+  db_.SpendBudgetBatch(
+      spends, base::Bind(&BudgetManager::DidConsumeBatch,
+                         weak_ptr_factory_.GetWeakPtr(), indices,
+                         base::Passed(&results), callback));
+}
+
 void BudgetManager::DidGetBudget(
     const GetBudgetCallback& callback,
     const blink::mojom::BudgetServiceErrorType error,
@@ -142,3 +210,43 @@ void BudgetManager::DidReserve(const url::Origin& origin,
 
   callback.Run(error, success);
 }
+
+void BudgetManager::DidReserveBatch(
+    const std::vector<OperationRequest>& requests,
+    const std::vector<size_t>& indices,
+    std::vector<BudgetDatabase::SpendResult> results,
+    const ReserveBatchCallback& callback,
+    const std::vector<BudgetDatabase::SpendResult>& spend_results) {
+  DCHECK_EQ(indices.size(), spend_results.size());
+
+  // Write all of the new reservations into the map at once.
+  for (size_t i = 0; i < indices.size(); ++i) {
+    const BudgetDatabase::SpendResult& result = spend_results[i];
+    if (result.success &&
+        result.error == blink::mojom::BudgetServiceErrorType::NONE) {
+      reservation_map_[requests[indices[i]].first]++;
+    }
+
+    UMA_HISTOGRAM_BOOLEAN("Blink.BudgetAPI.Reserve", result.success);
+    results[indices[i]] = result;
+  }
+
+  callback.Run(results);
+}
+
+void BudgetManager::DidConsumeBatch(
+    const std::vector<size_t>& indices,
+    std::vector<bool> results,
+    const ConsumeBatchCallback& callback,
+    const std::vector<BudgetDatabase::SpendResult>& spend_results) {
+  DCHECK_EQ(indices.size(), spend_results.size());
+
+  // As for Consume, only return whether each request succeeded.
+  for (size_t i = 0; i < indices.size(); ++i) {
+    results[indices[i]] =
+        spend_results[i].success &&
+        spend_results[i].error == blink::mojom::BudgetServiceErrorType::NONE;
+  }
+
+  callback.Run(results);
+}
@@ -7,6 +7,8 @@
 
 #include <map>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "base/callback_forward.h"
 #include "base/gtest_prod_util.h"
@@ -36,6 +38,16 @@ class BudgetManager : public KeyedService {
   using ReserveCallback = blink::mojom::BudgetService::ReserveCallback;
   using ConsumeCallback = base::Callback<void(bool success)>;
 
+  // An origin and the operation it wants to perform, for the batch methods.
+  using OperationRequest =
+      std::pair<url::Origin, blink::mojom::BudgetOperationType>;
+
+  // Receive one result per request, in the order of the requests.
+  using ReserveBatchCallback = base::Callback<void(
+      const std::vector<BudgetDatabase::SpendResult>& results)>;
+  using ConsumeBatchCallback =
+      base::Callback<void(const std::vector<bool>& results)>;
+
   // Get the budget associated with the origin. This is passed to the
   // callback. Budget will be a sequence of points describing the time and
   // the budget at that time.
@@ -54,7 +66,19 @@ class BudgetManager : public KeyedService {
                blink::mojom::BudgetOperationType type,
                const ConsumeCallback& callback);
 
+  // Reserve budget for each of |requests|, as Reserve() does, spending the
+  // budget of all of them in a single database operation.
+  void ReserveBatch(const std::vector<OperationRequest>& requests,
+                    const ReserveBatchCallback& callback);
+
+  // Consume budget for each of |requests|, as Consume() does. Reservations
+  // are used first, and the remaining requests are spent in a single
+  // database operation.
+  void ConsumeBatch(const std::vector<OperationRequest>& requests,
+                    const ConsumeBatchCallback& callback);
+
  private:
+  friend class BudgetManagerPerfTest;
   friend class BudgetManagerTest;
 
   void DidGetBudget(const GetBudgetCallback& callback,
@@ -70,6 +94,21 @@ class BudgetManager : public KeyedService {
                   blink::mojom::BudgetServiceErrorType error,
                   bool success);
 
+  // |indices| maps each entry of |spend_results| to the index of its request.
+  // |results| holds the results of the requests which were not spent.
+  void DidReserveBatch(const std::vector<OperationRequest>& requests,
+                       const std::vector<size_t>& indices,
+                       std::vector<BudgetDatabase::SpendResult> results,
+                       const ReserveBatchCallback& callback,
+                       const std::vector<BudgetDatabase::SpendResult>&
+                           spend_results);
+
+  void DidConsumeBatch(const std::vector<size_t>& indices,
+                       std::vector<bool> results,
+                       const ConsumeBatchCallback& callback,
+                       const std::vector<BudgetDatabase::SpendResult>&
+                           spend_results);
+
   Profile* profile_;
   BudgetDatabase db_;
 
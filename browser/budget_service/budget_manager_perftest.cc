@@ -0,0 +1,253 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/test/simple_test_clock.h"
+#include "base/time/time.h"
+#include "chrome/browser/budget_service/budget_database.h"
+#include "chrome/browser/budget_service/budget_manager.h"
+#include "chrome/browser/budget_service/budget_manager_factory.h"
+#include "chrome/browser/engagement/site_engagement_score.h"
+#include "chrome/browser/engagement/site_engagement_service.h"
+#include "chrome/test/base/testing_profile.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+#include "third_party/WebKit/public/platform/modules/budget_service/budget_service.mojom.h"
+#include "url/gurl.h"
+#include "url/origin.h"
+
+namespace {
+
+// The exponent of the Zipf distribution used to pick the origin for each
+// operation. An exponent of 1 means the most popular origin receives about
+// twice the operations of the second most popular one.
+const double kZipfExponent = 1.0;
+
+// The simulated time which passes between operations, so that engagement
+// budget keeps being awarded and chunks expire over the run.
+const int kOperationsPerHour = 200;
+
+// Fixed seed so that runs are comparable.
+const uint32_t kRandomSeed = 42;
+
+struct Workload {
+  const char* name;
+  size_t num_origins;
+  size_t num_operations;
+
+  // Whether all operations are issued at once, like a burst of push messages
+  // after coming back online, or one after another.
+  bool burst;
+
+  // How long BudgetDatabase holds back writes to coalesce them. A negative
+  // value keeps the default.
+  int write_delay_ms;
+};
+
+const Workload kWorkloads[] = {
+    {"sequential_100_origins", 100, 2000, false, 0},
+    {"sequential_1000_origins", 1000, 2000, false, 0},
+    {"burst_1000_origins", 1000, 2000, true, -1},
+    {"burst_10000_origins", 10000, 5000, true, -1},
+};
+
+// Samples ranks in [0, n) with probability proportional to 1 / (rank + 1)^s.
+class ZipfDistribution {
+ public:
+  ZipfDistribution(size_t n, double exponent) : cdf_(n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sum += 1.0 / std::pow(i + 1, exponent);
+      cdf_[i] = sum;
+    }
+    for (double& value : cdf_)
+      value /= sum;
+  }
+
+  size_t Sample(std::mt19937* generator) {
+    double value = std::uniform_real_distribution<double>(0, 1)(*generator);
+    auto iter = std::lower_bound(cdf_.begin(), cdf_.end(), value);
+    return std::min<size_t>(iter - cdf_.begin(), cdf_.size() - 1);
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+// Returns the |percentile| (between 0 and 1) of the sorted |values|.
+double Percentile(const std::vector<double>& values, double percentile) {
+  if (values.empty())
+    return 0;
+  size_t index = static_cast<size_t>(percentile * (values.size() - 1));
+  return values[index];
+}
+
+}  // namespace
+
+// Drives the BudgetManager of a testing profile, which keeps its budget in a
+// LevelDB on disk, with a synthetic mix of GetBudget, Reserve and Consume
+// calls, and reports throughput, callback latency and database traffic.
+class BudgetManagerPerfTest : public testing::Test {
+ public:
+  BudgetManagerPerfTest() : clock_(nullptr), outstanding_(0) {}
+  ~BudgetManagerPerfTest() override {}
+
+  void SetUp() override {
+    clock_ = new base::SimpleTestClock();
+    clock_->SetNow(base::Time::Now());
+    database()->SetClockForTesting(base::WrapUnique(clock_));
+  }
+
+  BudgetManager* manager() {
+    return BudgetManagerFactory::GetForProfile(&profile_);
+  }
+  BudgetDatabase* database() { return &manager()->db_; }
+
+  void RunWorkload(const Workload& workload) {
+    if (workload.write_delay_ms >= 0) {
+      database()->SetWriteDelayForTesting(
+          base::TimeDelta::FromMilliseconds(workload.write_delay_ms));
+    }
+
+    // Give the origins a spread of engagement scores.
+    SiteEngagementService* service = SiteEngagementService::Get(&profile_);
+    std::vector<url::Origin> origins;
+    for (size_t i = 0; i < workload.num_origins; ++i) {
+      origins.push_back(url::Origin(GURL(
+          "https://origin" + base::SizeTToString(i) + ".example.com")));
+      service->ResetBaseScoreForURL(origins.back().GetURL(),
+                                    (i % 10 + 1) * 0.1 *
+                                        SiteEngagementScore::kMaxPoints);
+    }
+
+    std::mt19937 generator(kRandomSeed);
+    ZipfDistribution distribution(workload.num_origins, kZipfExponent);
+    int initial_reads = database()->database_read_count_;
+    int initial_writes = database()->database_write_count_;
+    latencies_.clear();
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    for (size_t i = 0; i < workload.num_operations; ++i) {
+      if (i > 0 && i % kOperationsPerHour == 0)
+        clock_->Advance(base::TimeDelta::FromHours(1));
+
+      const url::Origin& origin = origins[distribution.Sample(&generator)];
+      IssueOperation(origin, i);
+      if (!workload.burst)
+        WaitForOperations();
+    }
+    WaitForOperations();
+    base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+
+    std::sort(latencies_.begin(), latencies_.end());
+    ASSERT_EQ(workload.num_operations, latencies_.size());
+
+    PrintResult(workload, "operations_per_second",
+                workload.num_operations / elapsed.InSecondsF(), "ops/s");
+    PrintResult(workload, "latency_p50", Percentile(latencies_, 0.5), "ms");
+    PrintResult(workload, "latency_p99", Percentile(latencies_, 0.99), "ms");
+    PrintResult(workload, "database_reads",
+                database()->database_read_count_ - initial_reads, "count");
+    PrintResult(workload, "database_writes",
+                database()->database_write_count_ - initial_writes, "count");
+  }
+
+ private:
+  // Every third operation queries the budget; the others either reserve or
+  // consume budget for a silent push message.
+  void IssueOperation(const url::Origin& origin, size_t index) {
+    const blink::mojom::BudgetOperationType type =
+        blink::mojom::BudgetOperationType::SILENT_PUSH;
+    base::TimeTicks start = base::TimeTicks::Now();
+    outstanding_++;
+    switch (index % 3) {
+      case 0:
+        manager()->GetBudget(
+            origin, base::Bind(&BudgetManagerPerfTest::DidGetBudget,
+                               base::Unretained(this), start));
+        break;
+      case 1:
+        manager()->Reserve(origin, type,
+                           base::Bind(&BudgetManagerPerfTest::DidReserve,
+                                      base::Unretained(this), start));
+        break;
+      case 2:
+        manager()->Consume(origin, type,
+                           base::Bind(&BudgetManagerPerfTest::DidConsume,
+                                      base::Unretained(this), start));
+        break;
+    }
+  }
+
+  void DidGetBudget(base::TimeTicks start,
+                    blink::mojom::BudgetServiceErrorType error,
+                    std::vector<blink::mojom::BudgetStatePtr> budget) {
+    EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NONE, error);
+    DidCompleteOperation(start);
+  }
+
+  void DidReserve(base::TimeTicks start,
+                  blink::mojom::BudgetServiceErrorType error,
+                  bool success) {
+    EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NONE, error);
+    DidCompleteOperation(start);
+  }
+
+  void DidConsume(base::TimeTicks start, bool success) {
+    DidCompleteOperation(start);
+  }
+
+  void DidCompleteOperation(base::TimeTicks start) {
+    latencies_.push_back((base::TimeTicks::Now() - start).InMillisecondsF());
+    DCHECK_GT(outstanding_, 0U);
+    if (--outstanding_ == 0 && !quit_closure_.is_null())
+      quit_closure_.Run();
+  }
+
+  void WaitForOperations() {
+    if (outstanding_ == 0)
+      return;
+    base::RunLoop run_loop;
+    quit_closure_ = run_loop.QuitClosure();
+    run_loop.Run();
+    quit_closure_.Reset();
+  }
+
+  void PrintResult(const Workload& workload,
+                   const std::string& trace,
+                   double value,
+                   const std::string& units) {
+    perf_test::PrintResult("budget_manager", std::string("_") + workload.name,
+                           trace, value, units, true /* important */);
+  }
+
+  content::TestBrowserThreadBundle thread_bundle_;
+  TestingProfile profile_;
+
+  // Owned by the BudgetDatabase.
+  base::SimpleTestClock* clock_;
+
+  size_t outstanding_;
+  base::Closure quit_closure_;
+  std::vector<double> latencies_;
+
+  DISALLOW_COPY_AND_ASSIGN(BudgetManagerPerfTest);
+};
+
+TEST_F(BudgetManagerPerfTest, SyntheticWorkloads) {
+  for (const Workload& workload : kWorkloads)
+    RunWorkload(workload);
+}
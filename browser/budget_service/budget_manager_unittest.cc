@@ -98,8 +98,41 @@ class BudgetManagerTest : public testing::Test {
     return success_;
   }
 
+  void ReserveBatchCallback(
+      base::Closure run_loop_closure,
+      const std::vector<BudgetDatabase::SpendResult>& results) {
+    reserve_results_ = results;
+    run_loop_closure.Run();
+  }
+
+  void ConsumeBatchCallback(base::Closure run_loop_closure,
+                            const std::vector<bool>& results) {
+    consume_results_ = results;
+    run_loop_closure.Run();
+  }
+
+  void ReserveBudgetBatch(
+      const std::vector<BudgetManager::OperationRequest>& requests) {
+    base::RunLoop run_loop;
+    GetManager()->ReserveBatch(
+        requests, base::Bind(&BudgetManagerTest::ReserveBatchCallback,
+                             base::Unretained(this), run_loop.QuitClosure()));
+    run_loop.Run();
+  }
+
+  void ConsumeBudgetBatch(
+      const std::vector<BudgetManager::OperationRequest>& requests) {
+    base::RunLoop run_loop;
+    GetManager()->ConsumeBatch(
+        requests, base::Bind(&BudgetManagerTest::ConsumeBatchCallback,
+                             base::Unretained(this), run_loop.QuitClosure()));
+    run_loop.Run();
+  }
+
   // Members for callbacks to set.
   bool success_;
+  std::vector<BudgetDatabase::SpendResult> reserve_results_;
+  std::vector<bool> consume_results_;
   blink::mojom::BudgetServiceErrorType error_;
 
  protected:
@@ -184,3 +217,39 @@ TEST_F(BudgetManagerTest, TestUniqueOrigin) {
   ASSERT_EQ(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED, error_);
   ASSERT_FALSE(ConsumeBudget(type));
 }
+
+TEST_F(BudgetManagerTest, ReserveAndConsumeBatch) {
+  // The engagement award covers 11 silent push messages, as above.
+  SetSiteEngagementScore(kTestSES);
+  const blink::mojom::BudgetOperationType type =
+      blink::mojom::BudgetOperationType::SILENT_PUSH;
+  const url::Origin insecure_origin(GURL("http://example.com"));
+
+  std::vector<BudgetManager::OperationRequest> requests(
+      12, std::make_pair(origin(), type));
+  requests.insert(requests.begin() + 5, std::make_pair(insecure_origin, type));
+
+  // The first 11 reservations for the origin succeed, and the insecure origin
+  // isn't supported.
+  ReserveBudgetBatch(requests);
+  ASSERT_EQ(requests.size(), reserve_results_.size());
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const BudgetDatabase::SpendResult& result = reserve_results_[i];
+    if (i == 5) {
+      EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NOT_SUPPORTED,
+                result.error);
+      EXPECT_FALSE(result.success);
+      continue;
+    }
+    EXPECT_EQ(blink::mojom::BudgetServiceErrorType::NONE, result.error);
+    EXPECT_EQ(i < requests.size() - 1, result.success);
+  }
+
+  // Consuming uses up the 11 reservations, after which there is no budget
+  // left to spend directly.
+  ConsumeBudgetBatch(requests);
+  ASSERT_EQ(requests.size(), consume_results_.size());
+  for (size_t i = 0; i < requests.size(); ++i)
+    EXPECT_EQ(i != 5 && i < requests.size() - 1, consume_results_[i]);
+  EXPECT_FALSE(ConsumeBudget(type));
+}
@@ -5,6 +5,7 @@
 #include "chrome/browser/icon_loader.h"
 
 #include "base/bind.h"
+#include "base/task_runner_util.h"
 #include "base/threading/thread_task_runner_handle.h"
 #include "content/public/browser/browser_thread.h"
 
@@ -14,12 +15,33 @@ using content::BrowserThread;
 IconLoader* IconLoader::Create(const base::FilePath& file_path,
                                IconSize size,
                                IconLoadedCallback callback) {
-  return new IconLoader(file_path, size, callback);
+  return new IconLoader(file_path, IconGroup(), false, size, callback);
+}
+
+// static
+IconLoader* IconLoader::CreateForGroup(const IconGroup& group,
+                                       IconSize size,
+                                       IconLoadedCallback callback) {
+  return new IconLoader(base::FilePath(), group, true, size, callback);
+}
+
+// static
+void IconLoader::ReadGroups(const std::vector<base::FilePath>& file_paths,
+                            const GroupsReadCallback& callback) {
+  base::PostTaskAndReplyWithResult(
+      BrowserThread::GetTaskRunnerForThread(BrowserThread::FILE).get(),
+      FROM_HERE, base::Bind(&IconLoader::GroupsForFilepaths, file_paths),
+      callback);
 }
 
 void IconLoader::Start() {
   target_task_runner_ = base::ThreadTaskRunnerHandle::Get();
 
+  if (group_known_) {
+    OnReadGroup();
+    return;
+  }
+
   BrowserThread::PostTaskAndReply(
       BrowserThread::FILE, FROM_HERE,
       base::Bind(&IconLoader::ReadGroup, base::Unretained(this)),
@@ -27,12 +49,28 @@ void IconLoader::Start() {
 }
 
 IconLoader::IconLoader(const base::FilePath& file_path,
+                       const IconGroup& group,
+                       bool group_known,
                        IconSize size,
                        IconLoadedCallback callback)
-    : file_path_(file_path), icon_size_(size), callback_(callback) {}
+    : file_path_(file_path),
+      group_(group),
+      group_known_(group_known),
+      icon_size_(size),
+      callback_(callback) {}
 
 IconLoader::~IconLoader() {}
 
+// static
+std::vector<IconLoader::IconGroup> IconLoader::GroupsForFilepaths(
+    const std::vector<base::FilePath>& file_paths) {
+  std::vector<IconGroup> groups;
+  groups.reserve(file_paths.size());
+  for (const base::FilePath& file_path : file_paths)
+    groups.push_back(GroupForFilepath(file_path));
+  return groups;
+}
+
 void IconLoader::ReadGroup() {
   group_ = GroupForFilepath(file_path_);
 }
@@ -7,6 +7,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "base/callback.h"
 #include "base/files/file_path.h"
@@ -45,12 +46,28 @@ class IconLoader {
   using IconLoadedCallback =
       base::Callback<void(std::unique_ptr<gfx::Image>, const IconGroup&)>;
 
+  // The callback invoked with the groups of a list of files, in the same
+  // order as the files.
+  using GroupsReadCallback =
+      base::Callback<void(const std::vector<IconGroup>&)>;
+
   // Creates an IconLoader, which owns itself. If the IconLoader might outlive
   // the caller, be sure to use a weak pointer in the |callback|.
   static IconLoader* Create(const base::FilePath& file_path,
                             IconSize size,
                             IconLoadedCallback callback);
 
+  // Like Create(), for the icon of an already known |group|. This skips the
+  // trip to the file thread to find the group of a file.
+  static IconLoader* CreateForGroup(const IconGroup& group,
+                                    IconSize size,
+                                    IconLoadedCallback callback);
+
+  // Finds the groups of all of |file_paths| in a single task on the file
+  // thread, and runs |callback| with them on the calling thread.
+  static void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                         const GroupsReadCallback& callback);
+
   // Starts the process of reading the icon. When the reading of the icon is
   // complete, the IconLoadedCallback callback will be fulfilled, and the
   // IconLoader will delete itself.
@@ -58,6 +75,8 @@ class IconLoader {
 
  private:
   IconLoader(const base::FilePath& file_path,
+             const IconGroup& group,
+             bool group_known,
              IconSize size,
              IconLoadedCallback callback);
 
@@ -65,6 +84,8 @@ class IconLoader {
 
   // Given a file path, get the group for the given file.
   static IconGroup GroupForFilepath(const base::FilePath& file_path);
+  static std::vector<IconGroup> GroupsForFilepaths(
+      const std::vector<base::FilePath>& file_paths);
 
   // The thread ReadIcon() should be called on.
   static content::BrowserThread::ID ReadIconThreadID();
@@ -80,6 +101,9 @@ class IconLoader {
 
   IconGroup group_;
 
+  // Whether |group_| was given at creation, so ReadGroup() is not needed.
+  bool group_known_;
+
   IconSize icon_size_;
 
   IconLoadedCallback callback_;
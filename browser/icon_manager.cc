@@ -6,42 +6,79 @@
 
 #include <memory>
 #include <tuple>
+#include <utility>
 
 #include "base/bind.h"
 #include "base/task_runner.h"
+#include "base/threading/thread_task_runner_handle.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 #include "third_party/skia/include/core/SkCanvas.h"
+#include "ui/gfx/image/image_skia.h"
+#include "ui/gfx/image/image_skia_rep.h"
 
 namespace {
 
+// Bytes of icon pixel data kept in the cache. Even the largest icons take a few
+// tens of kilobytes, so this holds several hundred of them.
+const size_t kMaxIconCacheBytes = 2 * 1024 * 1024;
+
+// File paths whose icon group is remembered. Pages such as the downloads page
+// may look up icons for an unbounded number of files.
+const size_t kMaxGroupCacheEntries = 1000;
+
+// Returns the bytes of pixel data held by |image|.
+size_t GetImageBytes(const gfx::Image& image) {
+  if (!image.HasRepresentation(gfx::Image::kImageRepSkia))
+    return 4 * static_cast<size_t>(image.Width()) * image.Height();
+
+  size_t bytes = 0;
+  for (const gfx::ImageSkiaRep& image_rep : image.AsImageSkia().image_reps())
+    bytes += image_rep.sk_bitmap().getSize();
+  return bytes;
+}
+
 void RunCallbackIfNotCanceled(
     const base::CancelableTaskTracker::IsCanceledCallback& is_canceled,
-    const IconManager::IconRequestCallback& callback,
+    const IconManager::IconsRequestCallback& callback,
+    const base::FilePath& file_path,
     gfx::Image* image) {
   if (is_canceled.Run())
     return;
+  callback.Run(file_path, image);
+}
+
+void RunCallbackWithoutPath(const IconManager::IconRequestCallback& callback,
+                            const base::FilePath& file_path,
+                            gfx::Image* image) {
   callback.Run(image);
 }
 
 }  // namespace
 
-IconManager::IconManager() : weak_factory_(this) {}
+IconManager::IconManager()
+    : group_cache_(kMaxGroupCacheEntries),
+      icon_cache_(base::MRUCache<CacheKey, CachedIcon>::NO_AUTO_EVICT),
+      max_icon_cache_bytes_(kMaxIconCacheBytes),
+      memory_pressure_listener_(new base::MemoryPressureListener(
+          base::Bind(&IconManager::OnMemoryPressure, base::Unretained(this)))),
+      weak_factory_(this) {}
 
 IconManager::~IconManager() {
 }
 
 gfx::Image* IconManager::LookupIconFromFilepath(const base::FilePath& file_path,
                                                 IconLoader::IconSize size) {
-  auto group_it = group_cache_.find(file_path);
+  auto group_it = group_cache_.Get(file_path);
   if (group_it == group_cache_.end())
     return nullptr;
 
   CacheKey key(group_it->second, size);
-  auto icon_it = icon_cache_.find(key);
+  auto icon_it = icon_cache_.Get(key);
   if (icon_it == icon_cache_.end())
     return nullptr;
 
-  return icon_it->second.get();
+  ++cache_stats_.hits;
+  return icon_it->second.image.get();
 }
 
 base::CancelableTaskTracker::TaskId IconManager::LoadIcon(
@@ -49,45 +86,172 @@ base::CancelableTaskTracker::TaskId IconManager::LoadIcon(
     IconLoader::IconSize size,
     const IconRequestCallback& callback,
     base::CancelableTaskTracker* tracker) {
+  return LoadIcons(std::vector<base::FilePath>(1, file_path), size,
+                   base::Bind(&RunCallbackWithoutPath, callback), tracker);
+}
+
+base::CancelableTaskTracker::TaskId IconManager::LoadIcons(
+    const std::vector<base::FilePath>& file_paths,
+    IconLoader::IconSize size,
+    const IconsRequestCallback& callback,
+    base::CancelableTaskTracker* tracker) {
   base::CancelableTaskTracker::IsCanceledCallback is_canceled;
   base::CancelableTaskTracker::TaskId id =
       tracker->NewTrackedTaskId(&is_canceled);
-  IconRequestCallback callback_runner = base::Bind(
+  IconsRequestCallback callback_runner = base::Bind(
       &RunCallbackIfNotCanceled, is_canceled, callback);
 
-  IconLoader* loader = IconLoader::Create(
-      file_path, size,
-      base::Bind(&IconManager::OnIconLoaded, weak_factory_.GetWeakPtr(),
-                 callback_runner, file_path, size));
-  loader->Start();
+  // Only the files whose group is not known yet need the file thread.
+  std::vector<base::FilePath> known_paths;
+  std::vector<IconLoader::IconGroup> known_groups;
+  std::vector<base::FilePath> unknown_paths;
+  for (const base::FilePath& file_path : file_paths) {
+    auto group_it = group_cache_.Get(file_path);
+    if (group_it == group_cache_.end()) {
+      unknown_paths.push_back(file_path);
+    } else {
+      known_paths.push_back(file_path);
+      known_groups.push_back(group_it->second);
+    }
+  }
+
+  if (!known_paths.empty()) {
+    base::ThreadTaskRunnerHandle::Get()->PostTask(
+        FROM_HERE,
+        base::Bind(&IconManager::OnGroupsRead, weak_factory_.GetWeakPtr(),
+                   size, callback_runner, known_paths, known_groups));
+  }
+  if (!unknown_paths.empty()) {
+    ReadGroups(unknown_paths,
+               base::Bind(&IconManager::OnGroupsRead,
+                          weak_factory_.GetWeakPtr(), size, callback_runner,
+                          unknown_paths));
+  }
 
   return id;
 }
 
-void IconManager::OnIconLoaded(IconRequestCallback callback,
-                               base::FilePath file_path,
-                               IconLoader::IconSize size,
+void IconManager::ReadGroups(const std::vector<base::FilePath>& file_paths,
+                             const IconLoader::GroupsReadCallback& callback) {
+  IconLoader::ReadGroups(file_paths, callback);
+}
+
+void IconManager::StartIconLoader(
+    const IconLoader::IconGroup& group,
+    IconLoader::IconSize size,
+    const IconLoader::IconLoadedCallback& callback) {
+  IconLoader* loader = IconLoader::CreateForGroup(group, size, callback);
+  loader->Start();
+}
+
+void IconManager::OnGroupsRead(
+    IconLoader::IconSize size,
+    const IconsRequestCallback& callback,
+    const std::vector<base::FilePath>& file_paths,
+    const std::vector<IconLoader::IconGroup>& groups) {
+  DCHECK_EQ(file_paths.size(), groups.size());
+  for (size_t i = 0; i < file_paths.size(); ++i) {
+    group_cache_.Put(file_paths[i], groups[i]);
+    LoadIconForKey(CacheKey(groups[i], size),
+                   base::Bind(callback, file_paths[i]));
+  }
+}
+
+void IconManager::LoadIconForKey(const CacheKey& key,
+                                 const IconRequestCallback& callback) {
+  auto icon_it = icon_cache_.Get(key);
+  if (icon_it != icon_cache_.end()) {
+    ++cache_stats_.hits;
+    callback.Run(icon_it->second.image.get());
+    return;
+  }
+  ++cache_stats_.misses;
+
+  std::vector<IconRequestCallback>& callbacks = pending_loads_[key];
+  callbacks.push_back(callback);
+  if (callbacks.size() > 1)
+    return;
+
+  StartIconLoader(key.group, key.size,
+                  base::Bind(&IconManager::OnIconLoaded,
+                             weak_factory_.GetWeakPtr(), key.size));
+}
+
+void IconManager::OnIconLoaded(IconLoader::IconSize size,
                                std::unique_ptr<gfx::Image> result,
                                const IconLoader::IconGroup& group) {
+  CacheKey key(group, size);
+  std::vector<IconRequestCallback> callbacks;
+  auto pending_it = pending_loads_.find(key);
+  if (pending_it != pending_loads_.end()) {
+    callbacks = std::move(pending_it->second);
+    pending_loads_.erase(pending_it);
+  }
+
   // Cache the bitmap. Watch out: |result| may be null, which indicates a
   // failure. We assume that if we have an entry in |icon_cache_| it must not be
-  // null.
-  CacheKey key(group, size);
+  // null. |image| stays valid while the callbacks run, even if it is too
+  // large to be cached.
+  RemoveIcon(key);
+  gfx::Image* image = result.get();
   if (result) {
-    callback.Run(result.get());
-    icon_cache_[key] = std::move(result);
-  } else {
-    callback.Run(nullptr);
-    icon_cache_.erase(key);
+    size_t byte_size = GetImageBytes(*result);
+    if (byte_size <= max_icon_cache_bytes_) {
+      icon_cache_.Put(key, CachedIcon(std::move(result), byte_size));
+      cache_stats_.bytes += byte_size;
+      TrimIconCache(max_icon_cache_bytes_);
+    }
   }
 
-  group_cache_[file_path] = group;
+  for (const IconRequestCallback& callback : callbacks)
+    callback.Run(image);
+}
+
+void IconManager::RemoveIcon(const CacheKey& key) {
+  auto icon_it = icon_cache_.Peek(key);
+  if (icon_it == icon_cache_.end())
+    return;
+  cache_stats_.bytes -= icon_it->second.byte_size;
+  icon_cache_.Erase(icon_it);
+}
+
+void IconManager::TrimIconCache(size_t max_bytes) {
+  while (cache_stats_.bytes > max_bytes && !icon_cache_.empty()) {
+    auto icon_it = icon_cache_.rbegin();
+    cache_stats_.bytes -= icon_it->second.byte_size;
+    icon_cache_.Erase(icon_it);
+    ++cache_stats_.evictions;
+  }
+}
+
+void IconManager::OnMemoryPressure(
+    base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level) {
+  switch (memory_pressure_level) {
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_NONE:
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_MODERATE:
+      TrimIconCache(max_icon_cache_bytes_ / 2);
+      group_cache_.ShrinkToSize(kMaxGroupCacheEntries / 2);
+      break;
+    case base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL:
+      TrimIconCache(0);
+      group_cache_.Clear();
+      break;
+  }
 }
 
 IconManager::CacheKey::CacheKey(const IconLoader::IconGroup& group,
                                 IconLoader::IconSize size)
     : group(group), size(size) {}
 
+IconManager::CachedIcon::CachedIcon(std::unique_ptr<gfx::Image> image,
+                                    size_t byte_size)
+    : image(std::move(image)), byte_size(byte_size) {}
+
+IconManager::CachedIcon::CachedIcon(CachedIcon&& other) = default;
+
+IconManager::CachedIcon::~CachedIcon() {}
+
 bool IconManager::CacheKey::operator<(const CacheKey &other) const {
   return std::tie(group, size) < std::tie(other.group, other.size);
 }
@@ -32,24 +32,33 @@
 //   1. A quick, synchronous check of its caches which does not touch the disk:
 //      IconManager::LookupIcon()
 //   2. An asynchronous icon load from a file on the file thread:
-//      IconManager::LoadIcon()
+//      IconManager::LoadIcon(), or IconManager::LoadIcons() for many files
 //
 // When using the second (asynchronous) method, callers must supply a callback
 // which will be run once the icon has been extracted. The icon manager will
 // cache the results of the icon extraction so that subsequent lookups will be
-// fast.
+// fast. Loads of the same icon which overlap share a single extraction.
 //
 // Icon bitmaps returned should be treated as const since they may be referenced
 // by other clients. Make a copy of the icon if you need to modify it.
+//
+// Both caches are bounded: icons are kept within a byte budget and file paths
+// within an entry limit, dropping the least recently used ones first. Memory
+// pressure shrinks or clears them.
 
 #ifndef CHROME_BROWSER_ICON_MANAGER_H_
 #define CHROME_BROWSER_ICON_MANAGER_H_
 
+#include <stddef.h>
+
 #include <map>
 #include <memory>
+#include <vector>
 
+#include "base/containers/mru_cache.h"
 #include "base/files/file_path.h"
 #include "base/macros.h"
+#include "base/memory/memory_pressure_listener.h"
 #include "base/memory/weak_ptr.h"
 #include "base/task/cancelable_task_tracker.h"
 #include "chrome/browser/icon_loader.h"
@@ -58,13 +67,14 @@
 class IconManager {
  public:
   IconManager();
-  ~IconManager();
+  virtual ~IconManager();
 
   // Synchronous call to examine the internal caches for the icon. Returns the
   // icon if we have already loaded it, or null if we don't have it and must
   // load it via LoadIcon(). The returned bitmap is owned by the IconManager and
   // must not be free'd by the caller. If the caller needs to modify the icon,
-  // it must make a copy and modify the copy.
+  // it must make a copy and modify the copy. The icon may be evicted once
+  // control returns to the message loop, so the pointer must not be kept.
   gfx::Image* LookupIconFromFilepath(const base::FilePath& file_path,
                                      IconLoader::IconSize size);
 
@@ -75,7 +85,8 @@ class IconManager {
   // this function is called.
   //
   // Note:
-  // 1. This does *not* check the cache.
+  // 1. Icons in the cache are returned without being loaded again, but the
+  //    callback is still run asynchronously.
   // 2. The returned bitmap pointer is *not* owned by callback. So callback
   //    should never keep it or delete it.
   // 3. The gfx::Image pointer passed to the callback will be null if decoding
@@ -86,10 +97,67 @@ class IconManager {
       const IconRequestCallback& callback,
       base::CancelableTaskTracker* tracker);
 
+  using IconsRequestCallback =
+      base::Callback<void(const base::FilePath&, gfx::Image*)>;
+
+  // Like LoadIcon(), for all of |file_paths|. |callback| is run once for each
+  // file, with its path. The groups of all the files are found in a single
+  // task on the file thread, and each distinct icon is loaded only once.
+  // Canceling the returned task cancels the callbacks for all the files.
+  base::CancelableTaskTracker::TaskId LoadIcons(
+      const std::vector<base::FilePath>& file_paths,
+      IconLoader::IconSize size,
+      const IconsRequestCallback& callback,
+      base::CancelableTaskTracker* tracker);
+
+  // Counters describing the icon cache.
+  struct CacheStats {
+    CacheStats() : hits(0), misses(0), evictions(0), bytes(0) {}
+
+    // Requests which found the icon in the cache, or did not. Each lookup or
+    // load counts once: lookups only count hits, since callers load the icons
+    // they miss, and that load counts the miss.
+    size_t hits;
+    size_t misses;
+
+    // Icons which were dropped to stay within the byte budget or to release
+    // memory under pressure.
+    size_t evictions;
+
+    // Bytes of pixel data currently held by the cache.
+    size_t bytes;
+  };
+
+  const CacheStats& cache_stats() const { return cache_stats_; }
+
+ protected:
+  // Finds the groups of |file_paths| and runs |callback| with them. Virtual
+  // method so tests can avoid the file thread.
+  virtual void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                          const IconLoader::GroupsReadCallback& callback);
+
+  // Starts loading the icon of |group|, which is passed to |callback|. Virtual
+  // method so tests can provide the icons.
+  virtual void StartIconLoader(const IconLoader::IconGroup& group,
+                               IconLoader::IconSize size,
+                               const IconLoader::IconLoadedCallback& callback);
+
  private:
-  void OnIconLoaded(IconRequestCallback callback,
-                    base::FilePath file_path,
-                    IconLoader::IconSize size,
+  friend class IconManagerTest;
+
+  struct CacheKey;
+
+  // Called with the |groups| of the |file_paths| passed to LoadIcons().
+  void OnGroupsRead(IconLoader::IconSize size,
+                    const IconsRequestCallback& callback,
+                    const std::vector<base::FilePath>& file_paths,
+                    const std::vector<IconLoader::IconGroup>& groups);
+
+  // Runs |callback| with the icon for |key|, loading it unless it is cached or
+  // already being loaded.
+  void LoadIconForKey(const CacheKey& key, const IconRequestCallback& callback);
+
+  void OnIconLoaded(IconLoader::IconSize size,
                     std::unique_ptr<gfx::Image> result,
                     const IconLoader::IconGroup& group);
 
@@ -103,8 +171,37 @@ class IconManager {
     IconLoader::IconSize size;
   };
 
-  std::map<base::FilePath, IconLoader::IconGroup> group_cache_;
-  std::map<CacheKey, std::unique_ptr<gfx::Image>> icon_cache_;
+  struct CachedIcon {
+    CachedIcon(std::unique_ptr<gfx::Image> image, size_t byte_size);
+    CachedIcon(CachedIcon&& other);
+    ~CachedIcon();
+
+    std::unique_ptr<gfx::Image> image;
+    size_t byte_size;
+  };
+
+  // Removes the icon for |key| from |icon_cache_|, if there is one.
+  void RemoveIcon(const CacheKey& key);
+
+  // Evicts the least recently used icons until the cache holds no more than
+  // |max_bytes|.
+  void TrimIconCache(size_t max_bytes);
+
+  void OnMemoryPressure(
+      base::MemoryPressureListener::MemoryPressureLevel memory_pressure_level);
+
+  base::MRUCache<base::FilePath, IconLoader::IconGroup> group_cache_;
+  base::MRUCache<CacheKey, CachedIcon> icon_cache_;
+
+  // Bytes of pixel data kept in |icon_cache_|.
+  size_t max_icon_cache_bytes_;
+
+  // The callbacks waiting for each icon being loaded.
+  std::map<CacheKey, std::vector<IconRequestCallback>> pending_loads_;
+
+  CacheStats cache_stats_;
+
+  std::unique_ptr<base::MemoryPressureListener> memory_pressure_listener_;
 
   base::WeakPtrFactory<IconManager> weak_factory_;
 
@@ -0,0 +1,290 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/icon_manager.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/files/file_path.h"
+#include "base/macros.h"
+#include "base/memory/memory_pressure_listener.h"
+#include "base/memory/ptr_util.h"
+#include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/task/cancelable_task_tracker.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/image/image.h"
+
+namespace {
+
+const int kIconSize = 16;
+const size_t kIconBytes = kIconSize * kIconSize * 4;
+
+// An icon load started by TestIconManager, waiting to be finished.
+struct PendingLoad {
+  IconLoader::IconGroup group;
+  IconLoader::IconSize size;
+  IconLoader::IconLoadedCallback callback;
+};
+
+// Uses the extension of each file as its group, and leaves the icon loads to
+// the test instead of starting IconLoaders.
+class TestIconManager : public IconManager {
+ public:
+  TestIconManager() : read_groups_count_(0) {}
+  ~TestIconManager() override {}
+
+  size_t read_groups_count() const { return read_groups_count_; }
+  std::vector<PendingLoad>& pending_loads() { return pending_loads_; }
+
+ private:
+  // IconManager:
+  void ReadGroups(const std::vector<base::FilePath>& file_paths,
+                  const IconLoader::GroupsReadCallback& callback) override {
+    ++read_groups_count_;
+    std::vector<IconLoader::IconGroup> groups;
+    for (const base::FilePath& file_path : file_paths)
+      groups.push_back(file_path.Extension());
+    base::ThreadTaskRunnerHandle::Get()->PostTask(
+        FROM_HERE, base::Bind(callback, groups));
+  }
+
+  void StartIconLoader(
+      const IconLoader::IconGroup& group,
+      IconLoader::IconSize size,
+      const IconLoader::IconLoadedCallback& callback) override {
+    pending_loads_.push_back({group, size, callback});
+  }
+
+  size_t read_groups_count_;
+  std::vector<PendingLoad> pending_loads_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestIconManager);
+};
+
+}  // namespace
+
+class IconManagerTest : public testing::Test {
+ public:
+  IconManagerTest() : manager_(new TestIconManager) {}
+  ~IconManagerTest() override {}
+
+  void set_max_icon_cache_bytes(size_t bytes) {
+    manager_->max_icon_cache_bytes_ = bytes;
+  }
+  size_t max_group_cache_entries() const {
+    return manager_->group_cache_.max_size();
+  }
+
+  // Loads the icon of |path| and finishes its load with an icon, unless it
+  // is cached.
+  void LoadAndFinish(const base::FilePath& path) {
+    manager_->LoadIcon(path, IconLoader::NORMAL,
+                       base::Bind(&IconManagerTest::DidLoadIcon,
+                                  base::Unretained(this)),
+                       &tracker_);
+    base::RunLoop().RunUntilIdle();
+    FinishPendingLoads();
+  }
+
+  // Loads the icons of |paths| at once and finishes their loads.
+  void LoadIconsAndFinish(const std::vector<base::FilePath>& paths) {
+    manager_->LoadIcons(paths, IconLoader::NORMAL,
+                        base::Bind(&IconManagerTest::DidLoadIconForPath,
+                                   base::Unretained(this)),
+                        &tracker_);
+    base::RunLoop().RunUntilIdle();
+    FinishPendingLoads();
+  }
+
+  // Finishes all the icon loads started so far with an icon each.
+  void FinishPendingLoads() {
+    std::vector<PendingLoad> loads;
+    loads.swap(manager_->pending_loads());
+    for (const PendingLoad& load : loads) {
+      SkBitmap bitmap;
+      bitmap.allocN32Pixels(kIconSize, kIconSize);
+      bitmap.eraseColor(SK_ColorBLUE);
+      load.callback.Run(
+          base::MakeUnique<gfx::Image>(gfx::Image::CreateFrom1xBitmap(bitmap)),
+          load.group);
+    }
+  }
+
+  bool IsCached(const base::FilePath& path) {
+    return manager_->LookupIconFromFilepath(path, IconLoader::NORMAL) !=
+           nullptr;
+  }
+
+  void DidLoadIcon(gfx::Image* image) {
+    ++icons_loaded_;
+    if (image)
+      ++icons_found_;
+  }
+
+  void DidLoadIconForPath(const base::FilePath& path, gfx::Image* image) {
+    loaded_paths_.push_back(path);
+    DidLoadIcon(image);
+  }
+
+ protected:
+  content::TestBrowserThreadBundle thread_bundle_;
+  std::unique_ptr<TestIconManager> manager_;
+  base::CancelableTaskTracker tracker_;
+
+  int icons_loaded_ = 0;
+  int icons_found_ = 0;
+  std::vector<base::FilePath> loaded_paths_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(IconManagerTest);
+};
+
+TEST_F(IconManagerTest, EvictsLeastRecentlyUsedIcons) {
+  set_max_icon_cache_bytes(3 * kIconBytes);
+  const base::FilePath a(FILE_PATH_LITERAL("a.aaa"));
+  const base::FilePath b(FILE_PATH_LITERAL("b.bbb"));
+  const base::FilePath c(FILE_PATH_LITERAL("c.ccc"));
+  const base::FilePath d(FILE_PATH_LITERAL("d.ddd"));
+  LoadAndFinish(a);
+  LoadAndFinish(b);
+  LoadAndFinish(c);
+  EXPECT_EQ(3 * kIconBytes, manager_->cache_stats().bytes);
+  EXPECT_EQ(0U, manager_->cache_stats().evictions);
+
+  // Using |a| leaves |b| as the least recently used icon.
+  EXPECT_TRUE(IsCached(a));
+  LoadAndFinish(d);
+  EXPECT_EQ(1U, manager_->cache_stats().evictions);
+  EXPECT_EQ(3 * kIconBytes, manager_->cache_stats().bytes);
+  EXPECT_FALSE(IsCached(b));
+  EXPECT_TRUE(IsCached(a));
+  EXPECT_TRUE(IsCached(c));
+  EXPECT_TRUE(IsCached(d));
+
+  // Icons larger than the whole budget are returned but not cached.
+  set_max_icon_cache_bytes(kIconBytes - 1);
+  LoadAndFinish(base::FilePath(FILE_PATH_LITERAL("e.eee")));
+  EXPECT_EQ(5, icons_found_);
+  EXPECT_FALSE(IsCached(base::FilePath(FILE_PATH_LITERAL("e.eee"))));
+}
+
+TEST_F(IconManagerTest, GroupCacheIsBounded) {
+  // All the files share one icon, so only their groups take up space.
+  std::vector<base::FilePath> paths;
+  for (size_t i = 0; i <= max_group_cache_entries(); ++i)
+    paths.push_back(base::FilePath().AppendASCII(base::SizeTToString(i) +
+                                                 ".txt"));
+  LoadIconsAndFinish(paths);
+  EXPECT_EQ(paths.size(), loaded_paths_.size());
+
+  // The group of the first file was dropped to make room for the last one.
+  EXPECT_FALSE(IsCached(paths.front()));
+  EXPECT_TRUE(IsCached(paths[1]));
+  EXPECT_TRUE(IsCached(paths.back()));
+}
+
+TEST_F(IconManagerTest, CriticalMemoryPressureClearsCaches) {
+  const base::FilePath a(FILE_PATH_LITERAL("a.aaa"));
+  const base::FilePath b(FILE_PATH_LITERAL("b.bbb"));
+  LoadAndFinish(a);
+  LoadAndFinish(b);
+  EXPECT_EQ(2 * kIconBytes, manager_->cache_stats().bytes);
+
+  base::MemoryPressureListener::SimulatePressureNotification(
+      base::MemoryPressureListener::MEMORY_PRESSURE_LEVEL_CRITICAL);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(0U, manager_->cache_stats().bytes);
+  EXPECT_EQ(2U, manager_->cache_stats().evictions);
+  EXPECT_FALSE(IsCached(a));
+  EXPECT_FALSE(IsCached(b));
+
+  // The groups are gone too, so loading the icon again reads them anew.
+  size_t read_groups_count = manager_->read_groups_count();
+  LoadAndFinish(a);
+  EXPECT_EQ(read_groups_count + 1, manager_->read_groups_count());
+}
+
+TEST_F(IconManagerTest, CountsHitsAndMisses) {
+  const base::FilePath a(FILE_PATH_LITERAL("a.aaa"));
+
+  // A lookup which misses, followed by the load of the icon, is one miss.
+  EXPECT_FALSE(IsCached(a));
+  LoadAndFinish(a);
+  EXPECT_EQ(0U, manager_->cache_stats().hits);
+  EXPECT_EQ(1U, manager_->cache_stats().misses);
+  EXPECT_EQ(kIconBytes, manager_->cache_stats().bytes);
+
+  // Both lookups and loads are answered from the cache now.
+  EXPECT_TRUE(IsCached(a));
+  LoadAndFinish(a);
+  EXPECT_TRUE(manager_->pending_loads().empty());
+  EXPECT_EQ(2U, manager_->cache_stats().hits);
+  EXPECT_EQ(1U, manager_->cache_stats().misses);
+
+  // A file whose group is not known yet, but whose icon is cached, is a hit.
+  const base::FilePath b(FILE_PATH_LITERAL("b.aaa"));
+  EXPECT_FALSE(IsCached(b));
+  LoadAndFinish(b);
+  EXPECT_TRUE(manager_->pending_loads().empty());
+  EXPECT_EQ(3U, manager_->cache_stats().hits);
+  EXPECT_EQ(1U, manager_->cache_stats().misses);
+  EXPECT_EQ(3, icons_found_);
+}
+
+TEST_F(IconManagerTest, ConcurrentLoadsShareOneLoader) {
+  const base::FilePath a(FILE_PATH_LITERAL("a.aaa"));
+  IconManager::IconRequestCallback callback =
+      base::Bind(&IconManagerTest::DidLoadIcon, base::Unretained(this));
+  manager_->LoadIcon(a, IconLoader::NORMAL, callback, &tracker_);
+  manager_->LoadIcon(a, IconLoader::NORMAL, callback, &tracker_);
+  base::RunLoop().RunUntilIdle();
+  ASSERT_EQ(1U, manager_->pending_loads().size());
+  EXPECT_EQ(0, icons_loaded_);
+
+  // Another size is another icon.
+  manager_->LoadIcon(a, IconLoader::SMALL, callback, &tracker_);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(2U, manager_->pending_loads().size());
+
+  FinishPendingLoads();
+  EXPECT_EQ(3, icons_loaded_);
+  EXPECT_EQ(3, icons_found_);
+}
+
+TEST_F(IconManagerTest, LoadIconsReadsGroupsOnce) {
+  const base::FilePath a(FILE_PATH_LITERAL("a.txt"));
+  const base::FilePath b(FILE_PATH_LITERAL("b.txt"));
+  const base::FilePath c(FILE_PATH_LITERAL("c.png"));
+  manager_->LoadIcons({a, b, c}, IconLoader::NORMAL,
+                      base::Bind(&IconManagerTest::DidLoadIconForPath,
+                                 base::Unretained(this)),
+                      &tracker_);
+  base::RunLoop().RunUntilIdle();
+  EXPECT_EQ(1U, manager_->read_groups_count());
+
+  // The two .txt files share one icon.
+  EXPECT_EQ(2U, manager_->pending_loads().size());
+  FinishPendingLoads();
+  EXPECT_EQ(3, icons_found_);
+  std::sort(loaded_paths_.begin(), loaded_paths_.end());
+  EXPECT_EQ(std::vector<base::FilePath>({a, b, c}), loaded_paths_);
+
+  // Only the files whose group is not known yet are read again.
+  loaded_paths_.clear();
+  const base::FilePath d(FILE_PATH_LITERAL("d.pdf"));
+  LoadIconsAndFinish({a, d});
+  EXPECT_EQ(2U, manager_->read_groups_count());
+  EXPECT_EQ(5, icons_found_);
+  std::sort(loaded_paths_.begin(), loaded_paths_.end());
+  EXPECT_EQ(std::vector<base::FilePath>({a, d}), loaded_paths_);
+}
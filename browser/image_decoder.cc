@@ -4,24 +4,37 @@
 
 #include "chrome/browser/image_decoder.h"
 
+#include <algorithm>
+#include <map>
 #include <utility>
 
 #include "base/bind.h"
 #include "base/callback.h"
+#include "base/sha1.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/stringprintf.h"
+#include "base/task_scheduler/post_task.h"
+#include "base/threading/sequenced_task_runner_handle.h"
 #include "base/threading/thread_task_runner_handle.h"
 #include "build/build_config.h"
 #include "content/public/browser/browser_thread.h"
 #include "content/public/common/service_manager_connection.h"
 #include "ipc/ipc_channel.h"
-#include "services/image_decoder/public/cpp/decode.h"
+#include "services/image_decoder/public/interfaces/constants.mojom.h"
+#include "services/image_decoder/public/interfaces/image_decoder.mojom.h"
 #include "services/service_manager/public/cpp/connector.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 #include "ui/gfx/geometry/size.h"
 
 namespace {
 
-const int64_t kMaxImageSizeInBytes =
-    static_cast<int64_t>(IPC::Channel::kMaximumMessageSize);
+// How long the connection to the image decoder service is kept open after the
+// last decode finishes. Holding the connection keeps the utility process which
+// hosts the service alive, so it is dropped once decodes stop coming in.
+const int kIdleConnectionTimeoutSeconds = 5;
+
+// Bytes of decoded pixel data kept with kImageDecoderResultCache.
+const size_t kMaxDecodedImageCacheBytes = 4 * 1024 * 1024;
 
 // Note that this is always called on the thread which initiated the
 // corresponding image_decoder::Decode request.
@@ -55,36 +68,237 @@ void RunDecodeCallbackOnTaskRunner(
   task_runner->PostTask(FROM_HERE, base::Bind(callback, image));
 }
 
-void DecodeImage(
-    std::vector<uint8_t> image_data,
-    image_decoder::mojom::ImageCodec codec,
-    bool shrink_to_fit,
-    const gfx::Size& desired_image_frame_size,
-    const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback,
-    scoped_refptr<base::SequencedTaskRunner> callback_task_runner) {
-  DCHECK_CURRENTLY_ON(content::BrowserThread::IO);
+// Keeps a connection to the image decoder service which is shared by all
+// decodes, so that a decode needs neither a new connector nor a hop to the UI
+// thread to bind one. The connection is re-established after the service goes
+// away, e.g. because its utility process crashed, and is closed after
+// |kIdleConnectionTimeoutSeconds| without decodes. Used on the sequence it
+// first decodes on. Instances are leaked, so there is no destructor.
+class DecoderServiceConnection {
+ public:
+  DecoderServiceConnection() : next_decode_id_(0) {
+    sequence_checker_.DetachFromSequence();
+  }
+
+  void Decode(
+      const std::vector<uint8_t>& image_data,
+      image_decoder::mojom::ImageCodec codec,
+      bool shrink_to_fit,
+      int64_t max_size_in_bytes,
+      const gfx::Size& desired_image_frame_size,
+      const image_decoder::mojom::ImageDecoder::DecodeImageCallback& callback) {
+    DCHECK(sequence_checker_.CalledOnValidSequence());
+    EnsureConnected();
+
+    int decode_id = next_decode_id_++;
+    pending_decodes_.insert(std::make_pair(decode_id, callback));
+    decoder_->DecodeImage(
+        image_data, codec, shrink_to_fit, max_size_in_bytes,
+        desired_image_frame_size,
+        base::Bind(&DecoderServiceConnection::OnDecodeDone,
+                   base::Unretained(this), decode_id));
+  }
+
+ private:
+  ~DecoderServiceConnection() = delete;
+
+  void EnsureConnected() {
+    if (decoder_)
+      return;
+
+    // The browser connector lives on the UI thread, so binding a connector to
+    // it takes a hop there. That only happens when (re)connecting.
+    if (!connector_) {
+      service_manager::mojom::ConnectorRequest connector_request;
+      connector_ = service_manager::Connector::Create(&connector_request);
+      BindToBrowserConnector(std::move(connector_request));
+    }
+
+    connector_->BindInterface(image_decoder::mojom::kServiceName, &decoder_);
+    decoder_.set_connection_error_handler(base::Bind(
+        &DecoderServiceConnection::OnConnectionError, base::Unretained(this)));
+  }
 
-  service_manager::mojom::ConnectorRequest connector_request;
-  std::unique_ptr<service_manager::Connector> connector =
-      service_manager::Connector::Create(&connector_request);
-  BindToBrowserConnector(std::move(connector_request));
+  void OnDecodeDone(int decode_id, const SkBitmap& image) {
+    auto it = pending_decodes_.find(decode_id);
+    DCHECK(it != pending_decodes_.end());
+    image_decoder::mojom::ImageDecoder::DecodeImageCallback callback =
+        it->second;
+    pending_decodes_.erase(it);
+    if (pending_decodes_.empty()) {
+      last_decode_time_ = base::TimeTicks::Now();
+      base::SequencedTaskRunnerHandle::Get()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&DecoderServiceConnection::DisconnectIfIdle,
+                     base::Unretained(this)),
+          base::TimeDelta::FromSeconds(kIdleConnectionTimeoutSeconds));
+    }
+    callback.Run(image);
+  }
+
+  void DisconnectIfIdle() {
+    if (pending_decodes_.empty() &&
+        base::TimeTicks::Now() - last_decode_time_ >=
+            base::TimeDelta::FromSeconds(kIdleConnectionTimeoutSeconds)) {
+      Disconnect();
+    }
+  }
+
+  // Fails the decodes which were in flight; the next decode reconnects.
+  void OnConnectionError() {
+    std::map<int, image_decoder::mojom::ImageDecoder::DecodeImageCallback>
+        pending_decodes;
+    pending_decodes.swap(pending_decodes_);
+    Disconnect();
+    for (const auto& decode : pending_decodes)
+      decode.second.Run(SkBitmap());
+  }
+
+  // Also drops the connector, in case it was the connection to the browser
+  // connector which broke.
+  void Disconnect() {
+    decoder_.reset();
+    connector_.reset();
+  }
+
+  std::unique_ptr<service_manager::Connector> connector_;
+  image_decoder::mojom::ImageDecoderPtr decoder_;
+
+  // Callbacks of the decodes sent over |decoder_|, by decode id.
+  std::map<int, image_decoder::mojom::ImageDecoder::DecodeImageCallback>
+      pending_decodes_;
+  int next_decode_id_;
+
+  // When |pending_decodes_| last became empty.
+  base::TimeTicks last_decode_time_;
+
+  base::SequenceChecker sequence_checker_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecoderServiceConnection);
+};
+
+// A decode on its way to the sequence which dispatches it.
+struct PendingDecode {
+  PendingDecode()
+      : codec(image_decoder::mojom::ImageCodec::DEFAULT),
+        shrink_to_fit(false),
+        max_size_in_bytes(ImageDecoder::kMaxImageSizeInBytes) {}
+  PendingDecode(PendingDecode&& other) = default;
+  PendingDecode& operator=(PendingDecode&& other) = default;
+
+  std::vector<uint8_t> image_data;
+  image_decoder::mojom::ImageCodec codec;
+  bool shrink_to_fit;
+  int64_t max_size_in_bytes;
+  gfx::Size desired_image_frame_size;
+
+  // Run on the dispatch sequence. |is_needed| tells whether any request still
+  // waits for the decode; if not, it is dropped instead of being sent.
+  base::Callback<bool()> is_needed;
+  image_decoder::mojom::ImageDecoder::DecodeImageCallback callback;
+};
+
+image_decoder::mojom::ImageCodec ToMojoCodec(
+    ImageDecoder::ImageCodec image_codec) {
+#if defined(OS_CHROMEOS)
+  if (image_codec == ImageDecoder::ROBUST_JPEG_CODEC)
+    return image_decoder::mojom::ImageCodec::ROBUST_JPEG;
+  if (image_codec == ImageDecoder::ROBUST_PNG_CODEC)
+    return image_decoder::mojom::ImageCodec::ROBUST_PNG;
+#endif  // defined(OS_CHROMEOS)
+  return image_decoder::mojom::ImageCodec::DEFAULT;
+}
 
-  image_decoder::Decode(connector.get(), image_data, codec, shrink_to_fit,
-                        kMaxImageSizeInBytes, desired_image_frame_size,
-                        base::Bind(&RunDecodeCallbackOnTaskRunner, callback,
-                                   callback_task_runner));
+// A sequence which dispatches decodes, along with its connection to the
+// decoder service.
+struct DispatchSequence {
+  explicit DispatchSequence(
+      scoped_refptr<base::SequencedTaskRunner> task_runner)
+      : task_runner(std::move(task_runner)),
+        connection(new DecoderServiceConnection()) {}
+
+  const scoped_refptr<base::SequencedTaskRunner> task_runner;
+  DecoderServiceConnection* const connection;
+};
+
+scoped_refptr<base::SequencedTaskRunner> CreateDispatchTaskRunner(
+    base::TaskPriority priority) {
+  return base::CreateSequencedTaskRunnerWithTraits(
+      base::TaskTraits().WithPriority(priority).WithShutdownBehavior(
+          base::TaskShutdownBehavior::SKIP_ON_SHUTDOWN));
+}
+
+// Returns the sequence to dispatch decodes of |priority| on.
+const DispatchSequence& GetDispatchSequence(ImageDecoder::Priority priority) {
+  // NOTE: There exist ImageDecoder consumers which implicitly rely on this
+  // operation happening on a thread which always has a ThreadTaskRunnerHandle.
+  // We arbitrarily use the IO thread here to match details of the legacy
+  // implementation.
+  if (!base::FeatureList::IsEnabled(kImageDecoderOnTaskScheduler)) {
+    static const auto* io_sequence =
+        new DispatchSequence(content::BrowserThread::GetTaskRunnerForThread(
+            content::BrowserThread::IO));
+    return *io_sequence;
+  }
+
+  if (priority == ImageDecoder::Priority::BACKGROUND) {
+    static const auto* background_sequence = new DispatchSequence(
+        CreateDispatchTaskRunner(base::TaskPriority::BACKGROUND));
+    return *background_sequence;
+  }
+  static const auto* user_visible_sequence = new DispatchSequence(
+      CreateDispatchTaskRunner(base::TaskPriority::USER_VISIBLE));
+  return *user_visible_sequence;
+}
+
+// Sends all of |decodes| which are still needed to the decoder service back
+// to back.
+void DecodeImages(DecoderServiceConnection* connection,
+                  std::vector<PendingDecode> decodes) {
+  for (PendingDecode& decode : decodes) {
+    if (decode.is_needed.Run()) {
+      connection->Decode(decode.image_data, decode.codec, decode.shrink_to_fit,
+                         decode.max_size_in_bytes,
+                         decode.desired_image_frame_size, decode.callback);
+    }
+
+    // The data was copied into the message, so free it now rather than once
+    // the whole batch is sent, to keep the peak memory of large batches down.
+    std::vector<uint8_t>().swap(decode.image_data);
+  }
+}
+
+// Posts one task which sends all of |decodes| to the decoder service.
+void DispatchDecodes(ImageDecoder::Priority priority,
+                     std::vector<PendingDecode> decodes) {
+  if (decodes.empty())
+    return;
+  const DispatchSequence& sequence = GetDispatchSequence(priority);
+  sequence.task_runner->PostTask(
+      FROM_HERE, base::Bind(&DecodeImages, sequence.connection,
+                            base::Passed(&decodes)));
 }
 
 }  // namespace
 
+const int64_t ImageDecoder::kMaxImageSizeInBytes =
+    static_cast<int64_t>(IPC::Channel::kMaximumMessageSize);
+
+const base::Feature kImageDecoderOnTaskScheduler{
+    "ImageDecoderOnTaskScheduler", base::FEATURE_DISABLED_BY_DEFAULT};
+
+const base::Feature kImageDecoderResultCache{"ImageDecoderResultCache",
+                                             base::FEATURE_DISABLED_BY_DEFAULT};
+
 ImageDecoder::ImageRequest::ImageRequest()
-    : task_runner_(base::ThreadTaskRunnerHandle::Get()) {
+    : task_runner_(base::ThreadTaskRunnerHandle::Get()),
+      priority_(Priority::USER_VISIBLE) {
   DCHECK(sequence_checker_.CalledOnValidSequence());
 }
 
 ImageDecoder::ImageRequest::ImageRequest(
     const scoped_refptr<base::SequencedTaskRunner>& task_runner)
-    : task_runner_(task_runner) {
+    : task_runner_(task_runner), priority_(Priority::USER_VISIBLE) {
   DCHECK(sequence_checker_.CalledOnValidSequence());
 }
 
@@ -93,6 +307,43 @@ ImageDecoder::ImageRequest::~ImageRequest() {
   ImageDecoder::Cancel(this);
 }
 
+ImageDecoder::BatchItem::BatchItem(ImageRequest* image_request,
+                                   std::vector<uint8_t> image_data)
+    : BatchItem(image_request,
+                std::move(image_data),
+                DEFAULT_CODEC,
+                false,
+                gfx::Size()) {}
+
+ImageDecoder::BatchItem::BatchItem(ImageRequest* image_request,
+                                   std::vector<uint8_t> image_data,
+                                   ImageCodec image_codec,
+                                   bool shrink_to_fit,
+                                   const gfx::Size& desired_image_frame_size)
+    : BatchItem(image_request,
+                std::move(image_data),
+                image_codec,
+                shrink_to_fit,
+                desired_image_frame_size,
+                kMaxImageSizeInBytes) {}
+
+ImageDecoder::BatchItem::BatchItem(ImageRequest* image_request,
+                                   std::vector<uint8_t> image_data,
+                                   ImageCodec image_codec,
+                                   bool shrink_to_fit,
+                                   const gfx::Size& desired_image_frame_size,
+                                   int64_t max_size_in_bytes)
+    : image_request(image_request),
+      image_data(std::move(image_data)),
+      image_codec(image_codec),
+      shrink_to_fit(shrink_to_fit),
+      desired_image_frame_size(desired_image_frame_size),
+      max_size_in_bytes(max_size_in_bytes) {}
+
+ImageDecoder::BatchItem::BatchItem(BatchItem&& other) = default;
+
+ImageDecoder::BatchItem::~BatchItem() {}
+
 // static
 ImageDecoder* ImageDecoder::GetInstance() {
   static auto* image_decoder = new ImageDecoder();
@@ -119,9 +370,23 @@ void ImageDecoder::StartWithOptions(ImageRequest* image_request,
                                     ImageCodec image_codec,
                                     bool shrink_to_fit,
                                     const gfx::Size& desired_image_frame_size) {
-  ImageDecoder::GetInstance()->StartWithOptionsImpl(
-      image_request, std::move(image_data), image_codec, shrink_to_fit,
-      desired_image_frame_size);
+  StartWithOptions(image_request, std::move(image_data), image_codec,
+                   shrink_to_fit, desired_image_frame_size,
+                   kMaxImageSizeInBytes);
+}
+
+// static
+void ImageDecoder::StartWithOptions(ImageRequest* image_request,
+                                    std::vector<uint8_t> image_data,
+                                    ImageCodec image_codec,
+                                    bool shrink_to_fit,
+                                    const gfx::Size& desired_image_frame_size,
+                                    int64_t max_size_in_bytes) {
+  std::vector<BatchItem> items;
+  items.emplace_back(image_request, std::move(image_data), image_codec,
+                     shrink_to_fit, desired_image_frame_size,
+                     max_size_in_bytes);
+  ImageDecoder::GetInstance()->StartBatchImpl(std::move(items));
 }
 
 // static
@@ -134,48 +399,169 @@ void ImageDecoder::StartWithOptions(ImageRequest* image_request,
                    image_codec, shrink_to_fit, gfx::Size());
 }
 
-ImageDecoder::ImageDecoder() : image_request_id_counter_(0) {}
+// static
+void ImageDecoder::StartBatch(std::vector<BatchItem> items) {
+  if (items.empty())
+    return;
+  ImageDecoder::GetInstance()->StartBatchImpl(std::move(items));
+}
 
-void ImageDecoder::StartWithOptionsImpl(
-    ImageRequest* image_request,
-    std::vector<uint8_t> image_data,
-    ImageCodec image_codec,
-    bool shrink_to_fit,
-    const gfx::Size& desired_image_frame_size) {
-  DCHECK(image_request);
-  DCHECK(image_request->task_runner());
+ImageDecoder::ImageDecoder()
+    : image_request_id_counter_(0),
+      decoded_images_(DecodedImageCache::NO_AUTO_EVICT),
+      decoded_images_bytes_(0) {}
+
+void ImageDecoder::StartBatchImpl(std::vector<BatchItem> items) {
+  const bool use_cache =
+      base::FeatureList::IsEnabled(kImageDecoderResultCache);
+  std::vector<std::string> keys;
+  if (use_cache) {
+    for (const BatchItem& item : items)
+      keys.push_back(GetDecodeKey(item));
+  }
 
-  int request_id;
+  // All the requests of the batch are registered under a single lock. Items
+  // answered from the cache, or waiting for an identical decode, need no
+  // decode of their own and are left with an id of -1 in |decode_ids|.
+  std::vector<int> decode_ids(items.size(), -1);
   {
     base::AutoLock lock(map_lock_);
-    request_id = image_request_id_counter_++;
-    image_request_id_map_.insert(std::make_pair(request_id, image_request));
+    for (size_t i = 0; i < items.size(); ++i) {
+      ImageRequest* image_request = items[i].image_request;
+      DCHECK(image_request);
+      DCHECK(image_request->task_runner());
+
+      int request_id = image_request_id_counter_++;
+      image_request_id_map_.insert(std::make_pair(request_id, image_request));
+      image_request_ids_[image_request].push_back(request_id);
+      if (!use_cache) {
+        decode_ids[i] = request_id;
+        continue;
+      }
+
+      auto cached = decoded_images_.Get(keys[i]);
+      if (cached != decoded_images_.end()) {
+        PostResult(image_request->task_runner(), request_id, cached->second);
+        continue;
+      }
+
+      std::vector<int>& waiting_ids = in_flight_decodes_[keys[i]];
+      if (waiting_ids.empty())
+        decode_ids[i] = request_id;
+      waiting_ids.push_back(request_id);
+    }
   }
 
-  image_decoder::mojom::ImageCodec codec =
-      image_decoder::mojom::ImageCodec::DEFAULT;
-#if defined(OS_CHROMEOS)
-  if (image_codec == ROBUST_JPEG_CODEC)
-    codec = image_decoder::mojom::ImageCodec::ROBUST_JPEG;
-  if (image_codec == ROBUST_PNG_CODEC)
-    codec = image_decoder::mojom::ImageCodec::ROBUST_PNG;
-#endif  // defined(OS_CHROMEOS)
+  std::vector<PendingDecode> user_visible_decodes;
+  std::vector<PendingDecode> background_decodes;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (decode_ids[i] < 0)
+      continue;
+
+    BatchItem& item = items[i];
+    PendingDecode decode;
+    decode.image_data = std::move(item.image_data);
+    decode.codec = ToMojoCodec(item.image_codec);
+    decode.shrink_to_fit = item.shrink_to_fit;
+    decode.max_size_in_bytes = item.max_size_in_bytes;
+    decode.desired_image_frame_size = item.desired_image_frame_size;
+    if (use_cache) {
+      decode.is_needed = base::Bind(&ImageDecoder::IsSharedDecodeNeeded,
+                                    base::Unretained(this), keys[i]);
+      decode.callback = base::Bind(&ImageDecoder::OnSharedDecodeDone,
+                                   base::Unretained(this), keys[i]);
+    } else {
+      decode.is_needed = base::Bind(&ImageDecoder::IsDecodeNeeded,
+                                    base::Unretained(this), decode_ids[i]);
+      decode.callback = base::Bind(
+          &RunDecodeCallbackOnTaskRunner,
+          base::Bind(&OnDecodeImageDone,
+                     base::Bind(&ImageDecoder::OnDecodeImageFailed,
+                                base::Unretained(this)),
+                     base::Bind(&ImageDecoder::OnDecodeImageSucceeded,
+                                base::Unretained(this)),
+                     decode_ids[i]),
+          make_scoped_refptr(item.image_request->task_runner()));
+    }
+    if (item.image_request->priority() == Priority::BACKGROUND)
+      background_decodes.push_back(std::move(decode));
+    else
+      user_visible_decodes.push_back(std::move(decode));
+  }
 
-  auto callback = base::Bind(
-      &OnDecodeImageDone,
-      base::Bind(&ImageDecoder::OnDecodeImageFailed, base::Unretained(this)),
-      base::Bind(&ImageDecoder::OnDecodeImageSucceeded, base::Unretained(this)),
-      request_id);
+  DispatchDecodes(Priority::USER_VISIBLE, std::move(user_visible_decodes));
+  DispatchDecodes(Priority::BACKGROUND, std::move(background_decodes));
+}
 
-  // NOTE: There exist ImageDecoder consumers which implicitly rely on this
-  // operation happening on a thread which always has a ThreadTaskRunnerHandle.
-  // We arbitrarily use the IO thread here to match details of the legacy
-  // implementation.
-  content::BrowserThread::PostTask(
-      content::BrowserThread::IO, FROM_HERE,
-      base::Bind(&DecodeImage, base::Passed(&image_data), codec, shrink_to_fit,
-                 desired_image_frame_size, callback,
-                 make_scoped_refptr(image_request->task_runner())));
+// static
+std::string ImageDecoder::GetDecodeKey(const BatchItem& item) {
+  // The image data may come from web content, so this uses a cryptographic
+  // hash: a collision would hand one caller the image of another.
+  unsigned char hash[base::kSHA1Length];
+  base::SHA1HashBytes(item.image_data.data(), item.image_data.size(), hash);
+  return base::StringPrintf(
+      "%s %d %d %s %s", base::HexEncode(hash, sizeof(hash)).c_str(),
+      static_cast<int>(item.image_codec), item.shrink_to_fit,
+      item.desired_image_frame_size.ToString().c_str(),
+      base::Int64ToString(item.max_size_in_bytes).c_str());
+}
+
+void ImageDecoder::OnSharedDecodeDone(const std::string& key,
+                                      const SkBitmap& image) {
+  SkBitmap shared_image = image;
+  shared_image.setImmutable();
+
+  base::AutoLock lock(map_lock_);
+  auto in_flight = in_flight_decodes_.find(key);
+  DCHECK(in_flight != in_flight_decodes_.end());
+  std::vector<int> request_ids = std::move(in_flight->second);
+  in_flight_decodes_.erase(in_flight);
+
+  if (!shared_image.isNull() && !shared_image.empty())
+    AddToCacheLocked(key, shared_image);
+
+  for (int request_id : request_ids) {
+    // Requests which were canceled since have no one to tell.
+    auto it = image_request_id_map_.find(request_id);
+    if (it != image_request_id_map_.end())
+      PostResult(it->second->task_runner(), request_id, shared_image);
+  }
+}
+
+void ImageDecoder::AddToCacheLocked(const std::string& key,
+                                    const SkBitmap& image) {
+  map_lock_.AssertAcquired();
+  size_t image_bytes = image.getSize();
+  if (image_bytes > kMaxDecodedImageCacheBytes)
+    return;
+
+  auto existing = decoded_images_.Peek(key);
+  if (existing != decoded_images_.end()) {
+    decoded_images_bytes_ -= existing->second.getSize();
+    decoded_images_.Erase(existing);
+  }
+
+  decoded_images_.Put(key, image);
+  decoded_images_bytes_ += image_bytes;
+  while (decoded_images_bytes_ > kMaxDecodedImageCacheBytes) {
+    auto oldest = decoded_images_.rbegin();
+    decoded_images_bytes_ -= oldest->second.getSize();
+    decoded_images_.Erase(oldest);
+  }
+}
+
+void ImageDecoder::PostResult(base::SequencedTaskRunner* task_runner,
+                              int request_id,
+                              const SkBitmap& image) {
+  if (!image.isNull() && !image.empty()) {
+    task_runner->PostTask(
+        FROM_HERE, base::Bind(&ImageDecoder::OnDecodeImageSucceeded,
+                              base::Unretained(this), image, request_id));
+  } else {
+    task_runner->PostTask(
+        FROM_HERE, base::Bind(&ImageDecoder::OnDecodeImageFailed,
+                              base::Unretained(this), request_id));
+  }
 }
 
 // static
@@ -186,14 +572,43 @@ void ImageDecoder::Cancel(ImageRequest* image_request) {
 
 void ImageDecoder::CancelImpl(ImageRequest* image_request) {
   base::AutoLock lock(map_lock_);
-  for (auto it = image_request_id_map_.begin();
-       it != image_request_id_map_.end();) {
-    if (it->second == image_request) {
-      image_request_id_map_.erase(it++);
-    } else {
-      ++it;
-    }
+  auto ids = image_request_ids_.find(image_request);
+  if (ids == image_request_ids_.end())
+    return;
+  for (int request_id : ids->second)
+    image_request_id_map_.erase(request_id);
+  image_request_ids_.erase(ids);
+}
+
+void ImageDecoder::RemoveRequestLocked(RequestMap::iterator it) {
+  map_lock_.AssertAcquired();
+  auto ids = image_request_ids_.find(it->second);
+  DCHECK(ids != image_request_ids_.end());
+  std::vector<int>& request_ids = ids->second;
+  request_ids.erase(
+      std::find(request_ids.begin(), request_ids.end(), it->first));
+  if (request_ids.empty())
+    image_request_ids_.erase(ids);
+  image_request_id_map_.erase(it);
+}
+
+bool ImageDecoder::IsDecodeNeeded(int request_id) {
+  base::AutoLock lock(map_lock_);
+  return image_request_id_map_.count(request_id) > 0;
+}
+
+bool ImageDecoder::IsSharedDecodeNeeded(const std::string& key) {
+  base::AutoLock lock(map_lock_);
+  auto in_flight = in_flight_decodes_.find(key);
+  DCHECK(in_flight != in_flight_decodes_.end());
+  for (int request_id : in_flight->second) {
+    if (image_request_id_map_.count(request_id))
+      return true;
   }
+
+  // Identical requests started from now on decode the image anew.
+  in_flight_decodes_.erase(in_flight);
+  return false;
 }
 
 void ImageDecoder::OnDecodeImageSucceeded(
@@ -206,7 +621,7 @@ void ImageDecoder::OnDecodeImageSucceeded(
     if (it == image_request_id_map_.end())
       return;
     image_request = it->second;
-    image_request_id_map_.erase(it);
+    RemoveRequestLocked(it);
   }
 
   DCHECK(image_request->task_runner()->RunsTasksOnCurrentThread());
@@ -221,7 +636,7 @@ void ImageDecoder::OnDecodeImageFailed(int request_id) {
     if (it == image_request_id_map_.end())
       return;
     image_request = it->second;
-    image_request_id_map_.erase(it);
+    RemoveRequestLocked(it);
   }
 
   DCHECK(image_request->task_runner()->RunsTasksOnCurrentThread());
@@ -5,21 +5,31 @@
 #ifndef CHROME_BROWSER_IMAGE_DECODER_H_
 #define CHROME_BROWSER_IMAGE_DECODER_H_
 
-#include <map>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "base/containers/mru_cache.h"
+#include "base/feature_list.h"
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
 #include "base/sequence_checker.h"
 #include "base/sequenced_task_runner.h"
 #include "base/synchronization/lock.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/geometry/size.h"
 
-namespace gfx {
-class Size;
-}  // namespace gfx
+// Dispatches decodes to the decoder service from task scheduler sequences of
+// the request's priority, instead of from the IO thread.
+extern const base::Feature kImageDecoderOnTaskScheduler;
 
-class SkBitmap;
+// Keeps the results of recent decodes and answers requests for identical
+// input from them, and lets identical decodes in flight share one decode.
+// Requests then share the pixels of the decoded image, which is immutable.
+extern const base::Feature kImageDecoderResultCache;
 
 // This is a helper class for decoding images safely in a sandboxed service. To
 // use this, call ImageDecoder::Start(...) or
@@ -34,6 +44,15 @@ class SkBitmap;
 // client library usage.
 class ImageDecoder {
  public:
+  // How urgently an ImageRequest's result is needed. This only has an effect
+  // with kImageDecoderOnTaskScheduler.
+  enum class Priority {
+    // The image is about to be shown.
+    USER_VISIBLE,
+    // The image is decoded ahead of use, e.g. to fill a cache.
+    BACKGROUND,
+  };
+
   // ImageRequest objects needs to be created and destroyed on the same
   // SequencedTaskRunner.
   class ImageRequest {
@@ -49,6 +68,10 @@ class ImageDecoder {
       return task_runner_.get();
     }
 
+    // Applies to decodes started after the change. Defaults to USER_VISIBLE.
+    Priority priority() const { return priority_; }
+    void set_priority(Priority priority) { priority_ = priority; }
+
    protected:
     // Creates an ImageRequest that runs on the thread which created it.
     ImageRequest();
@@ -64,6 +87,8 @@ class ImageDecoder {
     // the image has been decoded.
     const scoped_refptr<base::SequencedTaskRunner> task_runner_;
 
+    Priority priority_;
+
     base::SequenceChecker sequence_checker_;
   };
 
@@ -75,6 +100,39 @@ class ImageDecoder {
 #endif  // defined(OS_CHROMEOS)
   };
 
+  // An image to decode with StartBatch(), with the same options as
+  // StartWithOptions().
+  struct BatchItem {
+    BatchItem(ImageRequest* image_request, std::vector<uint8_t> image_data);
+    BatchItem(ImageRequest* image_request,
+              std::vector<uint8_t> image_data,
+              ImageCodec image_codec,
+              bool shrink_to_fit,
+              const gfx::Size& desired_image_frame_size);
+    BatchItem(ImageRequest* image_request,
+              std::vector<uint8_t> image_data,
+              ImageCodec image_codec,
+              bool shrink_to_fit,
+              const gfx::Size& desired_image_frame_size,
+              int64_t max_size_in_bytes);
+    BatchItem(BatchItem&& other);
+    ~BatchItem();
+
+    ImageRequest* image_request;
+    std::vector<uint8_t> image_data;
+    ImageCodec image_codec;
+    bool shrink_to_fit;
+    gfx::Size desired_image_frame_size;
+    int64_t max_size_in_bytes;
+
+   private:
+    DISALLOW_COPY_AND_ASSIGN(BatchItem);
+  };
+
+  // The largest decoded image, in bytes, unless a request passes a limit of
+  // its own. This is the largest IPC message.
+  static const int64_t kMaxImageSizeInBytes;
+
   static ImageDecoder* GetInstance();
 
   // Calls StartWithOptions() with ImageCodec::DEFAULT_CODEC and
@@ -97,30 +155,75 @@ class ImageDecoder {
                                ImageCodec image_codec,
                                bool shrink_to_fit,
                                const gfx::Size& desired_image_frame_size);
+  // Like the above, but the decoded image must fit in |max_size_in_bytes|
+  // instead of kMaxImageSizeInBytes. With |shrink_to_fit|, the decoder
+  // service scales larger images down to fit, keeping their aspect ratio;
+  // otherwise they fail to decode.
+  static void StartWithOptions(ImageRequest* image_request,
+                               std::vector<uint8_t> image_data,
+                               ImageCodec image_codec,
+                               bool shrink_to_fit,
+                               const gfx::Size& desired_image_frame_size,
+                               int64_t max_size_in_bytes);
   // Deprecated. Use std::vector<uint8_t> version to avoid an extra copy.
   static void StartWithOptions(ImageRequest* image_request,
                                const std::string& image_data,
                                ImageCodec image_codec,
                                bool shrink_to_fit);
 
+  // Starts decoding all of |items| at once, which is cheaper than starting
+  // them one by one. Each item reports back to its own ImageRequest as if it
+  // had been started by StartWithOptions(); the same ImageRequest may be used
+  // by several items.
+  static void StartBatch(std::vector<BatchItem> items);
+
   // Removes all instances of |image_request| from |image_request_id_map_|,
   // ensuring callbacks are not made to the image_request after it is destroyed.
+  // Decodes which were not sent to the decoder service yet are dropped.
   static void Cancel(ImageRequest* image_request);
 
  private:
-  using RequestMap = std::map<int, ImageRequest*>;
+  friend class ImageDecoderBrowserTest;
+
+  using RequestMap = std::unordered_map<int, ImageRequest*>;
+  using DecodedImageCache = base::MRUCache<std::string, SkBitmap>;
 
   ImageDecoder();
   ~ImageDecoder() = delete;
 
-  void StartWithOptionsImpl(ImageRequest* image_request,
-                            std::vector<uint8_t> image_data,
-                            ImageCodec image_codec,
-                            bool shrink_to_fit,
-                            const gfx::Size& desired_image_frame_size);
+  void StartBatchImpl(std::vector<BatchItem> items);
+
+  // Returns the cache key for the result of decoding |item|: a hash of its
+  // data along with its decoding options.
+  static std::string GetDecodeKey(const BatchItem& item);
+
+  // Called on the sequence which dispatched the decode of |key|, which was
+  // shared by the requests in |in_flight_decodes_|. Caches |image| and posts
+  // it to each of them.
+  void OnSharedDecodeDone(const std::string& key, const SkBitmap& image);
+
+  // Adds |image| to |decoded_images_|, evicting the least recently used
+  // images to stay within the size limit. |map_lock_| must be held.
+  void AddToCacheLocked(const std::string& key, const SkBitmap& image);
+
+  // Posts the result of the decode for |request_id| to |task_runner|. An empty
+  // |image| signals a failed decode.
+  void PostResult(base::SequencedTaskRunner* task_runner,
+                  int request_id,
+                  const SkBitmap& image);
 
   void CancelImpl(ImageRequest* image_request);
 
+  // Removes the request at |it| from |image_request_id_map_| and
+  // |image_request_ids_|. |map_lock_| must be held.
+  void RemoveRequestLocked(RequestMap::iterator it);
+
+  // Called on the dispatch sequence before sending a decode. Return whether
+  // the request |request_id|, or any of the requests sharing the decode of
+  // |key|, is still waiting for it.
+  bool IsDecodeNeeded(int request_id);
+  bool IsSharedDecodeNeeded(const std::string& key);
+
   // IPC message handlers.
   void OnDecodeImageSucceeded(const SkBitmap& decoded_image, int request_id);
   void OnDecodeImageFailed(int request_id);
@@ -131,7 +234,18 @@ class ImageDecoder {
   // Map of request id's to ImageRequests.
   RequestMap image_request_id_map_;
 
-  // Protects |image_request_id_map_| and |image_request_id_counter_|.
+  // The ids of each ImageRequest in |image_request_id_map_|, so that canceling
+  // does not need to search the whole map.
+  std::unordered_map<const ImageRequest*, std::vector<int>> image_request_ids_;
+
+  // Recently decoded images by GetDecodeKey(), and their total size in bytes.
+  DecodedImageCache decoded_images_;
+  size_t decoded_images_bytes_;
+
+  // Ids of the requests waiting for each shared decode, by GetDecodeKey().
+  std::unordered_map<std::string, std::vector<int>> in_flight_decodes_;
+
+  // Protects all of the above.
   base::Lock map_lock_;
 
   DISALLOW_COPY_AND_ASSIGN(ImageDecoder);
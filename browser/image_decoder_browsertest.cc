@@ -4,7 +4,17 @@
 
 #include "chrome/browser/image_decoder.h"
 
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "base/barrier_closure.h"
+#include "base/bind_helpers.h"
 #include "base/macros.h"
+#include "base/test/scoped_feature_list.h"
+#include "base/time/time.h"
 #include "build/build_config.h"
 #include "chrome/grit/generated_resources.h"
 #include "chrome/test/base/in_process_browser_test.h"
@@ -12,6 +22,7 @@
 #include "content/public/browser/browser_thread.h"
 #include "content/public/browser/child_process_data.h"
 #include "content/public/test/test_utils.h"
+#include "testing/perf/perf_test.h"
 #include "ui/base/l10n/l10n_util.h"
 
 using content::BrowserThread;
@@ -157,6 +168,22 @@ class KillProcessObserver : public content::BrowserChildProcessObserver {
 }  // namespace
 
 class ImageDecoderBrowserTest : public InProcessBrowserTest {
+ protected:
+  // Decodes |image_data| and returns whether that succeeded.
+  bool Decode(const std::vector<uint8_t>& image_data) {
+    scoped_refptr<content::MessageLoopRunner> runner =
+        new content::MessageLoopRunner;
+    TestImageRequest test_request(runner->QuitClosure());
+    ImageDecoder::Start(&test_request, image_data);
+    runner->Run();
+    return test_request.decode_succeeded();
+  }
+
+  size_t GetCachedImageCount() {
+    ImageDecoder* image_decoder = ImageDecoder::GetInstance();
+    base::AutoLock lock(image_decoder->map_lock_);
+    return image_decoder->decoded_images_.size();
+  }
 };
 
 IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, Basic) {
@@ -250,6 +277,28 @@ IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, BasicDecodeString) {
   EXPECT_TRUE(test_request.decode_succeeded());
 }
 
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartBatch) {
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  base::Closure barrier = base::BarrierClosure(3, runner->QuitClosure());
+  TestImageRequest valid_request(barrier);
+  TestImageRequest invalid_request(barrier);
+  TestImageRequest options_request(barrier);
+
+  std::vector<ImageDecoder::BatchItem> items;
+  items.emplace_back(&valid_request, GetValidPngData());
+  items.emplace_back(&invalid_request, std::vector<uint8_t>());
+  items.emplace_back(&options_request, GetValidPngData(),
+                     ImageDecoder::DEFAULT_CODEC, /*shrink_to_fit=*/true,
+                     /*desired_image_frame_size=*/gfx::Size(1, 1));
+  ImageDecoder::StartBatch(std::move(items));
+  runner->Run();
+
+  EXPECT_TRUE(valid_request.decode_succeeded());
+  EXPECT_FALSE(invalid_request.decode_succeeded());
+  EXPECT_TRUE(options_request.decode_succeeded());
+}
+
 IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartAndDestroy) {
   scoped_refptr<content::MessageLoopRunner> runner =
       new content::MessageLoopRunner;
@@ -260,6 +309,24 @@ IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartAndDestroy) {
   runner->Run();
 }
 
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartBatchAndDestroyOne) {
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  TestImageRequest kept_request(runner->QuitClosure());
+  std::unique_ptr<TestImageRequest> destroyed_request(
+      new TestImageRequest(base::Bind(&base::DoNothing)));
+
+  std::vector<ImageDecoder::BatchItem> items;
+  for (int i = 0; i < 10; ++i)
+    items.emplace_back(destroyed_request.get(), GetValidPngData());
+  items.emplace_back(&kept_request, GetValidPngData());
+  ImageDecoder::StartBatch(std::move(items));
+  destroyed_request.reset();
+  runner->Run();
+
+  EXPECT_TRUE(kept_request.decode_succeeded());
+}
+
 // Killing the utility process counts as a crash. Thus the request fails.
 // If ImageDecoder did not handle the crash properly, the request never finishes
 // and this test would hang.
@@ -279,3 +346,117 @@ IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, StartAndKillProcess) {
   }
   // Else the IO thread won the race and the image got decoded. Oh well.
 }
+
+// Decodes after a crash of the utility process reconnect to the service.
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, DecodeAfterKillProcess) {
+  {
+    KillProcessObserver observer;
+    Decode(GetValidPngData());
+  }
+  EXPECT_TRUE(Decode(GetValidPngData()));
+}
+
+// Reports the latency of decodes issued one after another. The first decode
+// includes connecting to the service and launching its utility process; the
+// following ones measure the cost of a decode over an established connection.
+IN_PROC_BROWSER_TEST_F(ImageDecoderBrowserTest, DecodeLatency) {
+  const size_t kDecodes = 200;
+  const std::vector<uint8_t> image_data = GetValidPngData();
+
+  std::vector<double> latencies;
+  for (size_t i = 0; i < kDecodes; ++i) {
+    base::TimeTicks start = base::TimeTicks::Now();
+    ASSERT_TRUE(Decode(image_data));
+    latencies.push_back((base::TimeTicks::Now() - start).InMillisecondsF());
+  }
+
+  perf_test::PrintResult("image_decoder", "", "first_decode", latencies[0],
+                         "ms", true);
+  std::sort(latencies.begin() + 1, latencies.end());
+  perf_test::PrintResult("image_decoder", "", "decode_p50",
+                         latencies[1 + (kDecodes - 1) / 2], "ms", true);
+  perf_test::PrintResult("image_decoder", "", "decode_p99",
+                         latencies[1 + (kDecodes - 1) * 99 / 100], "ms", true);
+}
+
+class ImageDecoderOnTaskSchedulerBrowserTest : public ImageDecoderBrowserTest {
+ public:
+  ImageDecoderOnTaskSchedulerBrowserTest() {
+    scoped_feature_list_.InitAndEnableFeature(kImageDecoderOnTaskScheduler);
+  }
+
+ private:
+  base::test::ScopedFeatureList scoped_feature_list_;
+
+  DISALLOW_COPY_AND_ASSIGN(ImageDecoderOnTaskSchedulerBrowserTest);
+};
+
+IN_PROC_BROWSER_TEST_F(ImageDecoderOnTaskSchedulerBrowserTest, BasicDecode) {
+  EXPECT_TRUE(Decode(GetValidPngData()));
+  EXPECT_FALSE(Decode(std::vector<uint8_t>()));
+}
+
+IN_PROC_BROWSER_TEST_F(ImageDecoderOnTaskSchedulerBrowserTest,
+                       MixedPriorities) {
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  base::Closure barrier = base::BarrierClosure(2, runner->QuitClosure());
+  TestImageRequest user_visible_request(barrier);
+  TestImageRequest background_request(barrier);
+  background_request.set_priority(ImageDecoder::Priority::BACKGROUND);
+
+  std::vector<ImageDecoder::BatchItem> items;
+  items.emplace_back(&background_request, GetValidPngData());
+  items.emplace_back(&user_visible_request, GetValidPngData());
+  ImageDecoder::StartBatch(std::move(items));
+  runner->Run();
+
+  EXPECT_TRUE(user_visible_request.decode_succeeded());
+  EXPECT_TRUE(background_request.decode_succeeded());
+}
+
+class ImageDecoderResultCacheBrowserTest : public ImageDecoderBrowserTest {
+ public:
+  ImageDecoderResultCacheBrowserTest() {
+    scoped_feature_list_.InitAndEnableFeature(kImageDecoderResultCache);
+  }
+
+ private:
+  base::test::ScopedFeatureList scoped_feature_list_;
+
+  DISALLOW_COPY_AND_ASSIGN(ImageDecoderResultCacheBrowserTest);
+};
+
+IN_PROC_BROWSER_TEST_F(ImageDecoderResultCacheBrowserTest, IdenticalDecodes) {
+  scoped_refptr<content::MessageLoopRunner> runner =
+      new content::MessageLoopRunner;
+  base::Closure barrier = base::BarrierClosure(3, runner->QuitClosure());
+  TestImageRequest first_request(barrier);
+  TestImageRequest second_request(barrier);
+  TestImageRequest options_request(barrier);
+
+  // The first two requests share a decode. The third one has other options,
+  // so it is decoded separately.
+  std::vector<ImageDecoder::BatchItem> items;
+  items.emplace_back(&first_request, GetValidPngData());
+  items.emplace_back(&second_request, GetValidPngData());
+  items.emplace_back(&options_request, GetValidPngData(),
+                     ImageDecoder::DEFAULT_CODEC, /*shrink_to_fit=*/true,
+                     gfx::Size());
+  ImageDecoder::StartBatch(std::move(items));
+  runner->Run();
+
+  EXPECT_TRUE(first_request.decode_succeeded());
+  EXPECT_TRUE(second_request.decode_succeeded());
+  EXPECT_TRUE(options_request.decode_succeeded());
+  EXPECT_EQ(2U, GetCachedImageCount());
+
+  // Later requests are answered from the cache.
+  EXPECT_TRUE(Decode(GetValidPngData()));
+  EXPECT_EQ(2U, GetCachedImageCount());
+
+  // Failed decodes are not cached.
+  EXPECT_FALSE(Decode(std::vector<uint8_t>()));
+  EXPECT_FALSE(Decode(std::vector<uint8_t>()));
+  EXPECT_EQ(2U, GetCachedImageCount());
+}
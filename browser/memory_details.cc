@@ -96,6 +96,7 @@ ProcessMemoryInformation::ProcessMemoryInformation()
       process_type(content::PROCESS_TYPE_UNKNOWN),
       num_open_fds(-1),
       open_fds_soft_limit(-1),
+      swapped_kb(0),
       renderer_type(RENDERER_UNKNOWN) {}
 
 ProcessMemoryInformation::ProcessMemoryInformation(
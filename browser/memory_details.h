@@ -65,6 +65,9 @@ struct ProcessMemoryInformation {
   int num_open_fds;
   // Maximum number of file descriptors that can be opened in this process.
   int open_fds_soft_limit;
+  // Memory of this process which is swapped out, in KB. Only sampled on Linux,
+  // where it needs /proc/<pid>/smaps_rollup outside of Chrome OS.
+  size_t swapped_kb;
   // If this is a renderer process, what type it is.
   RendererProcessType renderer_type;
   // A collection of titles used, i.e. for a tab it'll show all the page titles.
@@ -163,6 +166,16 @@ class MemoryDetails : public base::RefCountedThreadSafe<MemoryDetails> {
   void CollectProcessData(
       const std::vector<ProcessMemoryInformation>& child_info);
 
+#if defined(OS_LINUX)
+  // Finishes CollectProcessData() once the memory of the browser's processes
+  // has been sampled. The processes are sampled by several tasks at once, each
+  // filling one of the |samples| lists, and this runs on whichever of them
+  // finishes last.
+  void OnProcessesSampled(
+      const std::vector<ProcessMemoryInformation>& child_info,
+      std::vector<ProcessMemoryInformationList>* samples);
+#endif
+
   // Collect child process information on the UI thread.  Information about
   // renderer processes is only available there.
   void CollectChildInfoOnUIThread();
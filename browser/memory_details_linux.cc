@@ -8,19 +8,30 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <map>
+#include <algorithm>
 #include <memory>
-#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "base/barrier_closure.h"
 #include "base/bind.h"
+#include "base/files/file_enumerator.h"
+#include "base/files/file_path.h"
 #include "base/files/file_util.h"
+#include "base/macros.h"
 #include "base/process/process_iterator.h"
 #include "base/process/process_metrics.h"
 #include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
 #include "base/strings/string_util.h"
 #include "base/strings/utf_string_conversions.h"
+#include "base/sys_info.h"
+#include "base/task_scheduler/post_task.h"
 #include "base/threading/sequenced_worker_pool.h"
 #include "build/build_config.h"
+#include "chrome/browser/memory_details_linux.h"
 #include "chrome/common/chrome_constants.h"
 #include "chrome/grit/chromium_strings.h"
 #include "content/public/browser/browser_thread.h"
@@ -29,80 +40,240 @@
 
 using base::ProcessEntry;
 using content::BrowserThread;
+using memory_details_linux::Process;
 
 namespace {
 
-struct Process {
-  pid_t pid;
-  pid_t parent;
-};
-
-typedef std::map<pid_t, Process> ProcessMap;
+const base::FilePath::CharType kProcDir[] = FILE_PATH_LITERAL("/proc");
 
 // Get information on all the processes running on the system.
-ProcessMap GetProcesses() {
-  ProcessMap map;
+std::vector<Process> GetProcesses() {
+  std::vector<Process> processes;
 
   base::ProcessIterator process_iter(NULL);
   while (const ProcessEntry* process_entry = process_iter.NextProcessEntry()) {
     Process process;
     process.pid = process_entry->pid();
     process.parent = process_entry->parent_pid();
-    map.insert(std::make_pair(process.pid, process));
+    processes.push_back(process);
+  }
+  return processes;
+}
+
+// Returns the path of the children file of the thread named by |task_dir| of
+// process |pid|.
+base::FilePath GetChildrenFilePath(const base::FilePath& proc_dir,
+                                   pid_t pid,
+                                   const base::FilePath& task_dir) {
+  return proc_dir.Append(base::IntToString(pid))
+      .Append("task")
+      .Append(task_dir)
+      .Append("children");
+}
+
+// Appends the pids listed in the children files of all threads of |pid|.
+void ReadChildren(const base::FilePath& proc_dir,
+                  pid_t pid,
+                  std::vector<pid_t>* children) {
+  base::FileEnumerator tasks(
+      proc_dir.Append(base::IntToString(pid)).Append("task"), false,
+      base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath task = tasks.Next(); !task.empty(); task = tasks.Next()) {
+    // The process or thread may have exited since; it then has no children.
+    std::string contents;
+    if (!base::ReadFileToString(
+            GetChildrenFilePath(proc_dir, pid, task.BaseName()), &contents)) {
+      continue;
+    }
+    for (const base::StringPiece& token : base::SplitStringPiece(
+             contents, " \n", base::TRIM_WHITESPACE,
+             base::SPLIT_WANT_NONEMPTY)) {
+      int child;
+      if (base::StringToInt(token, &child))
+        children->push_back(child);
+    }
   }
-  return map;
 }
 
-// For each of a list of pids, collect memory information about that process.
-ProcessData GetProcessDataMemoryInformation(
-    const std::vector<pid_t>& pids) {
-  ProcessData process_data;
-  for (pid_t pid : pids) {
-    ProcessMemoryInformation pmi;
+// Processes are sampled by several tasks at once, but each task gets at least
+// this many so that a small browser is not spread over more tasks than it is
+// worth.
+const size_t kMinProcessesPerTask = 8;
+
+base::FilePath GetSmapsRollupFilePath(pid_t pid) {
+  return base::FilePath(kProcDir)
+      .Append(base::IntToString(pid))
+      .Append("smaps_rollup");
+}
 
-    pmi.pid = pid;
-    pmi.num_processes = 1;
+// Collects memory information about process |pid|.
+ProcessMemoryInformation GetProcessMemoryInformation(pid_t pid,
+                                                     bool use_smaps_rollup) {
+  ProcessMemoryInformation pmi;
 
-    if (pmi.pid == base::GetCurrentProcId())
-      pmi.process_type = content::PROCESS_TYPE_BROWSER;
-    else
-      pmi.process_type = content::PROCESS_TYPE_UNKNOWN;
+  pmi.pid = pid;
+  pmi.num_processes = 1;
 
-    std::unique_ptr<base::ProcessMetrics> metrics(
-        base::ProcessMetrics::CreateProcessMetrics(pid));
-    metrics->GetWorkingSetKBytes(&pmi.working_set);
-    pmi.num_open_fds = metrics->GetOpenFdCount();
-    pmi.open_fds_soft_limit = metrics->GetOpenFdSoftLimit();
+  if (pmi.pid == base::GetCurrentProcId())
+    pmi.process_type = content::PROCESS_TYPE_BROWSER;
+  else
+    pmi.process_type = content::PROCESS_TYPE_UNKNOWN;
 
-    process_data.processes.push_back(pmi);
-  }
-  return process_data;
+  memory_details_linux::SampleProcessMemory(pid, use_smaps_rollup, &pmi);
+  return pmi;
+}
+
+// Returns share |index| of |pids| split into |count| contiguous shares.
+std::vector<pid_t> GetShare(const std::vector<pid_t>& pids,
+                            size_t index,
+                            size_t count) {
+  return std::vector<pid_t>(pids.begin() + pids.size() * index / count,
+                            pids.begin() + pids.size() * (index + 1) / count);
+}
+
+// Collects memory information about each of |pids| into |processes|, then
+// runs |done|.
+void SampleProcesses(const std::vector<pid_t>& pids,
+                     bool use_smaps_rollup,
+                     ProcessMemoryInformationList* processes,
+                     const base::Closure& done) {
+  for (pid_t pid : pids)
+    processes->push_back(GetProcessMemoryInformation(pid, use_smaps_rollup));
+  done.Run();
 }
 
-// Find all children of the given process with pid |root|.
-std::vector<pid_t> GetAllChildren(const ProcessMap& processes, pid_t root) {
+}  // namespace
+
+namespace memory_details_linux {
+
+std::vector<pid_t> GetAllChildren(const std::vector<Process>& processes,
+                                  pid_t root) {
+  std::unordered_map<pid_t, std::vector<pid_t>> children_of;
+  for (const Process& process : processes)
+    children_of[process.parent].push_back(process.pid);
+
+  // Walk the tree breadth first. |visited| guards against cycles, which a
+  // racy snapshot of the process table may contain.
   std::vector<pid_t> children;
+  std::unordered_set<pid_t> visited;
   children.push_back(root);
+  visited.insert(root);
+  for (size_t i = 0; i < children.size(); ++i) {
+    auto it = children_of.find(children[i]);
+    if (it == children_of.end())
+      continue;
+    for (pid_t child : it->second) {
+      if (visited.insert(child).second)
+        children.push_back(child);
+    }
+  }
+  return children;
+}
 
-  std::set<pid_t> wavefront, next_wavefront;
-  wavefront.insert(root);
+bool GetAllChildrenFromProc(const base::FilePath& proc_dir,
+                            pid_t root,
+                            std::vector<pid_t>* pids) {
+  // The children files need a kernel built with CONFIG_PROC_CHILDREN.
+  if (!base::PathExists(GetChildrenFilePath(
+          proc_dir, root, base::FilePath(base::IntToString(root))))) {
+    return false;
+  }
 
-  while (wavefront.size()) {
-    for (const auto& entry : processes) {
-      const Process& process = entry.second;
-      if (wavefront.count(process.parent)) {
-        children.push_back(process.pid);
-        next_wavefront.insert(process.pid);
-      }
+  std::unordered_set<pid_t> visited;
+  pids->clear();
+  pids->push_back(root);
+  visited.insert(root);
+  std::vector<pid_t> children;
+  for (size_t i = 0; i < pids->size(); ++i) {
+    children.clear();
+    ReadChildren(proc_dir, (*pids)[i], &children);
+    for (pid_t child : children) {
+      if (visited.insert(child).second)
+        pids->push_back(child);
     }
+  }
+  return true;
+}
+
+bool ParseSmapsRollup(const std::string& contents,
+                      base::WorkingSetKBytes* working_set,
+                      size_t* swapped_kb) {
+  size_t rss = 0, pss = 0, private_clean = 0, private_dirty = 0,
+         shared_clean = 0, shared_dirty = 0, swap = 0;
+  struct Field {
+    const char* name;
+    size_t* value;
+  } fields[] = {
+      {"Rss:", &rss},
+      {"Pss:", &pss},
+      {"Private_Clean:", &private_clean},
+      {"Private_Dirty:", &private_dirty},
+      {"Shared_Clean:", &shared_clean},
+      {"Shared_Dirty:", &shared_dirty},
+      {"Swap:", &swap},
+  };
+  size_t found = 0;
 
-    wavefront.clear();
-    wavefront.swap(next_wavefront);
+  // Each line after the header looks like "Rss:    884 kB".
+  for (const base::StringPiece& line : base::SplitStringPiece(
+           contents, "\n", base::KEEP_WHITESPACE,
+           base::SPLIT_WANT_NONEMPTY)) {
+    std::vector<base::StringPiece> tokens = base::SplitStringPiece(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    if (tokens.size() != 3 || tokens[2] != "kB")
+      continue;
+    for (Field& field : fields) {
+      if (tokens[0] != field.name)
+        continue;
+      if (base::StringToSizeT(tokens[1], field.value))
+        found++;
+      break;
+    }
   }
-  return children;
+  if (found != arraysize(fields))
+    return false;
+
+  // Mirror how base::ProcessMetrics reports /proc/<pid>/totmaps on Chrome OS:
+  // |shared| is the process' proportional share of its shared pages.
+  working_set->priv = private_clean + private_dirty;
+  working_set->shareable = shared_clean + shared_dirty;
+  working_set->shared = pss > working_set->priv ? pss - working_set->priv : 0;
+#if defined(OS_CHROMEOS)
+  working_set->swapped = swap;
+#endif
+  *swapped_kb = swap;
+  return true;
 }
 
-}  // namespace
+bool HasSmapsRollup() {
+  return base::PathExists(GetSmapsRollupFilePath(getpid()));
+}
+
+bool SampleProcessMemory(pid_t pid,
+                         bool use_smaps_rollup,
+                         ProcessMemoryInformation* pmi) {
+  std::unique_ptr<base::ProcessMetrics> metrics(
+      base::ProcessMetrics::CreateProcessMetrics(pid));
+
+  bool sampled = false;
+  std::string smaps_rollup;
+  if (use_smaps_rollup &&
+      base::ReadFileToString(GetSmapsRollupFilePath(pid), &smaps_rollup)) {
+    sampled = ParseSmapsRollup(smaps_rollup, &pmi->working_set,
+                               &pmi->swapped_kb);
+  }
+  if (!sampled) {
+    sampled = metrics->GetWorkingSetKBytes(&pmi->working_set);
+#if defined(OS_CHROMEOS)
+    pmi->swapped_kb = pmi->working_set.swapped;
+#endif
+  }
+  pmi->num_open_fds = metrics->GetOpenFdCount();
+  pmi->open_fds_soft_limit = metrics->GetOpenFdSoftLimit();
+  return sampled;
+}
+
+}  // namespace memory_details_linux
 
 MemoryDetails::MemoryDetails() {
 }
@@ -115,26 +286,71 @@ void MemoryDetails::CollectProcessData(
     const std::vector<ProcessMemoryInformation>& child_info) {
   DCHECK(BrowserThread::GetBlockingPool()->RunsTasksOnCurrentThread());
 
-  ProcessMap process_map = GetProcesses();
-  std::set<pid_t> browsers_found;
+  // Only walking the browser's own processes through /proc is much cheaper
+  // than listing every process on the system, which can run into the tens of
+  // thousands on shared machines.
+  std::vector<pid_t> pids;
+  if (!memory_details_linux::GetAllChildrenFromProc(base::FilePath(kProcDir),
+                                                    getpid(), &pids)) {
+    pids = memory_details_linux::GetAllChildren(GetProcesses(), getpid());
+  }
 
-  ProcessData current_browser =
-      GetProcessDataMemoryInformation(GetAllChildren(process_map, getpid()));
+  // Sampling a process means parsing several of its /proc files, which adds
+  // up with a hundred renderers, so the processes are split between tasks.
+  // The first share is sampled right here.
+  size_t num_tasks = std::min(
+      static_cast<size_t>(base::SysInfo::NumberOfProcessors()),
+      (pids.size() + kMinProcessesPerTask - 1) / kMinProcessesPerTask);
+  num_tasks = std::max(num_tasks, static_cast<size_t>(1));
+  bool use_smaps_rollup = memory_details_linux::HasSmapsRollup();
+
+  // Owned by |done|, which outlives all the tasks.
+  std::vector<ProcessMemoryInformationList>* samples =
+      new std::vector<ProcessMemoryInformationList>(num_tasks);
+  base::Closure done = base::BarrierClosure(
+      num_tasks, base::Bind(&MemoryDetails::OnProcessesSampled, this,
+                            child_info, base::Owned(samples)));
+  for (size_t i = 1; i < num_tasks; ++i) {
+    base::PostTaskWithTraits(
+        FROM_HERE,
+        base::TaskTraits()
+            .MayBlock()
+            .WithPriority(base::TaskPriority::USER_VISIBLE)
+            .WithShutdownBehavior(
+                base::TaskShutdownBehavior::CONTINUE_ON_SHUTDOWN),
+        base::Bind(&SampleProcesses, GetShare(pids, i, num_tasks),
+                   use_smaps_rollup, &(*samples)[i], done));
+  }
+  SampleProcesses(GetShare(pids, 0, num_tasks), use_smaps_rollup,
+                  &(*samples)[0], done);
+}
+
+void MemoryDetails::OnProcessesSampled(
+    const std::vector<ProcessMemoryInformation>& child_info,
+    std::vector<ProcessMemoryInformationList>* samples) {
+  // The lists are in the order of the pids, with the browser first.
+  ProcessData current_browser;
+  for (ProcessMemoryInformationList& processes : *samples) {
+    current_browser.processes.insert(current_browser.processes.end(),
+                                     processes.begin(), processes.end());
+  }
   current_browser.name = l10n_util::GetStringUTF16(IDS_SHORT_PRODUCT_NAME);
   current_browser.process_name = base::ASCIIToUTF16("chrome");
 
-  for (std::vector<ProcessMemoryInformation>::iterator
-       i = current_browser.processes.begin();
-       i != current_browser.processes.end(); ++i) {
+  // Index the child processes whose data we collected on the IO thread.
+  std::unordered_map<base::ProcessId, const ProcessMemoryInformation*>
+      child_info_by_pid;
+  for (const ProcessMemoryInformation& child : child_info)
+    child_info_by_pid.insert(std::make_pair(child.pid, &child));
+
+  for (ProcessMemoryInformation& process : current_browser.processes) {
     // Check if this is one of the child processes whose data we collected
     // on the IO thread, and if so copy over that data.
-    for (size_t child = 0; child < child_info.size(); child++) {
-      if (child_info[child].pid != i->pid)
-        continue;
-      i->titles = child_info[child].titles;
-      i->process_type = child_info[child].process_type;
-      break;
-    }
+    auto child = child_info_by_pid.find(process.pid);
+    if (child == child_info_by_pid.end())
+      continue;
+    process.titles = child->second->titles;
+    process.process_type = child->second->process_type;
   }
 
   process_data_.push_back(current_browser);
@@ -0,0 +1,64 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_MEMORY_DETAILS_LINUX_H_
+#define CHROME_BROWSER_MEMORY_DETAILS_LINUX_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "chrome/browser/memory_details.h"
+
+namespace base {
+class FilePath;
+}  // namespace base
+
+// Helpers of MemoryDetails on Linux to find the processes of the browser and
+// sample their memory. Exposed for testing.
+namespace memory_details_linux {
+
+struct Process {
+  pid_t pid;
+  pid_t parent;
+};
+
+// Returns |root| followed by all of its descendants among |processes|. An
+// index of the children of each process is built in a single pass, so this is
+// linear in the number of processes.
+std::vector<pid_t> GetAllChildren(const std::vector<Process>& processes,
+                                  pid_t root);
+
+// Finds |root| and its descendants through the children files of their
+// threads, /proc/<pid>/task/<tid>/children, under |proc_dir|. Only the
+// browser's own processes are visited, however many other processes are
+// running. Returns false if the kernel does not provide these files.
+bool GetAllChildrenFromProc(const base::FilePath& proc_dir,
+                            pid_t root,
+                            std::vector<pid_t>* pids);
+
+// Parses |contents| of /proc/<pid>/smaps_rollup into |working_set| and
+// |swapped_kb|. The file sums up smaps over all mappings of a process, so it
+// is much cheaper to read than smaps itself, but needs Linux 4.14 or later.
+// Returns false if a field is missing.
+bool ParseSmapsRollup(const std::string& contents,
+                      base::WorkingSetKBytes* working_set,
+                      size_t* swapped_kb);
+
+// Returns true if the kernel provides /proc/<pid>/smaps_rollup.
+bool HasSmapsRollup();
+
+// Samples the working set, swap and open file descriptors of process |pid|
+// into |pmi|, from smaps_rollup if |use_smaps_rollup|. Without smaps_rollup,
+// swap is only known on Chrome OS. Returns false if the working set could not
+// be read, most likely because the process is gone.
+bool SampleProcessMemory(pid_t pid,
+                         bool use_smaps_rollup,
+                         ProcessMemoryInformation* pmi);
+
+}  // namespace memory_details_linux
+
+#endif  // CHROME_BROWSER_MEMORY_DETAILS_LINUX_H_
@@ -0,0 +1,120 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/strings/string_number_conversions.h"
+#include "base/time/time.h"
+#include "chrome/browser/memory_details_linux.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+
+using memory_details_linux::Process;
+
+namespace {
+
+// The number of times each process table is searched.
+const int kIterations = 20;
+
+// Sizes of the process table to measure. Shared build machines can run tens
+// of thousands of processes.
+const size_t kProcessCounts[] = {1000, 10000, 50000};
+
+const pid_t kBrowserPid = 1000000;
+
+// Builds a process table of |count| processes. Most of them are unrelated to
+// the browser and hang off a few dozen daemons. The browser has a zygote with
+// renderers under it, and a few other children, like a typical session.
+std::vector<Process> CreateProcessTable(size_t count) {
+  std::vector<Process> processes;
+  pid_t next_pid = 2;
+  while (processes.size() + 1 < count) {
+    Process process;
+    process.pid = next_pid++;
+    process.parent = 1 + process.pid % 50;
+    processes.push_back(process);
+  }
+
+  processes.push_back({kBrowserPid, 1});
+  processes.push_back({kBrowserPid + 1, kBrowserPid});  // Zygote.
+  for (pid_t i = 0; i < 40; ++i)
+    processes.push_back({kBrowserPid + 10 + i, kBrowserPid + 1});
+  for (pid_t i = 0; i < 5; ++i)
+    processes.push_back({kBrowserPid + 100 + i, kBrowserPid});
+  return processes;
+}
+
+// The search used by MemoryDetails before GetAllChildren(), which rescanned
+// the whole table once per level of the process tree.
+std::vector<pid_t> GetAllChildrenByWavefront(
+    const std::map<pid_t, Process>& processes,
+    pid_t root) {
+  std::vector<pid_t> children;
+  children.push_back(root);
+
+  std::set<pid_t> wavefront, next_wavefront;
+  wavefront.insert(root);
+
+  while (wavefront.size()) {
+    for (const auto& entry : processes) {
+      const Process& process = entry.second;
+      if (wavefront.count(process.parent)) {
+        children.push_back(process.pid);
+        next_wavefront.insert(process.pid);
+      }
+    }
+
+    wavefront.clear();
+    wavefront.swap(next_wavefront);
+  }
+  return children;
+}
+
+double RunWavefrontWorkload(const std::vector<Process>& processes) {
+  size_t found = 0;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; ++i) {
+    // Building the map was part of the old cost too.
+    std::map<pid_t, Process> process_map;
+    for (const Process& process : processes)
+      process_map.insert(std::make_pair(process.pid, process));
+    found += GetAllChildrenByWavefront(process_map, kBrowserPid).size();
+  }
+  double elapsed = (base::TimeTicks::Now() - start).InMicrosecondsF();
+
+  // Keep the compiler from discarding the work.
+  EXPECT_EQ(47U * kIterations, found);
+  return elapsed / kIterations;
+}
+
+double RunIndexWorkload(const std::vector<Process>& processes) {
+  size_t found = 0;
+  base::TimeTicks start = base::TimeTicks::Now();
+  for (int i = 0; i < kIterations; ++i) {
+    found +=
+        memory_details_linux::GetAllChildren(processes, kBrowserPid).size();
+  }
+  double elapsed = (base::TimeTicks::Now() - start).InMicrosecondsF();
+
+  EXPECT_EQ(47U * kIterations, found);
+  return elapsed / kIterations;
+}
+
+}  // namespace
+
+TEST(MemoryDetailsLinuxPerfTest, GetAllChildren) {
+  for (size_t process_count : kProcessCounts) {
+    std::vector<Process> processes = CreateProcessTable(process_count);
+    std::string trace = base::SizeTToString(process_count) + "_processes";
+    perf_test::PrintResult("memory_details_children_wavefront", "", trace,
+                           RunWavefrontWorkload(processes), "us", true);
+    perf_test::PrintResult("memory_details_children_index", "", trace,
+                           RunIndexWorkload(processes), "us", true);
+  }
+}
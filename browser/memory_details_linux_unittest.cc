@@ -0,0 +1,148 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/memory_details_linux.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "base/files/file_path.h"
+#include "base/files/file_util.h"
+#include "base/files/scoped_temp_dir.h"
+#include "base/process/process_metrics.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_util.h"
+#include "build/build_config.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+using memory_details_linux::GetAllChildren;
+using memory_details_linux::GetAllChildrenFromProc;
+using memory_details_linux::ParseSmapsRollup;
+using memory_details_linux::Process;
+
+namespace {
+
+const char kSmapsRollup[] =
+    "00400000-ffffffffff601000 ---p 00000000 00:00 0      [rollup]\n"
+    "Rss:              1884 kB\n"
+    "Pss:              1385 kB\n"
+    "Shared_Clean:      504 kB\n"
+    "Shared_Dirty:      200 kB\n"
+    "Private_Clean:     100 kB\n"
+    "Private_Dirty:    1080 kB\n"
+    "Referenced:       1884 kB\n"
+    "Anonymous:        1080 kB\n"
+    "LazyFree:            0 kB\n"
+    "AnonHugePages:       0 kB\n"
+    "Swap:               64 kB\n"
+    "SwapPss:            64 kB\n"
+    "Locked:              0 kB\n";
+
+Process MakeProcess(pid_t pid, pid_t parent) {
+  Process process;
+  process.pid = pid;
+  process.parent = parent;
+  return process;
+}
+
+// Writes the children file of thread |tid| of process |pid| under |proc_dir|.
+void WriteChildren(const base::FilePath& proc_dir,
+                   pid_t pid,
+                   pid_t tid,
+                   const std::string& children) {
+  base::FilePath task_dir = proc_dir.Append(base::IntToString(pid))
+                                .Append("task")
+                                .Append(base::IntToString(tid));
+  ASSERT_TRUE(base::CreateDirectory(task_dir));
+  ASSERT_EQ(static_cast<int>(children.size()),
+            base::WriteFile(task_dir.Append("children"), children.data(),
+                            children.size()));
+}
+
+std::vector<pid_t> Sorted(std::vector<pid_t> pids) {
+  std::sort(pids.begin(), pids.end());
+  return pids;
+}
+
+}  // namespace
+
+TEST(MemoryDetailsLinuxTest, GetAllChildren) {
+  std::vector<Process> processes = {
+      MakeProcess(1, 0),  MakeProcess(10, 1),  MakeProcess(11, 10),
+      MakeProcess(12, 10), MakeProcess(13, 12), MakeProcess(20, 1),
+      MakeProcess(21, 20),
+  };
+
+  std::vector<pid_t> children = GetAllChildren(processes, 10);
+  ASSERT_FALSE(children.empty());
+  EXPECT_EQ(10, children[0]);
+  EXPECT_EQ(std::vector<pid_t>({10, 11, 12, 13}), Sorted(children));
+
+  EXPECT_EQ(std::vector<pid_t>({13}), GetAllChildren(processes, 13));
+}
+
+TEST(MemoryDetailsLinuxTest, GetAllChildrenIgnoresCycles) {
+  // A snapshot taken while pids are reused may contain loops.
+  std::vector<Process> processes = {
+      MakeProcess(10, 12), MakeProcess(11, 10), MakeProcess(12, 11),
+  };
+  EXPECT_EQ(std::vector<pid_t>({10, 11, 12}),
+            Sorted(GetAllChildren(processes, 10)));
+}
+
+TEST(MemoryDetailsLinuxTest, GetAllChildrenFromProc) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const base::FilePath& proc_dir = temp_dir.GetPath();
+
+  // Process 10 has two threads, each with children of its own.
+  WriteChildren(proc_dir, 10, 10, "11 12 ");
+  WriteChildren(proc_dir, 10, 15, "16\n");
+  WriteChildren(proc_dir, 11, 11, "");
+  WriteChildren(proc_dir, 12, 12, "13 ");
+  WriteChildren(proc_dir, 13, 13, "");
+  // Process 16 exited after being listed, so it has no directory.
+
+  std::vector<pid_t> pids;
+  ASSERT_TRUE(GetAllChildrenFromProc(proc_dir, 10, &pids));
+  ASSERT_FALSE(pids.empty());
+  EXPECT_EQ(10, pids[0]);
+  EXPECT_EQ(std::vector<pid_t>({10, 11, 12, 13, 16}), Sorted(pids));
+}
+
+TEST(MemoryDetailsLinuxTest, GetAllChildrenFromProcUnsupported) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  ASSERT_TRUE(base::CreateDirectory(
+      temp_dir.GetPath().Append("10").Append("task").Append("10")));
+
+  std::vector<pid_t> pids;
+  EXPECT_FALSE(GetAllChildrenFromProc(temp_dir.GetPath(), 10, &pids));
+}
+
+TEST(MemoryDetailsLinuxTest, ParseSmapsRollup) {
+  base::WorkingSetKBytes working_set;
+  size_t swapped_kb = 0;
+  ASSERT_TRUE(ParseSmapsRollup(kSmapsRollup, &working_set, &swapped_kb));
+  EXPECT_EQ(1180U, working_set.priv);
+  EXPECT_EQ(704U, working_set.shareable);
+  EXPECT_EQ(205U, working_set.shared);
+  EXPECT_EQ(64U, swapped_kb);
+#if defined(OS_CHROMEOS)
+  EXPECT_EQ(64U, working_set.swapped);
+#endif
+}
+
+TEST(MemoryDetailsLinuxTest, ParseSmapsRollupMissingFields) {
+  base::WorkingSetKBytes working_set;
+  size_t swapped_kb = 0;
+  EXPECT_FALSE(ParseSmapsRollup(std::string(), &working_set, &swapped_kb));
+  EXPECT_FALSE(ParseSmapsRollup("Rss: 1884 kB\nPss: 1385 kB\n", &working_set,
+                                &swapped_kb));
+
+  std::string contents = kSmapsRollup;
+  base::ReplaceFirstSubstringAfterOffset(&contents, 0, "1385", "junk");
+  EXPECT_FALSE(ParseSmapsRollup(contents, &working_set, &swapped_kb));
+}
@@ -0,0 +1,321 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/memory_telemetry_sampler.h"
+
+#include <set>
+#include <utility>
+
+#include "base/bind.h"
+#include "base/logging.h"
+#include "base/sequenced_task_runner.h"
+#include "base/task_runner_util.h"
+#include "base/task_scheduler/post_task.h"
+#include "chrome/browser/memory_details_linux.h"
+#include "content/public/browser/browser_thread.h"
+#include "content/public/browser/notification_service.h"
+#include "content/public/browser/notification_types.h"
+
+using content::BrowserThread;
+
+namespace {
+
+MemoryTelemetrySample MakeSample(base::TimeTicks time,
+                                 const ProcessMemoryInformation& info) {
+  MemoryTelemetrySample sample;
+  sample.time = time;
+  sample.private_kb = info.working_set.priv;
+  sample.shared_kb = info.working_set.shared;
+  sample.swapped_kb = info.swapped_kb;
+  sample.num_open_fds = info.num_open_fds;
+  return sample;
+}
+
+// Samples the memory of each of |pids|, leaving out those which are gone.
+ProcessMemoryInformationList SampleProcesses(
+    const std::vector<base::ProcessId>& pids) {
+  bool use_smaps_rollup = memory_details_linux::HasSmapsRollup();
+  ProcessMemoryInformationList samples;
+  for (base::ProcessId pid : pids) {
+    ProcessMemoryInformation pmi;
+    pmi.pid = pid;
+    if (memory_details_linux::SampleProcessMemory(pid, use_smaps_rollup, &pmi))
+      samples.push_back(pmi);
+  }
+  return samples;
+}
+
+}  // namespace
+
+MemoryTelemetrySample::MemoryTelemetrySample()
+    : private_kb(0), shared_kb(0), swapped_kb(0), num_open_fds(-1) {}
+
+MemoryTelemetrySeries::MemoryTelemetrySeries(size_t capacity)
+    : capacity_(capacity), head_(0) {
+  DCHECK_GT(capacity_, 0U);
+}
+
+MemoryTelemetrySeries::MemoryTelemetrySeries(
+    const MemoryTelemetrySeries& other) = default;
+
+MemoryTelemetrySeries::~MemoryTelemetrySeries() {}
+
+const MemoryTelemetrySample& MemoryTelemetrySeries::operator[](
+    size_t index) const {
+  DCHECK_LT(index, buffer_.size());
+  return buffer_[(head_ + index) % buffer_.size()];
+}
+
+void MemoryTelemetrySeries::push_back(const MemoryTelemetrySample& sample) {
+  if (buffer_.size() < capacity_) {
+    buffer_.push_back(sample);
+    return;
+  }
+  buffer_[head_] = sample;
+  head_ = (head_ + 1) % capacity_;
+}
+
+// Resolves the processes of the browser through MemoryDetails, and hands them
+// to |callback|.
+class MemoryTelemetrySampler::Fetcher : public MemoryDetails {
+ public:
+  explicit Fetcher(const SamplesCallback& callback) : callback_(callback) {}
+
+  // MemoryDetails:
+  void OnDetailsAvailable() override {
+    callback_.Run(ChromeBrowser()->processes);
+  }
+
+ private:
+  ~Fetcher() override {}
+
+  SamplesCallback callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(Fetcher);
+};
+
+MemoryTelemetrySampler::Process::Process(size_t capacity)
+    : process_type(content::PROCESS_TYPE_UNKNOWN),
+      renderer_type(ProcessMemoryInformation::RENDERER_UNKNOWN),
+      samples(capacity) {}
+
+MemoryTelemetrySampler::Process::Process(const Process& other) = default;
+
+MemoryTelemetrySampler::Process::~Process() {}
+
+MemoryTelemetrySampler::Delta::Delta()
+    : pid(base::kNullProcessId),
+      is_new(false),
+      private_kb(0),
+      shared_kb(0),
+      swapped_kb(0),
+      num_open_fds(0) {}
+
+MemoryTelemetrySampler::MemoryTelemetrySampler(base::TimeDelta interval,
+                                               size_t samples_per_process)
+    : interval_(interval),
+      samples_per_process_(samples_per_process),
+      needs_resolve_(true),
+      sampling_(false),
+      task_runner_(base::CreateSequencedTaskRunnerWithTraits(
+          base::TaskTraits()
+              .MayBlock()
+              .WithPriority(base::TaskPriority::BACKGROUND)
+              .WithShutdownBehavior(
+                  base::TaskShutdownBehavior::SKIP_ON_SHUTDOWN))),
+      weak_ptr_factory_(this) {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+  BrowserChildProcessObserver::Add(this);
+  registrar_.Add(this, content::NOTIFICATION_RENDERER_PROCESS_CREATED,
+                 content::NotificationService::AllSources());
+  registrar_.Add(this, content::NOTIFICATION_RENDERER_PROCESS_TERMINATED,
+                 content::NotificationService::AllSources());
+}
+
+MemoryTelemetrySampler::~MemoryTelemetrySampler() {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+  BrowserChildProcessObserver::Remove(this);
+}
+
+void MemoryTelemetrySampler::Start() {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+  timer_.Start(FROM_HERE, interval_,
+               base::Bind(&MemoryTelemetrySampler::Sample,
+                          base::Unretained(this)));
+}
+
+void MemoryTelemetrySampler::Stop() {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+  timer_.Stop();
+
+  // Drop the results of a round under way. If it was resolving the processes,
+  // those launched before it would go unresolved, so the next round resolves
+  // them again.
+  weak_ptr_factory_.InvalidateWeakPtrs();
+  sampling_ = false;
+  needs_resolve_ = true;
+}
+
+void MemoryTelemetrySampler::SetInterval(base::TimeDelta interval) {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+  interval_ = interval;
+  if (IsRunning())
+    Start();
+}
+
+void MemoryTelemetrySampler::AddObserver(Observer* observer) {
+  observers_.AddObserver(observer);
+}
+
+void MemoryTelemetrySampler::RemoveObserver(Observer* observer) {
+  observers_.RemoveObserver(observer);
+}
+
+void MemoryTelemetrySampler::RecordSamplesForTesting(
+    base::TimeTicks time,
+    const ProcessMemoryInformationList& samples,
+    bool resolved) {
+  RecordSamples(time, samples, resolved);
+}
+
+void MemoryTelemetrySampler::SampleForTesting() {
+  Sample();
+}
+
+void MemoryTelemetrySampler::ResolveProcesses(
+    const SamplesCallback& callback) {
+  scoped_refptr<Fetcher> fetcher = new Fetcher(callback);
+  fetcher->StartFetch();
+}
+
+void MemoryTelemetrySampler::SampleKnownProcesses(
+    const std::vector<base::ProcessId>& pids,
+    const SamplesCallback& callback) {
+  base::PostTaskAndReplyWithResult(task_runner_.get(), FROM_HERE,
+                                   base::Bind(&SampleProcesses, pids),
+                                   callback);
+}
+
+void MemoryTelemetrySampler::Sample() {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+
+  // Skip this round if the previous one is still running.
+  if (sampling_)
+    return;
+  sampling_ = true;
+
+  if (needs_resolve_ || processes_.empty()) {
+    // Processes launched while this fetch is under way will be resolved by
+    // the next one.
+    needs_resolve_ = false;
+    ResolveProcesses(base::Bind(&MemoryTelemetrySampler::OnDetailsAvailable,
+                                weak_ptr_factory_.GetWeakPtr()));
+    return;
+  }
+
+  std::vector<base::ProcessId> pids;
+  for (const auto& process : processes_)
+    pids.push_back(process.first);
+  SampleKnownProcesses(
+      pids, base::Bind(&MemoryTelemetrySampler::OnProcessesSampled,
+                       weak_ptr_factory_.GetWeakPtr()));
+}
+
+void MemoryTelemetrySampler::OnDetailsAvailable(
+    const ProcessMemoryInformationList& samples) {
+  sampling_ = false;
+  RecordSamples(base::TimeTicks::Now(), samples, true /* resolved */);
+}
+
+void MemoryTelemetrySampler::OnProcessesSampled(
+    const ProcessMemoryInformationList& samples) {
+  sampling_ = false;
+  RecordSamples(base::TimeTicks::Now(), samples, false /* resolved */);
+}
+
+void MemoryTelemetrySampler::RecordSamples(
+    base::TimeTicks time,
+    const ProcessMemoryInformationList& samples,
+    bool resolved) {
+  DCHECK_CURRENTLY_ON(BrowserThread::UI);
+
+  std::vector<Delta> deltas;
+  std::set<base::ProcessId> sampled_pids;
+  for (const ProcessMemoryInformation& info : samples) {
+    MemoryTelemetrySample sample = MakeSample(time, info);
+    sampled_pids.insert(info.pid);
+
+    Delta delta;
+    delta.pid = info.pid;
+    auto it = processes_.find(info.pid);
+    if (it == processes_.end()) {
+      // A process which is not known yet can only come from MemoryDetails.
+      DCHECK(resolved);
+      it = processes_
+               .insert(std::make_pair(info.pid, Process(samples_per_process_)))
+               .first;
+      delta.is_new = true;
+      delta.private_kb = sample.private_kb;
+      delta.shared_kb = sample.shared_kb;
+      delta.swapped_kb = sample.swapped_kb;
+      delta.num_open_fds = sample.num_open_fds;
+    } else {
+      const MemoryTelemetrySample& last = it->second.samples.back();
+      delta.private_kb = static_cast<int64_t>(sample.private_kb) -
+                         static_cast<int64_t>(last.private_kb);
+      delta.shared_kb = static_cast<int64_t>(sample.shared_kb) -
+                        static_cast<int64_t>(last.shared_kb);
+      delta.swapped_kb = static_cast<int64_t>(sample.swapped_kb) -
+                         static_cast<int64_t>(last.swapped_kb);
+      delta.num_open_fds = sample.num_open_fds - last.num_open_fds;
+    }
+
+    Process& process = it->second;
+    if (resolved) {
+      process.process_type = info.process_type;
+      process.renderer_type = info.renderer_type;
+      process.titles = info.titles;
+    }
+    process.samples.push_back(sample);
+
+    if (delta.is_new || delta.private_kb || delta.shared_kb ||
+        delta.swapped_kb || delta.num_open_fds) {
+      deltas.push_back(delta);
+    }
+  }
+
+  std::vector<base::ProcessId> exited;
+  for (auto it = processes_.begin(); it != processes_.end();) {
+    if (sampled_pids.count(it->first)) {
+      ++it;
+      continue;
+    }
+    exited.push_back(it->first);
+    it = processes_.erase(it);
+  }
+
+  if (deltas.empty() && exited.empty())
+    return;
+  for (Observer& observer : observers_)
+    observer.OnMemorySampled(deltas, exited);
+}
+
+void MemoryTelemetrySampler::BrowserChildProcessLaunchedAndConnected(
+    const content::ChildProcessData& data) {
+  needs_resolve_ = true;
+}
+
+void MemoryTelemetrySampler::BrowserChildProcessHostDisconnected(
+    const content::ChildProcessData& data) {
+  needs_resolve_ = true;
+}
+
+void MemoryTelemetrySampler::Observe(
+    int type,
+    const content::NotificationSource& source,
+    const content::NotificationDetails& details) {
+  DCHECK(type == content::NOTIFICATION_RENDERER_PROCESS_CREATED ||
+         type == content::NOTIFICATION_RENDERER_PROCESS_TERMINATED);
+  needs_resolve_ = true;
+}
@@ -0,0 +1,221 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROME_BROWSER_MEMORY_TELEMETRY_SAMPLER_H_
+#define CHROME_BROWSER_MEMORY_TELEMETRY_SAMPLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "base/callback_forward.h"
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/weak_ptr.h"
+#include "base/observer_list.h"
+#include "base/process/process_handle.h"
+#include "base/strings/string16.h"
+#include "base/time/time.h"
+#include "base/timer/timer.h"
+#include "chrome/browser/memory_details.h"
+#include "content/public/browser/browser_child_process_observer.h"
+#include "content/public/browser/notification_observer.h"
+#include "content/public/browser/notification_registrar.h"
+
+namespace base {
+class SequencedTaskRunner;
+}  // namespace base
+
+// The memory use of a process at one point in time. |swapped_kb| is only known
+// on Chrome OS, and on other Linux systems from Linux 4.14 on, which provides
+// /proc/<pid>/smaps_rollup; it is 0 elsewhere.
+struct MemoryTelemetrySample {
+  MemoryTelemetrySample();
+
+  base::TimeTicks time;
+  size_t private_kb;
+  size_t shared_kb;
+  size_t swapped_kb;
+  int num_open_fds;
+};
+
+// The most recent samples of a process, oldest first. Once |capacity| samples
+// are held, each new one replaces the oldest, so the memory used stays fixed
+// however long sampling runs.
+class MemoryTelemetrySeries {
+ public:
+  explicit MemoryTelemetrySeries(size_t capacity);
+  MemoryTelemetrySeries(const MemoryTelemetrySeries& other);
+  ~MemoryTelemetrySeries();
+
+  bool empty() const { return buffer_.empty(); }
+  size_t size() const { return buffer_.size(); }
+  size_t capacity() const { return capacity_; }
+
+  // Access to the samples, with index 0 being the oldest.
+  const MemoryTelemetrySample& operator[](size_t index) const;
+  const MemoryTelemetrySample& back() const { return (*this)[size() - 1]; }
+
+  // Adds a sample at the back, dropping the oldest one if the series is full.
+  void push_back(const MemoryTelemetrySample& sample);
+
+ private:
+  // Ring buffer holding the samples, starting at |head_|. It grows up to
+  // |capacity_| samples and is then overwritten in place.
+  std::vector<MemoryTelemetrySample> buffer_;
+  size_t capacity_;
+  size_t head_;
+};
+
+// Samples the memory of the browser's processes at a regular interval and keeps
+// a time series for each of them.
+//
+// MemoryDetails re-enumerates the processes and works out the type and titles
+// of each of them on every fetch, which takes a trip over the UI, IO and
+// blocking pool threads. The sampler only does so when processes are launched
+// or go away. In between, it only samples the memory of the processes it
+// already knows, in one background task.
+//
+// This class must be used on the UI thread.
+class MemoryTelemetrySampler : public content::BrowserChildProcessObserver,
+                               public content::NotificationObserver {
+ public:
+  // A process being sampled.
+  struct Process {
+    explicit Process(size_t capacity);
+    Process(const Process& other);
+    ~Process();
+
+    // As last resolved by MemoryDetails.
+    int process_type;
+    ProcessMemoryInformation::RendererProcessType renderer_type;
+    std::vector<base::string16> titles;
+
+    MemoryTelemetrySeries samples;
+  };
+
+  // The change in memory use of a process since its previous sample. For a
+  // new process, the change is from zero.
+  struct Delta {
+    Delta();
+
+    base::ProcessId pid;
+    bool is_new;
+    int64_t private_kb;
+    int64_t shared_kb;
+    int64_t swapped_kb;
+    int num_open_fds;
+  };
+
+  class Observer {
+   public:
+    // Called after each round of sampling with the processes whose memory
+    // use changed, including new ones, and the processes which went away.
+    virtual void OnMemorySampled(
+        const std::vector<Delta>& deltas,
+        const std::vector<base::ProcessId>& exited) = 0;
+
+   protected:
+    virtual ~Observer() {}
+  };
+
+  // Called with the processes sampled in a round.
+  using SamplesCallback =
+      base::Callback<void(const ProcessMemoryInformationList& samples)>;
+
+  // Keeps the last |samples_per_process| samples of each process, taken every
+  // |interval| once started.
+  MemoryTelemetrySampler(base::TimeDelta interval, size_t samples_per_process);
+  ~MemoryTelemetrySampler() override;
+
+  void Start();
+  void Stop();
+  bool IsRunning() const { return timer_.IsRunning(); }
+
+  base::TimeDelta interval() const { return interval_; }
+  void SetInterval(base::TimeDelta interval);
+
+  void AddObserver(Observer* observer);
+  void RemoveObserver(Observer* observer);
+
+  // The processes being sampled.
+  const std::map<base::ProcessId, Process>& processes() const {
+    return processes_;
+  }
+
+  // Records |samples| as a round of sampling taken at |time|, as if they had
+  // come from MemoryDetails if |resolved|, or from sampling the known
+  // processes otherwise.
+  void RecordSamplesForTesting(base::TimeTicks time,
+                               const ProcessMemoryInformationList& samples,
+                               bool resolved);
+
+  // Starts a round of sampling now, as the timer does.
+  void SampleForTesting();
+
+ protected:
+  // Resolves the processes of the browser through MemoryDetails and runs
+  // |callback| with them. Virtual method so tests can avoid MemoryDetails.
+  virtual void ResolveProcesses(const SamplesCallback& callback);
+
+  // Samples the memory of |pids| in the background and runs |callback| with
+  // those which are still around. Virtual method so tests can avoid /proc.
+  virtual void SampleKnownProcesses(const std::vector<base::ProcessId>& pids,
+                                    const SamplesCallback& callback);
+
+ private:
+  class Fetcher;
+
+  // Starts a round of sampling.
+  void Sample();
+
+  // Called with the processes resolved by a Fetcher.
+  void OnDetailsAvailable(const ProcessMemoryInformationList& samples);
+
+  // Called with the known processes sampled in the background.
+  void OnProcessesSampled(const ProcessMemoryInformationList& samples);
+
+  // Appends |samples| to the series of their processes and notifies the
+  // observers. Processes without a sample are taken to have gone away. If
+  // |resolved|, the type and titles of the processes are updated as well.
+  void RecordSamples(base::TimeTicks time,
+                     const ProcessMemoryInformationList& samples,
+                     bool resolved);
+
+  // content::BrowserChildProcessObserver:
+  void BrowserChildProcessLaunchedAndConnected(
+      const content::ChildProcessData& data) override;
+  void BrowserChildProcessHostDisconnected(
+      const content::ChildProcessData& data) override;
+
+  // content::NotificationObserver:
+  void Observe(int type,
+               const content::NotificationSource& source,
+               const content::NotificationDetails& details) override;
+
+  base::TimeDelta interval_;
+  const size_t samples_per_process_;
+  base::RepeatingTimer timer_;
+
+  std::map<base::ProcessId, Process> processes_;
+
+  // Whether processes were launched or went away since they were last
+  // resolved.
+  bool needs_resolve_;
+
+  // Whether a round of sampling is under way.
+  bool sampling_;
+
+  scoped_refptr<base::SequencedTaskRunner> task_runner_;
+  content::NotificationRegistrar registrar_;
+  base::ObserverList<Observer> observers_;
+
+  base::WeakPtrFactory<MemoryTelemetrySampler> weak_ptr_factory_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryTelemetrySampler);
+};
+
+#endif  // CHROME_BROWSER_MEMORY_TELEMETRY_SAMPLER_H_
@@ -0,0 +1,265 @@
+// Copyright 2017 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chrome/browser/memory_telemetry_sampler.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "base/strings/utf_string_conversions.h"
+#include "base/time/time.h"
+#include "content/public/browser/browser_child_process_observer.h"
+#include "content/public/browser/child_process_data.h"
+#include "content/public/common/process_type.h"
+#include "content/public/test/test_browser_thread_bundle.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+const size_t kSamplesPerProcess = 3;
+
+ProcessMemoryInformation MakeInfo(base::ProcessId pid,
+                                  size_t private_kb,
+                                  int num_open_fds) {
+  ProcessMemoryInformation info;
+  info.pid = pid;
+  info.process_type = content::PROCESS_TYPE_RENDERER;
+  info.working_set.priv = private_kb;
+  info.num_open_fds = num_open_fds;
+  return info;
+}
+
+MemoryTelemetrySample MakeSample(size_t private_kb) {
+  MemoryTelemetrySample sample;
+  sample.private_kb = private_kb;
+  return sample;
+}
+
+// Leaves each round of sampling to the test instead of resolving or sampling
+// the processes of the browser.
+class TestMemoryTelemetrySampler : public MemoryTelemetrySampler {
+ public:
+  TestMemoryTelemetrySampler()
+      : MemoryTelemetrySampler(base::TimeDelta::FromSeconds(1),
+                               kSamplesPerProcess),
+        resolve_count_(0),
+        sample_count_(0) {}
+  ~TestMemoryTelemetrySampler() override {}
+
+  int resolve_count() const { return resolve_count_; }
+  int sample_count() const { return sample_count_; }
+
+  // Answers the last round which was started with |samples|.
+  void FinishRound(const ProcessMemoryInformationList& samples) {
+    callback_.Run(samples);
+  }
+
+ protected:
+  // MemoryTelemetrySampler:
+  void ResolveProcesses(const SamplesCallback& callback) override {
+    resolve_count_++;
+    callback_ = callback;
+  }
+
+  void SampleKnownProcesses(const std::vector<base::ProcessId>& pids,
+                            const SamplesCallback& callback) override {
+    sample_count_++;
+    callback_ = callback;
+  }
+
+ private:
+  int resolve_count_;
+  int sample_count_;
+  SamplesCallback callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestMemoryTelemetrySampler);
+};
+
+}  // namespace
+
+class MemoryTelemetrySamplerTest : public testing::Test,
+                                   public MemoryTelemetrySampler::Observer {
+ public:
+  MemoryTelemetrySamplerTest() { sampler_.AddObserver(this); }
+  ~MemoryTelemetrySamplerTest() override { sampler_.RemoveObserver(this); }
+
+  // MemoryTelemetrySampler::Observer:
+  void OnMemorySampled(const std::vector<MemoryTelemetrySampler::Delta>& deltas,
+                       const std::vector<base::ProcessId>& exited) override {
+    notifications_++;
+    deltas_ = deltas;
+    exited_ = exited;
+  }
+
+  void Record(const ProcessMemoryInformationList& samples, bool resolved) {
+    now_ += base::TimeDelta::FromSeconds(1);
+    sampler_.RecordSamplesForTesting(now_, samples, resolved);
+  }
+
+ protected:
+  content::TestBrowserThreadBundle thread_bundle_;
+  TestMemoryTelemetrySampler sampler_;
+
+  int notifications_ = 0;
+  std::vector<MemoryTelemetrySampler::Delta> deltas_;
+  std::vector<base::ProcessId> exited_;
+
+ private:
+  base::TimeTicks now_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryTelemetrySamplerTest);
+};
+
+TEST(MemoryTelemetrySeriesTest, KeepsMostRecentSamples) {
+  MemoryTelemetrySeries series(3);
+  EXPECT_TRUE(series.empty());
+
+  series.push_back(MakeSample(1));
+  series.push_back(MakeSample(2));
+  ASSERT_EQ(2U, series.size());
+  EXPECT_EQ(1U, series[0].private_kb);
+  EXPECT_EQ(2U, series.back().private_kb);
+
+  for (size_t i = 3; i <= 7; ++i)
+    series.push_back(MakeSample(i));
+  ASSERT_EQ(3U, series.size());
+  EXPECT_EQ(5U, series[0].private_kb);
+  EXPECT_EQ(6U, series[1].private_kb);
+  EXPECT_EQ(7U, series.back().private_kb);
+}
+
+TEST_F(MemoryTelemetrySamplerTest, ReportsNewProcessesInFull) {
+  ProcessMemoryInformation renderer = MakeInfo(10, 1000, 20);
+  renderer.titles.push_back(base::ASCIIToUTF16("Title"));
+  Record({renderer, MakeInfo(11, 2000, 30)}, true /* resolved */);
+
+  EXPECT_EQ(1, notifications_);
+  ASSERT_EQ(2U, deltas_.size());
+  EXPECT_EQ(10, deltas_[0].pid);
+  EXPECT_TRUE(deltas_[0].is_new);
+  EXPECT_EQ(1000, deltas_[0].private_kb);
+  EXPECT_EQ(20, deltas_[0].num_open_fds);
+  EXPECT_EQ(11, deltas_[1].pid);
+  EXPECT_TRUE(exited_.empty());
+
+  ASSERT_EQ(2U, sampler_.processes().size());
+  const MemoryTelemetrySampler::Process& process =
+      sampler_.processes().at(10);
+  EXPECT_EQ(content::PROCESS_TYPE_RENDERER, process.process_type);
+  ASSERT_EQ(1U, process.titles.size());
+  EXPECT_EQ(1U, process.samples.size());
+}
+
+TEST_F(MemoryTelemetrySamplerTest, ReportsOnlyChanges) {
+  Record({MakeInfo(10, 1000, 20), MakeInfo(11, 2000, 30)}, true);
+
+  // Sampling the known processes again does not change what was resolved.
+  ProcessMemoryInformation renderer = MakeInfo(10, 1500, 18);
+  renderer.process_type = content::PROCESS_TYPE_UNKNOWN;
+  Record({renderer, MakeInfo(11, 2000, 30)}, false /* resolved */);
+
+  EXPECT_EQ(2, notifications_);
+  ASSERT_EQ(1U, deltas_.size());
+  EXPECT_EQ(10, deltas_[0].pid);
+  EXPECT_FALSE(deltas_[0].is_new);
+  EXPECT_EQ(500, deltas_[0].private_kb);
+  EXPECT_EQ(-2, deltas_[0].num_open_fds);
+  EXPECT_EQ(content::PROCESS_TYPE_RENDERER,
+            sampler_.processes().at(10).process_type);
+  EXPECT_EQ(2U, sampler_.processes().at(10).samples.size());
+
+  // Nothing changed, so the observers are not bothered.
+  Record({renderer, MakeInfo(11, 2000, 30)}, false);
+  EXPECT_EQ(2, notifications_);
+}
+
+TEST_F(MemoryTelemetrySamplerTest, ReportsExitedProcesses) {
+  Record({MakeInfo(10, 1000, 20), MakeInfo(11, 2000, 30)}, true);
+  Record({MakeInfo(10, 1000, 20)}, false);
+
+  EXPECT_EQ(2, notifications_);
+  EXPECT_TRUE(deltas_.empty());
+  EXPECT_EQ(std::vector<base::ProcessId>({11}), exited_);
+  EXPECT_EQ(1U, sampler_.processes().size());
+}
+
+TEST_F(MemoryTelemetrySamplerTest, SeriesHaveFixedSize) {
+  for (size_t i = 1; i <= 2 * kSamplesPerProcess; ++i)
+    Record({MakeInfo(10, i, 20)}, i == 1);
+
+  const MemoryTelemetrySeries& samples = sampler_.processes().at(10).samples;
+  ASSERT_EQ(kSamplesPerProcess, samples.size());
+  EXPECT_EQ(kSamplesPerProcess + 1, samples[0].private_kb);
+  EXPECT_EQ(2 * kSamplesPerProcess, samples.back().private_kb);
+  EXPECT_LT(samples[0].time, samples.back().time);
+}
+
+TEST_F(MemoryTelemetrySamplerTest, SetInterval) {
+  EXPECT_FALSE(sampler_.IsRunning());
+  sampler_.Start();
+  EXPECT_TRUE(sampler_.IsRunning());
+
+  sampler_.SetInterval(base::TimeDelta::FromSeconds(5));
+  EXPECT_EQ(base::TimeDelta::FromSeconds(5), sampler_.interval());
+  EXPECT_TRUE(sampler_.IsRunning());
+
+  sampler_.Stop();
+  EXPECT_FALSE(sampler_.IsRunning());
+}
+
+TEST_F(MemoryTelemetrySamplerTest, ResolvesOnlyWhenProcessesChange) {
+  sampler_.Start();
+  sampler_.SampleForTesting();
+  EXPECT_EQ(1, sampler_.resolve_count());
+  sampler_.FinishRound({MakeInfo(10, 1000, 20)});
+  EXPECT_EQ(1, notifications_);
+
+  // The known processes are sampled without resolving them again.
+  sampler_.SampleForTesting();
+  sampler_.SampleForTesting();
+  EXPECT_EQ(1, sampler_.sample_count());
+  sampler_.FinishRound({MakeInfo(10, 1500, 20)});
+  EXPECT_EQ(2, notifications_);
+  EXPECT_EQ(1, sampler_.resolve_count());
+
+  // A launch makes the next round resolve the processes.
+  content::BrowserChildProcessObserver* observer = &sampler_;
+  observer->BrowserChildProcessLaunchedAndConnected(
+      content::ChildProcessData(content::PROCESS_TYPE_UTILITY));
+  sampler_.SampleForTesting();
+  EXPECT_EQ(2, sampler_.resolve_count());
+  EXPECT_EQ(1, sampler_.sample_count());
+  sampler_.FinishRound({MakeInfo(10, 1500, 20), MakeInfo(11, 2000, 30)});
+  EXPECT_EQ(2U, sampler_.processes().size());
+  sampler_.Stop();
+}
+
+TEST_F(MemoryTelemetrySamplerTest, ResolvesAgainAfterStopDuringResolve) {
+  sampler_.Start();
+  sampler_.SampleForTesting();
+  sampler_.FinishRound({MakeInfo(10, 1000, 20)});
+
+  content::BrowserChildProcessObserver* observer = &sampler_;
+  observer->BrowserChildProcessLaunchedAndConnected(
+      content::ChildProcessData(content::PROCESS_TYPE_UTILITY));
+  sampler_.SampleForTesting();
+  EXPECT_EQ(2, sampler_.resolve_count());
+
+  // Stopping drops the result of the resolve under way.
+  sampler_.Stop();
+  sampler_.FinishRound({MakeInfo(10, 1000, 20), MakeInfo(11, 2000, 30)});
+  EXPECT_EQ(1, notifications_);
+  EXPECT_EQ(1U, sampler_.processes().size());
+
+  // So the first round after a restart resolves the processes again.
+  sampler_.Start();
+  sampler_.SampleForTesting();
+  EXPECT_EQ(3, sampler_.resolve_count());
+  EXPECT_EQ(0, sampler_.sample_count());
+  sampler_.FinishRound({MakeInfo(10, 1000, 20), MakeInfo(11, 2000, 30)});
+  EXPECT_EQ(2U, sampler_.processes().size());
+  sampler_.Stop();
+}